@@ -0,0 +1,53 @@
+/** Search work per solve of the IBFS solvers, with and without global
+ * relabels
+ *
+ * Usage: arc-scans [width] [k] [solves]
+ *
+ * Solves a width x width grid energy with cliques of size k, with new
+ * random unaries each time, and prints the arc scans, relabels, gap nodes
+ * and global relabels per solve.
+ */
+#include "bench-util.hpp"
+
+#include <iostream>
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+
+int main(int argc, char** argv) {
+    const int width = IntArg(argc, argv, 1, 200);
+    const int k = IntArg(argc, argv, 2, 3);
+    const int solves = IntArg(argc, argv, 3, 10);
+    const int n = width*width;
+    std::cout << "alg\tglobalRelabelFreq\tarcScans\trelabels\tgapNodes\tglobalRelabels\ttime\n";
+    for (Alg alg : { Alg::bidirectional, Alg::source }) {
+        for (double freq : { 0.0, 0.5, 1.0, 2.0 }) {
+            std::mt19937 rng(0);
+            SubmodularIBFSParams params(alg);
+            params.pairwiseFastPath = false;
+            params.globalRelabelFreq = freq;
+            SubmodularIBFS ibfs(params);
+            ibfs.AddNode(n);
+            AddGridCliques(ibfs, width, k, rng);
+            SoSGraph::SearchStats total;
+            double time = 0;
+            for (int s = 0; s < solves; ++s) {
+                SetRandomUnaries(ibfs, n, 20*k, rng);
+                auto start = Clock::now();
+                ibfs.Solve();
+                time += Seconds(start);
+                const auto& stats = *ibfs.SearchStats();
+                total.arcScans += stats.arcScans;
+                total.relabels += stats.relabels;
+                total.gapNodes += stats.gapNodes;
+                total.globalRelabels += stats.globalRelabels;
+            }
+            std::cout << (alg == Alg::bidirectional ? "bidirectional" : "source")
+                << "\t" << freq
+                << "\t" << total.arcScans / solves
+                << "\t" << total.relabels / solves
+                << "\t" << total.gapNodes / solves
+                << "\t" << double(total.globalRelabels) / solves
+                << "\t" << time / solves << "\n";
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef _BENCH_UTIL_HPP_
+#define _BENCH_UTIL_HPP_
+
+/** \file bench-util.hpp
+ * Grid energies and timing for the benchmark drivers
+ */
+
+#include "submodular-ibfs.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+typedef std::chrono::duration<double> Duration;
+typedef std::chrono::steady_clock Clock;
+
+/** Integer argument i of the command line, or def if not given */
+inline int IntArg(int argc, char** argv, int i, int def) {
+    return (i < argc) ? std::atoi(argv[i]) : def;
+}
+
+/** Add cliques of size k over every run of k consecutive nodes in a row or
+ * column of a width x width grid, with the energy of a cut through a
+ * Potts-like clique: weight times the product of the number of nodes on
+ * each side, times scale. Grid position i is node ids[i] if ids is given
+ */
+inline void AddGridCliques(SubmodularIBFS& ibfs, int width, int k, std::mt19937& rng, REAL scale = 1,
+        const std::vector<SubmodularIBFS::NodeId>* ids = nullptr) {
+    std::uniform_int_distribution<int> weight(1, 10);
+    std::vector<SubmodularIBFS::NodeId> nodes(k);
+    std::vector<REAL> table(1 << k);
+    for (int dir = 0; dir < 2; ++dir) {
+        for (int y = 0; y < width; ++y) {
+            for (int x = 0; x + k <= width; ++x) {
+                for (int j = 0; j < k; ++j)
+                    nodes[j] = dir ? (x + j)*width + y : y*width + x + j;
+                if (ids) {
+                    for (auto& i : nodes)
+                        i = (*ids)[i];
+                }
+                const int w = weight(rng);
+                for (uint32_t a = 0; a < table.size(); ++a) {
+                    const int in = __builtin_popcount(a);
+                    table[a] = scale * w * in * (k - in);
+                }
+                ibfs.AddClique(nodes, table);
+            }
+        }
+    }
+}
+
+/** Replace the unaries of the n nodes by random ones in [0, range] */
+inline void SetRandomUnaries(SubmodularIBFS& ibfs, int n, REAL range, std::mt19937& rng) {
+    std::uniform_int_distribution<REAL> cost(0, range);
+    ibfs.ClearUnaries();
+    ibfs.AddConstantTerm(-ibfs.GetConstantTerm());
+    for (int i = 0; i < n; ++i)
+        ibfs.AddUnaryTerm(i, cost(rng), cost(rng));
+}
+
+/** Seconds since start */
+inline double Seconds(Clock::time_point start) {
+    return Duration{ Clock::now() - start }.count();
+}
+
+#endif
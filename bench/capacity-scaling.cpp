@@ -0,0 +1,87 @@
+/** Time per solve of BidirectionalIBFS with and without capacity scaling,
+ * by the range of the capacities
+ *
+ * Usage: capacity-scaling [width] [k] [solves]
+ *
+ * Solves a width x width grid energy with cliques of size k, with the
+ * clique weights and unaries scaled by growing factors, and then a random
+ * energy on as many nodes whose capacities are spread over nine orders of
+ * magnitude. Prints the time per solve and arc scans with capacityScaling
+ * off and on.
+ */
+#include "bench-util.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+
+// Random cliques of size k with weights in [1, 1e9], log-uniformly
+static void AddSpreadCliques(SubmodularIBFS& ibfs, int n, int k, int count, std::mt19937& rng) {
+    std::uniform_real_distribution<double> logWeight(0, 9*std::log(10.0));
+    std::vector<SubmodularIBFS::NodeId> nodes;
+    std::vector<REAL> table(1 << k);
+    for (int c = 0; c < count; ++c) {
+        nodes.clear();
+        while (int(nodes.size()) < k) {
+            SubmodularIBFS::NodeId i = rng() % n;
+            if (std::find(nodes.begin(), nodes.end(), i) == nodes.end())
+                nodes.push_back(i);
+        }
+        const REAL w = REAL(std::exp(logWeight(rng)));
+        for (uint32_t a = 0; a < table.size(); ++a) {
+            const int in = __builtin_popcount(a);
+            table[a] = w * in * (k - in);
+        }
+        ibfs.AddClique(nodes, table);
+    }
+}
+
+static void SetSpreadUnaries(SubmodularIBFS& ibfs, int n, std::mt19937& rng) {
+    std::uniform_real_distribution<double> logCost(0, 9*std::log(10.0));
+    ibfs.ClearUnaries();
+    ibfs.AddConstantTerm(-ibfs.GetConstantTerm());
+    for (int i = 0; i < n; ++i)
+        ibfs.AddUnaryTerm(i, REAL(std::exp(logCost(rng))), REAL(std::exp(logCost(rng))));
+}
+
+int main(int argc, char** argv) {
+    const int width = IntArg(argc, argv, 1, 200);
+    const int k = IntArg(argc, argv, 2, 3);
+    const int solves = IntArg(argc, argv, 3, 5);
+    const int n = width*width;
+    std::cout << "graph\tscale\tcapacityScaling\ttime\tarcScans\tenergy\n";
+    // scale 0 stands for the random energy with spread capacities
+    for (REAL scale : { REAL(1), REAL(1000), REAL(1000000), REAL(0) }) {
+        for (bool scaling : { false, true }) {
+            std::mt19937 rng(0);
+            SubmodularIBFSParams params(Alg::bidirectional);
+            params.pairwiseFastPath = false;
+            params.capacityScaling = scaling;
+            SubmodularIBFS ibfs(params);
+            ibfs.AddNode(n);
+            if (scale > 0)
+                AddGridCliques(ibfs, width, k, rng, scale);
+            else
+                AddSpreadCliques(ibfs, n, k, 3*n, rng);
+            double time = 0;
+            size_t arcScans = 0;
+            REAL energy = 0;
+            for (int s = 0; s < solves; ++s) {
+                if (scale > 0)
+                    SetRandomUnaries(ibfs, n, 20*k*scale, rng);
+                else
+                    SetSpreadUnaries(ibfs, n, rng);
+                auto start = Clock::now();
+                ibfs.Solve();
+                time += Seconds(start);
+                arcScans += ibfs.SearchStats()->arcScans;
+                energy += ibfs.ComputeEnergy();
+            }
+            std::cout << (scale > 0 ? "grid" : "spread") << "\t" << scale
+                << "\t" << scaling << "\t" << time / solves
+                << "\t" << arcScans / solves << "\t" << energy << "\n";
+        }
+    }
+}
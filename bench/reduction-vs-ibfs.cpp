@@ -0,0 +1,49 @@
+/** Time per solve of PairwiseReduction and the IBFS solvers, by clique size
+ *
+ * Usage: reduction-vs-ibfs [width] [maxK] [solves]
+ *
+ * For each clique size k from 2 to maxK, solves a width x width grid
+ * energy with cliques of size k, with new random unaries each time, and
+ * prints the time per solve of each solver. Cliques larger than 3 don't
+ * always reduce, and then PairwiseReduction falls back to IBFS.
+ */
+#include "bench-util.hpp"
+
+#include <iostream>
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+
+int main(int argc, char** argv) {
+    const int width = IntArg(argc, argv, 1, 200);
+    const int maxK = IntArg(argc, argv, 2, 4);
+    const int solves = IntArg(argc, argv, 3, 10);
+    const int n = width*width;
+    const std::pair<Alg, const char*> algs[] = {
+        { Alg::reduction, "reduction" },
+        { Alg::bidirectional, "bidirectional" },
+        { Alg::source, "source" }
+    };
+    std::cout << "k\talg\ttime\tenergy\n";
+    for (int k = 2; k <= maxK; ++k) {
+        for (const auto& alg : algs) {
+            // Same energies for every solver
+            std::mt19937 rng(k);
+            SubmodularIBFSParams params(alg.first);
+            params.pairwiseFastPath = false;
+            SubmodularIBFS ibfs(params);
+            ibfs.AddNode(n);
+            AddGridCliques(ibfs, width, k, rng);
+            double time = 0;
+            REAL energy = 0;
+            for (int s = 0; s < solves; ++s) {
+                SetRandomUnaries(ibfs, n, 20*k, rng);
+                auto start = Clock::now();
+                ibfs.Solve();
+                time += Seconds(start);
+                energy += ibfs.ComputeEnergy();
+            }
+            std::cout << k << "\t" << alg.second << "\t" << time / solves
+                << "\t" << energy << "\n";
+        }
+    }
+}
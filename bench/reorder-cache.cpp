@@ -0,0 +1,116 @@
+/** Cache misses per solve with each node order
+ *
+ * Usage: reorder-cache [width] [k] [solves]
+ *
+ * Solves a width x width grid energy with cliques of size k, whose node ids
+ * are shuffled so the input order has no locality, and prints the hardware
+ * cache misses (from perf_event_open, on Linux, where permitted) and the
+ * time per solve for each SubmodularIBFSParams::nodeOrder. Misses are
+ * printed as -1 where the counter is not available.
+ */
+#include "bench-util.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+typedef SoSGraph::NodeOrder NodeOrder;
+
+/** Hardware cache miss counter of this thread, in user space */
+class CacheMisses {
+    public:
+        CacheMisses() {
+#ifdef __linux__
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            m_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+        }
+        ~CacheMisses() {
+#ifdef __linux__
+            if (m_fd >= 0)
+                close(m_fd);
+#endif
+        }
+        bool Available() const { return m_fd >= 0; }
+        void Start() {
+#ifdef __linux__
+            if (m_fd >= 0) {
+                ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+#endif
+        }
+        // Misses since Start, or -1 if the counter is not available
+        long long Stop() {
+            long long count = -1;
+#ifdef __linux__
+            if (m_fd >= 0) {
+                ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(m_fd, &count, sizeof(count)) != sizeof(count))
+                    count = -1;
+            }
+#endif
+            return count;
+        }
+    private:
+        int m_fd = -1;
+};
+
+int main(int argc, char** argv) {
+    const int width = IntArg(argc, argv, 1, 300);
+    const int k = IntArg(argc, argv, 2, 3);
+    const int solves = IntArg(argc, argv, 3, 5);
+    const int n = width*width;
+    std::vector<SubmodularIBFS::NodeId> ids(n);
+    std::iota(ids.begin(), ids.end(), 0);
+    std::shuffle(ids.begin(), ids.end(), std::mt19937(1));
+    CacheMisses misses;
+    if (!misses.Available())
+        std::cerr << "cache miss counter not available, printing -1\n";
+    std::cout << "nodeOrder\tcacheMisses\ttime\tenergy\n";
+    const char* names[] = { "none", "bfs", "rcm" };
+    int o = 0;
+    for (NodeOrder order : { NodeOrder::none, NodeOrder::bfs, NodeOrder::rcm }) {
+        std::mt19937 rng(0);
+        SubmodularIBFSParams params(Alg::bidirectional);
+        params.pairwiseFastPath = false;
+        params.nodeOrder = order;
+        SubmodularIBFS ibfs(params);
+        ibfs.AddNode(n);
+        AddGridCliques(ibfs, width, k, rng, 1, &ids);
+        // The first solve renumbers the graph, so leave it out
+        SetRandomUnaries(ibfs, n, 20*k, rng);
+        ibfs.Solve();
+        long long count = 0;
+        double time = 0;
+        REAL energy = 0;
+        for (int s = 0; s < solves; ++s) {
+            SetRandomUnaries(ibfs, n, 20*k, rng);
+            auto start = Clock::now();
+            misses.Start();
+            ibfs.Solve();
+            const long long m = misses.Stop();
+            time += Seconds(start);
+            count = (m < 0 || count < 0) ? -1 : count + m;
+            energy += ibfs.ComputeEnergy();
+        }
+        std::cout << names[o++] << "\t" << (count < 0 ? -1 : count / solves)
+            << "\t" << time / solves << "\t" << energy << "\n";
+    }
+}
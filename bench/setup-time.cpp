@@ -0,0 +1,46 @@
+/** Setup time per solve with and without the fused setup sweep
+ *
+ * Usage: setup-time [width] [k] [solves] [threads]
+ *
+ * Solves a width x width grid energy with cliques of size k, with new
+ * random unaries each time, and prints the time SetupFlow takes per solve
+ * (SubmodularIBFS::SetupStats) and the total time per solve, with
+ * fusedSetup off and on.
+ */
+#include "bench-util.hpp"
+
+#include <iostream>
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+
+int main(int argc, char** argv) {
+    const int width = IntArg(argc, argv, 1, 300);
+    const int k = IntArg(argc, argv, 2, 3);
+    const int solves = IntArg(argc, argv, 3, 10);
+    const int threads = IntArg(argc, argv, 4, 0);
+    const int n = width*width;
+    std::cout << "fusedSetup\tcliquePasses\tsetupTime\tsolveTime\n";
+    double setupTime[2];
+    for (int fused = 0; fused < 2; ++fused) {
+        std::mt19937 rng(0);
+        SubmodularIBFSParams params(Alg::bidirectional);
+        params.pairwiseFastPath = false;
+        params.fusedSetup = fused;
+        params.numThreads = threads;
+        SubmodularIBFS ibfs(params);
+        ibfs.AddNode(n);
+        AddGridCliques(ibfs, width, k, rng);
+        double setup = 0, time = 0;
+        for (int s = 0; s < solves; ++s) {
+            SetRandomUnaries(ibfs, n, 20*k, rng);
+            auto start = Clock::now();
+            ibfs.Solve();
+            time += Seconds(start);
+            setup += ibfs.SetupStats()->time;
+        }
+        setupTime[fused] = setup / solves;
+        std::cout << fused << "\t" << ibfs.SetupStats()->cliquePasses
+            << "\t" << setup / solves << "\t" << time / solves << "\n";
+    }
+    std::cout << "saved per solve: " << setupTime[0] - setupTime[1] << "\n";
+}
@@ -8,6 +8,8 @@
 #include <assert.h>
 #include <stdexcept>
 #include <string>
+#include <atomic>
+#include <chrono>
 
 #ifndef DNO_ASSERT
 #define ASSERT(cond) do { if (!(cond)) { throw std::logic_error((std::string("Assertion failure at " __FILE__ ":")+std::to_string(__LINE__)+std::string(" -- " #cond)).c_str() ); }} while(0)
@@ -17,4 +19,60 @@
 
 typedef int64_t REAL;
 
+/** Thrown by SolveToken when a solve runs out of time or is cancelled */
+class SolveInterrupted : public std::runtime_error {
+    public:
+        SolveInterrupted() : std::runtime_error("Solve interrupted") { }
+};
+
+/** A deadline and cancellation flag for long solves
+ *
+ * Solvers poll the token in their main loops, and throw SolveInterrupted
+ * once Cancel() has been called or the deadline has passed. Cancel() may be
+ * called from any thread while a solve runs.
+ */
+class SolveToken {
+    public:
+        typedef std::chrono::steady_clock Clock;
+
+        SolveToken()
+            : m_deadline(Clock::time_point::max()),
+            m_cancelled(false)
+        { }
+
+        void SetDeadline(Clock::time_point deadline) { m_deadline = deadline; }
+        void SetTimeout(double seconds) {
+            m_deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(seconds));
+        }
+        void Cancel() { m_cancelled.store(true, std::memory_order_relaxed); }
+
+        bool Expired() const {
+            return m_cancelled.load(std::memory_order_relaxed)
+                || Clock::now() >= m_deadline;
+        }
+        /** Throw SolveInterrupted if expired */
+        void Check() const {
+            if (Expired())
+                throw SolveInterrupted();
+        }
+        /** As Check, but only once every pollInterval calls, for use in
+         * inner loops. The calls are counted down in countdown, which each
+         * polling thread keeps for itself, so that the token is only read
+         * when it reaches 0
+         */
+        void Poll(unsigned& countdown) const {
+            if (countdown == 0) {
+                countdown = pollInterval;
+                Check();
+            }
+            countdown--;
+        }
+
+    private:
+        static const unsigned pollInterval = 1024;
+        Clock::time_point m_deadline;
+        std::atomic<bool> m_cancelled;
+};
+
 #endif
@@ -11,10 +11,26 @@ class FlowSolver {
         FlowSolver() = default;
         virtual ~FlowSolver() { }
 
-        static std::unique_ptr<FlowSolver> GetSolver(const SubmodularIBFSParams& params);
+        /** Construct the solver selected by params for the given graph.
+         *
+         * If params.pairwiseFastPath is set and every clique in the graph
+         * is pairwise, returns a PairwiseBK solver regardless of params.alg
+         */
+        static std::unique_ptr<FlowSolver> GetSolver(const SubmodularIBFSParams& params, const SoSGraph& graph);
 
         virtual void Solve(SubmodularIBFS* energy) = 0;
 
+    protected:
+        // Throw SolveInterrupted if the token of the current solve expired
+        void Poll() const {
+            if (m_interrupt)
+                m_interrupt->Poll(m_poll_countdown);
+        }
+
+        const SolveToken* m_interrupt = nullptr;
+        // Calls to Poll left until the token is checked
+        mutable unsigned m_poll_countdown = 0;
+
     private:
         // Make non-copyable, non-movable
         FlowSolver(const FlowSolver&) = delete;
@@ -37,11 +53,11 @@ class BidirectionalIBFS : public FlowSolver {
         // Typedefs
         typedef SoSGraph::NodeId NodeId;
         typedef SoSGraph::CliqueId CliqueId;
-        typedef SoSGraph::Node Node;
         typedef SoSGraph::NodeState NodeState;
         typedef SoSGraph::NeighborList NeighborList;
         typedef SoSGraph::ArcIterator ArcIterator;
-        typedef SoSGraph::NodeQueue NodeQueue;
+        typedef SoSGraph::ArcIdx ArcIdx;
+        typedef SoSGraph::NodeLayers NodeLayers;
         typedef SoSGraph::OrphanList OrphanList;
         typedef SoSGraph::CliqueVec CliqueVec;
 
@@ -53,6 +69,17 @@ class BidirectionalIBFS : public FlowSolver {
         void RemoveFromLayer(NodeId i);
         void AddToLayer(NodeId i);
         void AdvanceSearchNode();
+        // Drop all nodes of a tree beyond the empty layer d
+        void Gap(bool source, int d);
+        // Recompute the distances of a tree by BFS from its terminal
+        void GlobalRelabel(bool source);
+        // Grow both trees in parallel until they meet, and set up IBFS()
+        // to continue with the next layer. With m_concurrent_initial_trees, layer d
+        // of both trees is found at once, each on its own threads
+        void GrowInitialLayers();
+        // Whether an arc has residual capacity at least m_delta
+        bool Admissible(const ArcIterator& arc, bool forwardArc);
+        bool Admissible(const SoSGraph::IBFSEnergyTableClique& c, size_t u_idx, size_t v_idx) const;
 
         void IBFSInit();
 
@@ -61,18 +88,33 @@ class BidirectionalIBFS : public FlowSolver {
         SoSGraph* m_graph;
         SubmodularIBFS* m_energy;
         // Layers store vertices by distance.
-        std::vector<NodeQueue> m_source_layers;
-        std::vector<NodeQueue> m_sink_layers;
+        NodeLayers m_source_layers;
+        NodeLayers m_sink_layers;
         OrphanList m_source_orphans;
         OrphanList m_sink_orphans;
         int m_source_tree_d;
         int m_sink_tree_d;
-        typedef typename NodeQueue::iterator queue_iterator;
-        queue_iterator m_search_node_iter;
-        queue_iterator m_search_node_end;
+        NodeId m_search_node;
         ArcIterator m_search_arc;
         ArcIterator m_search_arc_end;
         bool m_forward_search;
+        std::vector<NodeId> m_relabel_queue;
+        // Number of arcs, and arcs scanned by relabels since the last
+        // global relabel
+        size_t m_num_arcs;
+        size_t m_relabel_work;
+        double m_global_relabel_freq;
+        bool m_initial_search;
+        bool m_concurrent_initial_trees;
+        int m_num_threads;
+        SoSGraph::Layer m_source_next;
+        SoSGraph::Layer m_sink_next;
+        // Threads for the layers of the source and sink trees when they
+        // grow concurrently, since the shared pool runs the trees themselves
+        WorkerPool m_tree_pools[2];
+        // Capacity scaling threshold: only arcs with residual capacity at
+        // least m_delta are in the trees
+        REAL m_delta = 1;
 
         // Statistics
 
@@ -81,8 +123,22 @@ class BidirectionalIBFS : public FlowSolver {
         double m_augmentTime = 0;
         double m_adoptTime = 0;
         size_t m_num_clique_pushes = 0;
+        SoSGraph::SearchStats m_search_stats;
 };
 
+inline bool BidirectionalIBFS::Admissible(const ArcIterator& arc, bool forwardArc) {
+    if (m_delta <= 1)
+        return m_graph->NonzeroCap(arc, forwardArc);
+    return m_graph->ResCap(arc, forwardArc) >= m_delta;
+}
+
+inline bool BidirectionalIBFS::Admissible(const SoSGraph::IBFSEnergyTableClique& c,
+        size_t u_idx, size_t v_idx) const {
+    if (m_delta <= 1)
+        return c.NonzeroCapacity(u_idx, v_idx);
+    return c.ExchangeCapacity(u_idx, v_idx) >= m_delta;
+}
+
 
 class SourceIBFS : public FlowSolver {
     public:
@@ -98,11 +154,11 @@ class SourceIBFS : public FlowSolver {
         // Typedefs
         typedef SoSGraph::NodeId NodeId;
         typedef SoSGraph::CliqueId CliqueId;
-        typedef SoSGraph::Node Node;
         typedef SoSGraph::NodeState NodeState;
         typedef SoSGraph::NeighborList NeighborList;
         typedef SoSGraph::ArcIterator ArcIterator;
-        typedef SoSGraph::NodeQueue NodeQueue;
+        typedef SoSGraph::ArcIdx ArcIdx;
+        typedef SoSGraph::NodeLayers NodeLayers;
         typedef SoSGraph::OrphanList OrphanList;
         typedef SoSGraph::CliqueVec CliqueVec;
 
@@ -114,6 +170,13 @@ class SourceIBFS : public FlowSolver {
         void RemoveFromLayer(NodeId i);
         void AddToLayer(NodeId i);
         void AdvanceSearchNode();
+        // Drop all nodes beyond the empty layer d
+        void Gap(int d);
+        // Recompute the distances by BFS from the source
+        void GlobalRelabel();
+        // Grow the tree in parallel until it reaches a sink node, and set up
+        // IBFS() to continue with the next layer
+        void GrowInitialLayers();
 
         void IBFSInit();
 
@@ -122,14 +185,21 @@ class SourceIBFS : public FlowSolver {
         SoSGraph* m_graph;
         SubmodularIBFS* m_energy;
         // Layers store vertices by distance.
-        std::vector<NodeQueue> m_source_layers;
+        NodeLayers m_source_layers;
         OrphanList m_source_orphans;
         int m_source_tree_d;
-        typedef typename NodeQueue::iterator queue_iterator;
-        queue_iterator m_search_node_iter;
-        queue_iterator m_search_node_end;
+        NodeId m_search_node;
         ArcIterator m_search_arc;
         ArcIterator m_search_arc_end;
+        std::vector<NodeId> m_relabel_queue;
+        // Number of arcs, and arcs scanned by relabels since the last
+        // global relabel
+        size_t m_num_arcs;
+        size_t m_relabel_work;
+        double m_global_relabel_freq;
+        bool m_initial_search;
+        int m_num_threads;
+        SoSGraph::Layer m_source_next;
 
         /* Statistics */
 
@@ -138,6 +208,7 @@ class SourceIBFS : public FlowSolver {
         double m_augmentTime = 0;
         double m_adoptTime = 0;
         size_t m_num_clique_pushes = 0;
+        SoSGraph::SearchStats m_search_stats;
 };
 
 class ParametricIBFS : public FlowSolver {
@@ -154,11 +225,11 @@ class ParametricIBFS : public FlowSolver {
         // Typedefs
         typedef SoSGraph::NodeId NodeId;
         typedef SoSGraph::CliqueId CliqueId;
-        typedef SoSGraph::Node Node;
         typedef SoSGraph::NodeState NodeState;
         typedef SoSGraph::NeighborList NeighborList;
         typedef SoSGraph::ArcIterator ArcIterator;
-        typedef SoSGraph::NodeQueue NodeQueue;
+        typedef SoSGraph::ArcIdx ArcIdx;
+        typedef SoSGraph::NodeLayers NodeLayers;
         typedef SoSGraph::OrphanList OrphanList;
         typedef SoSGraph::CliqueVec CliqueVec;
 
@@ -178,12 +249,10 @@ class ParametricIBFS : public FlowSolver {
         SoSGraph* m_graph;
         SubmodularIBFS* m_energy;
         // Layers store vertices by distance.
-        std::vector<NodeQueue> m_source_layers;
+        NodeLayers m_source_layers;
         OrphanList m_source_orphans;
         int m_source_tree_d;
-        typedef typename NodeQueue::iterator queue_iterator;
-        queue_iterator m_search_node_iter;
-        queue_iterator m_search_node_end;
+        NodeId m_search_node;
         ArcIterator m_search_arc;
         ArcIterator m_search_arc_end;
 
@@ -202,4 +271,182 @@ class ParametricIBFS : public FlowSolver {
         std::vector<REAL> m_parametricUnaries;
 };
 
+/** Boykov-Kolmogorov augmenting path solver for graphs where every clique
+ * is pairwise.
+ *
+ * Each (bounded, normalized) 2x2 clique table is just a pair of opposite
+ * edges, so we copy the residual capacities into a plain edge graph, solve
+ * that, and write the net edge flows back into the cliques as AlphaCi.
+ */
+class PairwiseBK : public FlowSolver {
+    public:
+        PairwiseBK() { }
+        virtual ~PairwiseBK() = default;
+
+        virtual void Solve(SubmodularIBFS* energy);
+
+        void MaxFlow();
+        void ComputeMinCut();
+
+    protected:
+        // Typedefs
+        typedef SoSGraph::NodeId NodeId;
+        typedef SoSGraph::CliqueId CliqueId;
+        typedef int ArcId;
+
+        // Special values of m_parent
+        static ArcId None() { return -1; }
+        static ArcId Terminal() { return -2; }
+        static ArcId Orphan() { return -3; }
+        static ArcId Sister(ArcId a) { return a ^ 1; }
+
+        // Helper functions
+        void BuildGraph();
+        void WriteBackFlow();
+        // Add arcs u->v and v->u, and return the id of u->v
+        ArcId AddEdge(NodeId u, NodeId v, REAL cap, REAL rev_cap);
+        void SetActive(NodeId i);
+        NodeId NextActive();
+        void Augment(ArcId middle_arc);
+        void SetOrphanFront(NodeId i);
+        void SetOrphanRear(NodeId i);
+        void ProcessOrphan(NodeId i, bool sink);
+
+        /* Algorithm data */
+
+        SoSGraph* m_graph;
+        SubmodularIBFS* m_energy;
+        // Arcs 2c and 2c+1 are the two directions of clique c (or of an
+        // edge built by AddEdge)
+        std::vector<NodeId> m_arc_head;
+        std::vector<ArcId> m_arc_next;
+        std::vector<REAL> m_arc_cap;
+        std::vector<REAL> m_orig_arc_cap;
+        // Per node data
+        std::vector<ArcId> m_first;
+        std::vector<REAL> m_tr_cap;
+        std::vector<REAL> m_orig_tr_cap;
+        std::vector<ArcId> m_parent;
+        std::vector<int> m_ts;
+        std::vector<int> m_dist;
+        std::vector<char> m_is_sink;
+        std::vector<char> m_is_active;
+        std::deque<NodeId> m_active;
+        std::deque<NodeId> m_orphans;
+        int m_time;
+
+        /* Statistics */
+
+        double m_totalTime = 0;
+        size_t m_num_augmentations = 0;
+};
+
+/** Solver which reduces the bounded clique tables to pairwise edges, with
+ * auxiliary nodes, and solves the result with PairwiseBK.
+ *
+ * Each clique table is split into its multilinear coefficients. Higher
+ * order terms become a star on a new auxiliary node (exact for negative
+ * terms of any order and for positive terms of order 3, as in HOCR), the
+ * remaining quadratic terms become edges, and the linear terms go to the
+ * terminals. The net flow out of each clique node over the edges of its
+ * clique, plus its linear term, gives back the AlphaCi of the clique.
+ *
+ * Graphs with a clique that doesn't reduce to a submodular pairwise graph
+ * this way (which can only happen for cliques of size 4 or more) are
+ * solved with BidirectionalIBFS instead.
+ */
+class PairwiseReduction : public PairwiseBK {
+    public:
+        PairwiseReduction() { }
+        virtual ~PairwiseReduction() = default;
+
+        virtual void Solve(SubmodularIBFS* energy);
+
+    protected:
+        typedef SoSGraph::IBFSEnergyTableClique::Assignment Assignment;
+
+        // Returns false if some clique can't be reduced
+        bool BuildReducedGraph();
+        bool ReduceClique(CliqueId cid);
+        void WriteBackReducedFlow();
+
+        // Arcs of clique c are m_clique_arcs[c] to m_clique_arcs[c+1], and
+        // the linear terms of its nodes start at m_clique_linear[c]
+        std::vector<ArcId> m_clique_arcs;
+        std::vector<size_t> m_clique_linear;
+        std::vector<REAL> m_linear;
+        std::vector<REAL> m_coeffs;
+        std::unique_ptr<FlowSolver> m_fallback;
+};
+
+/** Exact solver for graphs whose cliques form a hypertree, i.e., an acyclic
+ * hypergraph, which has a join tree.
+ *
+ * Cliques are eliminated leaves first (GYO reduction). On the way up, each
+ * clique minimizes out the nodes it doesn't share with the rest of the
+ * tree, which leaves the cut function of its subtree on its separator and
+ * the terminals. This is added to its parent as an extra clique, so that
+ * any flow through it can be routed through the subtree. On the way down,
+ * a small flow problem on the nodes of each clique and the terminals, with
+ * the functions of its children as extra cliques and the flow from its
+ * parent as supplies, gives the AlphaCi of the clique, the terminal flow of
+ * its private nodes and the flow that each child must take.
+ *
+ * Other graphs are solved with BidirectionalIBFS instead.
+ */
+class TreeDP : public FlowSolver {
+    public:
+        TreeDP() { }
+        virtual ~TreeDP() = default;
+
+        virtual void Solve(SubmodularIBFS* energy);
+
+        void ComputeMinCut();
+
+        // Whether the cliques of graph form a hypertree, so that Solve
+        // is exact without falling back to IBFS
+        bool IsHypertree(SoSGraph& graph) {
+            m_graph = &graph;
+            return BuildJoinTree();
+        }
+
+    protected:
+        // Typedefs
+        typedef SoSGraph::NodeId NodeId;
+        typedef SoSGraph::CliqueId CliqueId;
+        typedef SoSGraph::IBFSEnergyTableClique Clique;
+        typedef Clique::Assignment Assignment;
+
+        // Find the elimination order and parents, returns false if the
+        // cliques don't form a hypertree
+        bool BuildJoinTree();
+        void Upward(CliqueId c);
+        void Downward(CliqueId c);
+        // Route the supply of each local node to the nodes with negative
+        // supply, through the given cliques whose nodes are indices into
+        // supply
+        void LocalFlow(std::vector<Clique*>& cliques,
+                const std::vector<const std::vector<int>*>& cliqueNodes,
+                std::vector<REAL>& supply);
+
+        /* Algorithm data */
+
+        SoSGraph* m_graph;
+        SubmodularIBFS* m_energy;
+        std::vector<CliqueId> m_order;
+        std::vector<CliqueId> m_parent;
+        std::vector<std::vector<CliqueId>> m_children;
+        // Positions of the separator of c in c, and in its parent
+        std::vector<std::vector<int>> m_sep;
+        std::vector<std::vector<int>> m_sep_in_parent;
+        // Cut function of the subtree of c on its separator, s and t (the
+        // last two bits)
+        std::vector<std::vector<REAL>> m_sep_energy;
+        // Flow into the subtree of c at each node of its separator, s and t
+        std::vector<std::vector<REAL>> m_demand;
+        // Net terminal capacity of each node
+        std::vector<REAL> m_tr_cap;
+        std::unique_ptr<FlowSolver> m_fallback;
+};
+
 #endif
@@ -7,6 +7,7 @@
  */
 
 #include "energy-common.hpp"
+#include <algorithm>
 
 class Clique;
 
@@ -102,6 +103,28 @@ class Clique {
          */
         virtual REAL energy(const Label* labels) const = 0;
 
+        /** Compute the energy of every fusion of two labelings
+         *
+         * Entry a of out is the energy of the labeling taking proposed[i]
+         * where bit i of a is set, and current[i] otherwise. out must have
+         * room for 2^size() entries.
+         *
+         * The default calls energy() once per entry, in Gray code order.
+         * Derived classes may override it with a faster fill.
+         */
+        virtual void fusionTable(const Label* current, const Label* proposed,
+                REAL* out) const;
+
+        /** Return a lower bound on the least value over labelings x of
+         * \f$ f_C(x) - scale \sum_i lambda[i*numLabels + x_i] \f$,
+         * for scale >= 0. Used by SoSPD::LowerBound.
+         *
+         * The default only assumes that the energy is nonnegative. Derived
+         * classes may override it with a tighter bound.
+         */
+        virtual double dualBound(const REAL* lambda, Label numLabels,
+                double scale) const;
+
         /** Return an array containing the variables contained in the clique
          *
          * Returned pointer must point to an array of length size()
@@ -156,6 +179,65 @@ class PottsClique : public Clique {
             }
             return m_sameCost;
         }
+
+        /** Fill the fusion table directly: every entry is diff_cost except
+         * the fusions where all labels agree.
+         */
+        virtual void fusionTable(const Label* current, const Label* proposed,
+                REAL* out) const override {
+            const uint32_t num_assgns = 1 << Degree;
+            for (uint32_t a = 0; a < num_assgns; ++a)
+                out[a] = m_diffCost;
+            // Each fusion with all labels equal to l is fixed by the nodes
+            // that have l as only one of their two labels, and free on the
+            // nodes that have it as both
+            for (int p = 0; p < 2; ++p) {
+                const Label l = p ? proposed[0] : current[0];
+                if (p && l == current[0])
+                    break;
+                uint32_t set = 0, free = 0;
+                bool possible = true;
+                for (int i = 0; i < Degree; ++i) {
+                    const bool c = (current[i] == l), f = (proposed[i] == l);
+                    if (c && f)
+                        free |= 1 << i;
+                    else if (f)
+                        set |= 1 << i;
+                    else if (!c)
+                        possible = false;
+                }
+                if (!possible)
+                    continue;
+                // Enumerate the subsets of free
+                uint32_t sub = 0;
+                do {
+                    out[set | sub] = m_sameCost;
+                    sub = (sub - free) & free;
+                } while (sub != 0);
+            }
+        }
+
+        /** The least value is either at a constant labeling, or at the
+         * labeling maximizing lambda at each node separately
+         */
+        virtual double dualBound(const REAL* lambda, Label numLabels,
+                double scale) const override {
+            REAL maxSame = std::numeric_limits<REAL>::lowest();
+            for (Label l = 0; l < numLabels; ++l) {
+                REAL sum = 0;
+                for (int i = 0; i < Degree; ++i)
+                    sum += lambda[i*numLabels + l];
+                maxSame = std::max(maxSame, sum);
+            }
+            REAL maxAny = 0;
+            for (int i = 0; i < Degree; ++i) {
+                maxAny += *std::max_element(lambda + i*numLabels,
+                        lambda + (i+1)*numLabels);
+            }
+            return std::min(m_sameCost - scale*maxSame,
+                    m_diffCost - scale*maxAny);
+        }
+
         virtual const VarId* nodes() const override {
             return m_nodes;
         }
@@ -218,6 +300,39 @@ inline void MultilabelEnergy::addClique(CliquePtr c) {
     }
 }
 
+inline void Clique::fusionTable(const Label* current, const Label* proposed,
+        REAL* out) const {
+    const size_t k = size();
+    ASSERT(k < 32);
+    Label label_buf[32];
+    for (size_t i = 0; i < k; ++i)
+        label_buf[i] = current[i];
+    out[0] = energy(label_buf);
+    const uint32_t num_assgns = 1 << k;
+    uint32_t last_gray = 0;
+    for (uint32_t a = 1; a < num_assgns; ++a) {
+        const uint32_t gray = a ^ (a >> 1);
+        const uint32_t diff = gray ^ last_gray;
+        const int changed_idx = __builtin_ctz(diff);
+        if (diff & gray)
+            label_buf[changed_idx] = proposed[changed_idx];
+        else
+            label_buf[changed_idx] = current[changed_idx];
+        last_gray = gray;
+        out[gray] = energy(label_buf);
+    }
+}
+
+inline double Clique::dualBound(const REAL* lambda, Label numLabels,
+        double scale) const {
+    double bound = 0;
+    for (size_t i = 0; i < size(); ++i) {
+        bound -= scale * *std::max_element(lambda + i*numLabels,
+                lambda + (i+1)*numLabels);
+    }
+    return bound;
+}
+
 inline REAL 
 MultilabelEnergy::computeEnergy(const std::vector<Label>& labels) const {
     ASSERT(VarId(labels.size()) == m_numVars);
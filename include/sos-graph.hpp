@@ -8,18 +8,27 @@
 
 #include "energy-common.hpp"
 #include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <algorithm>
-#include <boost/intrusive/list.hpp>
-#include <boost/intrusive/slist.hpp>
-#include <boost/intrusive/options.hpp>
 
 #include "submodular-functions.hpp"
 
 
 /** Graph structure and algorithm for sum-of-submodular IBFS 
  */
+class WorkerPool;
+
 class SoSGraph {
     public:
         typedef int NodeId;
@@ -32,6 +41,19 @@ class SoSGraph {
         enum class UBfn {
             chen,
             cvpr14,
+            // Chosen per solve by SubmodularIBFS
+            automatic,
+        };
+        // Node orders for Reorder
+        enum class NodeOrder {
+            none,
+            // Breadth first over the cliques, from each unvisited node in
+            // turn
+            bfs,
+            // Reverse Cuthill-McKee: breadth first from a node of least
+            // degree in each component, neighbors by increasing degree,
+            // then reversed
+            rcm,
         };
         typedef std::tuple<UBfn, std::string, UpperBoundFunction> UBParam;
         static const std::vector<UBParam> ubParamList;
@@ -40,9 +62,15 @@ class SoSGraph {
             : m_num_nodes(0),
             s(-1), 
             t(-1),
-            m_num_cliques(0)
+            m_num_cliques(0),
+            m_num_linked(0)
         { }
 
+        /** Reserve space for numNodes nodes and numCliques cliques in total,
+         * so that building the graph doesn't reallocate
+         */
+        void Reserve(NodeId numNodes, CliqueId numCliques);
+
         /** Add n new nodes to the base set V
          *
          * \return Index of first created node
@@ -59,6 +87,23 @@ class SoSGraph {
         
         // Add Clique defined by nodes and energy table given
         IBFSEnergyTableClique& AddClique(const std::vector<NodeId>& nodes, const std::vector<REAL>& energyTable);
+        IBFSEnergyTableClique& AddClique(std::vector<NodeId>&& nodes, std::vector<REAL>&& energyTable);
+        /** Add count cliques of k nodes each, where clique c has nodes
+         * nodes[c*k] to nodes[c*k+k-1] and energy table energyTables[c<<k]
+         * to energyTables[(c+1)<<k - 1] (all 0 if energyTables is null).
+         *
+         * The cliques aren't added to the neighbor lists of their nodes
+         * until Freeze, which does all of them in one pass. Cliques added
+         * with AddClique while some are pending wait for Freeze as well.
+         */
+        void AddCliques(int k, CliqueId count, const NodeId* nodes, const REAL* energyTables = 0);
+        // Add the pending cliques to the neighbor lists of their nodes
+        void Freeze();
+        /** Give every clique its own copy of its energy table, so that
+         * MutableEnergyTable can then be called on different cliques from
+         * several threads at once
+         */
+        void UnshareTables();
 
         /* Clique: abstract base class for user-defined clique functions
          *
@@ -75,6 +120,10 @@ class SoSGraph {
                 : m_nodes(nodes),
                 m_alpha_Ci(nodes.size(), 0)
             { }
+            Clique(NodeVec&& nodes)
+                : m_nodes(std::move(nodes)),
+                m_alpha_Ci(m_nodes.size(), 0)
+            { }
             ~Clique() = default;
 
             // Returns the energy of the given labeling for this clique function
@@ -84,13 +133,22 @@ class SoSGraph {
             size_t Size() const { return m_nodes.size(); }
             std::vector<REAL>& AlphaCi() { return m_alpha_Ci; }
             const std::vector<REAL>& AlphaCi() const { return m_alpha_Ci; }
+            // Position of this clique in the neighbor list of each node
+            std::vector<int>& NeighborIdx() { return m_neighbor_idx; }
+            const std::vector<int>& NeighborIdx() const { return m_neighbor_idx; }
             size_t GetIndex(NodeId i) const {
                 return std::find(this->m_nodes.begin(), this->m_nodes.end(), i) - this->m_nodes.begin();
             }
+            // Replace each node i by newId[i]
+            void RenameNodes(const std::vector<NodeId>& newId) {
+                for (auto& i : m_nodes)
+                    i = newId[i];
+            }
 
             protected:
             NodeVec m_nodes; // The list of nodes in the clique
             std::vector<REAL> m_alpha_Ci; // The reparameterization variables for this clique
+            std::vector<int> m_neighbor_idx;
 
         };
         /*
@@ -100,16 +158,29 @@ class SoSGraph {
             public:
                 typedef uint32_t Assignment;
 
-                IBFSEnergyTableClique() : Clique(), m_energy(), m_alpha_energy(), m_min_tight_set() { }
+                typedef std::shared_ptr<std::vector<REAL>> TablePtr;
+
+                IBFSEnergyTableClique() : Clique(), m_energy(std::make_shared<std::vector<REAL>>()), m_alpha_energy(), m_min_tight_set() { }
                 IBFSEnergyTableClique(const std::vector<NodeId>& nodes,
                                   const std::vector<REAL>& energy)
                     : Clique(nodes),
-                    m_energy(energy),
+                    m_energy(std::make_shared<std::vector<REAL>>(energy)),
                     m_alpha_energy(energy),
                     m_min_tight_set(nodes.size(), (1 << nodes.size()) - 1)
                 { 
                     ASSERT(nodes.size() <= 31); 
                 }
+                // Shares the energy table, which is copied on the first
+                // MutableEnergyTable if anything else still refers to it.
+                // That copy is not thread safe, see UnshareTables
+                IBFSEnergyTableClique(NodeVec&& nodes, TablePtr energy)
+                    : Clique(std::move(nodes)),
+                    m_energy(std::move(energy)),
+                    m_alpha_energy(*m_energy),
+                    m_min_tight_set(m_nodes.size(), (1 << m_nodes.size()) - 1)
+                {
+                    ASSERT(m_nodes.size() <= 31);
+                }
 
                 virtual REAL ComputeEnergy(const std::vector<int>& labels) const;
                 REAL ComputeAlphaEnergy(const std::vector<int>& labels) const;
@@ -119,19 +190,31 @@ class SoSGraph {
 
                 void Push(size_t u_idx, size_t v_idx, REAL delta);
                 void ComputeMinTightSets();
-                std::vector<REAL>& EnergyTable() { return m_energy; }
-                const std::vector<REAL>& EnergyTable() const { return m_energy; }
+                const std::vector<REAL>& EnergyTable() const { return *m_energy; }
+                std::vector<REAL>& MutableEnergyTable() {
+                    if (m_energy.use_count() != 1)
+                        m_energy = std::make_shared<std::vector<REAL>>(*m_energy);
+                    return *m_energy;
+                }
                 std::vector<REAL>& AlphaEnergy() { return m_alpha_energy; }
                 const std::vector<REAL>& AlphaEnergy() const { return m_alpha_energy; }
 
                 void ResetAlpha();
 
             protected:
-                std::vector<REAL> m_energy;
+                TablePtr m_energy;
                 std::vector<REAL> m_alpha_energy;
                 std::vector<Assignment> m_min_tight_set;
 
         };
+        /* ArcIdx: 32 bit handle for an arc out of a fixed source node.
+         * Stores the index into the neighbor list of the source in the upper
+         * bits, and the index of the target within the clique in the low
+         * 5 bits (cliques have at most 31 nodes).
+         */
+        typedef int32_t ArcIdx;
+        static const int arcCliqueBits = 5;
+
         struct ArcIterator {
             NodeId source;
             NeighborList::iterator cIter;
@@ -176,34 +259,64 @@ class SoSGraph {
             int SourceIdx() const { return graph->m_cliques[*cIter].GetIndex(source); }
             int TargetIdx() const { return cliqueIdx; }
             CliqueId cliqueId() const { return *cIter; }
+            ArcIdx Index() const {
+                ArcIdx neighborIdx = cIter - graph->m_neighbors[source].begin();
+                return (neighborIdx << arcCliqueBits) | cliqueIdx;
+            }
             ArcIterator Reverse() const {
                 auto newSource = Target();
-                auto newCIter = std::find(graph->m_neighbors[newSource].begin(), graph->m_neighbors[newSource].end(), *cIter);
-                auto newCliqueIdx = graph->GetCliques()[*newCIter].GetIndex(source);
-                return {newSource, newCIter, static_cast<int>(newCliqueIdx), static_cast<int>(graph->m_cliques[*newCIter].Size()), graph};
+                const auto& c = graph->m_cliques[*cIter];
+                auto newCIter = graph->m_neighbors[newSource].begin() + c.NeighborIdx()[cliqueIdx];
+                auto newCliqueIdx = c.GetIndex(source);
+                return {newSource, newCIter, static_cast<int>(newCliqueIdx), static_cast<int>(c.Size()), graph};
             }
         };
 
-        typedef boost::intrusive::list_base_hook<boost::intrusive::link_mode<boost::intrusive::normal_link>> ListHook;
-        typedef boost::intrusive::slist_base_hook<boost::intrusive::link_mode<boost::intrusive::normal_link>> OrphanListHook;
-        struct Node : public ListHook, OrphanListHook {
-            NodeId id;
-            NodeState state;
-            int dis;
-            ArcIterator parent_arc;
-            NodeId parent;
-            NeighborList cliques;
-            Node(NodeId _id) 
-                : id(_id)
-                , state(NodeState::N)
-                , dis(std::numeric_limits<int>::max())
-                , parent_arc()
-                , parent(INT16_MIN)
-                , cliques() { }
-        };
+        /* NodeLayers: a set of FIFO queues of nodes (one per distance
+         * label), threaded through shared next/prev arrays. Each node is in
+         * at most one queue at a time, and can be removed in O(1).
+         */
+        class NodeLayers {
+            public:
+                static NodeId End() { return -1; }
 
-        typedef boost::intrusive::list<Node> NodeQueue;
-        typedef boost::intrusive::slist<Node, boost::intrusive::base_hook<OrphanListHook>, boost::intrusive::cache_last<true>> OrphanList;
+                void Reset(NodeId numNodes, int numLayers) {
+                    m_head.assign(numLayers, End());
+                    m_tail.assign(numLayers, End());
+                    m_next.assign(numNodes, End());
+                    m_prev.assign(numNodes, End());
+                }
+                bool Empty(int d) const { return m_head[d] == End(); }
+                NodeId Front(int d) const { return m_head[d]; }
+                NodeId Next(NodeId i) const { return m_next[i]; }
+                void PushBack(int d, NodeId i) {
+                    m_next[i] = End();
+                    m_prev[i] = m_tail[d];
+                    if (m_tail[d] == End())
+                        m_head[d] = i;
+                    else
+                        m_next[m_tail[d]] = i;
+                    m_tail[d] = i;
+                }
+                void Erase(int d, NodeId i) {
+                    if (m_prev[i] == End())
+                        m_head[d] = m_next[i];
+                    else
+                        m_next[m_prev[i]] = m_next[i];
+                    if (m_next[i] == End())
+                        m_tail[d] = m_prev[i];
+                    else
+                        m_prev[m_next[i]] = m_prev[i];
+                    m_next[i] = m_prev[i] = End();
+                }
+
+            private:
+                std::vector<NodeId> m_head;
+                std::vector<NodeId> m_tail;
+                std::vector<NodeId> m_next;
+                std::vector<NodeId> m_prev;
+        };
+        typedef std::deque<NodeId> OrphanList;
 
         ArcIterator ArcsBegin(NodeId i) {
             auto cIter = m_neighbors[i].begin();
@@ -215,14 +328,37 @@ class SoSGraph {
             auto& neighborList = m_neighbors[i];
             return {i, neighborList.end(), 0, 0, this};
         }
+        ArcIdx ArcsEndIdx(NodeId i) const {
+            return static_cast<ArcIdx>(m_neighbors[i].size()) << arcCliqueBits;
+        }
+        CliqueId ArcCliqueId(NodeId i, ArcIdx a) const {
+            return m_neighbors[i][a >> arcCliqueBits];
+        }
+        // ArcIdx of the arc from the u_idx'th to the v_idx'th node of c
+        ArcIdx CliqueArcIdx(CliqueId c, size_t u_idx, size_t v_idx) const {
+            return (static_cast<ArcIdx>(m_cliques[c].NeighborIdx()[u_idx]) << arcCliqueBits) | static_cast<ArcIdx>(v_idx);
+        }
+        // Recover the ArcIterator for an arc out of i from its ArcIdx
+        ArcIterator Arc(NodeId i, ArcIdx a) {
+            auto cIter = m_neighbors[i].begin() + (a >> arcCliqueBits);
+            if (cIter == m_neighbors[i].end())
+                return ArcsEnd(i);
+            return {i, cIter, a & ((1 << arcCliqueBits) - 1), static_cast<int>(m_cliques[*cIter].Size()), this};
+        }
 
         typedef std::vector<IBFSEnergyTableClique> CliqueVec;
 
         NodeId NumNodes() const { return m_num_nodes; }
         NodeId GetS() const { return s; }
         NodeId GetT() const { return t; }
-        Node& node(NodeId i) { return m_nodes[i]; }
-        const Node& node(NodeId i) const { return m_nodes[i]; }
+        NodeState& state(NodeId i) { return m_state[i]; }
+        NodeState state(NodeId i) const { return m_state[i]; }
+        int& dis(NodeId i) { return m_dis[i]; }
+        int dis(NodeId i) const { return m_dis[i]; }
+        NodeId& parent(NodeId i) { return m_parent[i]; }
+        NodeId parent(NodeId i) const { return m_parent[i]; }
+        ArcIdx& parentArc(NodeId i) { return m_parent_arc[i]; }
+        ArcIdx parentArc(NodeId i) const { return m_parent_arc[i]; }
         IBFSEnergyTableClique& clique(CliqueId c) { return m_cliques[c]; }
         const IBFSEnergyTableClique& clique(CliqueId c) const { return m_cliques[c]; }
         const std::vector<REAL>& GetC_si() const { return m_c_si; }
@@ -233,8 +369,6 @@ class SoSGraph {
         const CliqueVec& GetCliques() const { return m_cliques; }
         CliqueVec& GetCliques() { return m_cliques; }
         const std::vector<NeighborList>& GetNeighbors() const { return m_neighbors; }
-        std::vector<Node>& GetNodes() { return m_nodes; }
-        const std::vector<Node>& GetNodes() const { return m_nodes; }
 
         REAL ResCap(const ArcIterator& arc, bool forwardArc);
         bool NonzeroCap(const ArcIterator& arc, bool forwardArc);
@@ -251,6 +385,116 @@ class SoSGraph {
         void UpperBoundCliques(const std::vector<bool>& fixedVars, NormStats* stats);
         void UpperBoundCliques(UBfn ub, NormStats* stats = 0);
         void UpperBoundCliques(UBfn ub, const std::vector<bool>& fixedVars, const std::vector<int>& labels, NormStats* stats = 0);
+        /** Same as ResetFlow followed by UpperBoundCliques, and saturating
+         * every s-i-t path, but in one sweep over the cliques (on up to
+         * numThreads threads, 0 for one per core) and one over the nodes
+         */
+        template <BoundFn fn>
+        void SetupFlow(const std::vector<bool>& fixedVars, NormStats* stats, int numThreads);
+        void SetupFlow(UBfn ub, const std::vector<bool>& fixedVars, NormStats* stats = 0, int numThreads = 1);
+        // Setup of the most recent solve, see SubmodularIBFSParams::fusedSetup
+        struct SetupStats {
+            double time = 0;
+            int cliquePasses = 0;
+        };
+
+        // Work done by the flow solvers in the most recent Solve
+        struct SearchStats {
+            size_t arcScans = 0;
+            size_t relabels = 0;
+            size_t gapNodes = 0;
+            size_t globalRelabels = 0;
+        };
+        struct ReductionStats {
+            NodeId nodes = 0;
+            NodeId fixed = 0;
+            double Ratio() const { return nodes ? double(fixed) / nodes : 0; }
+        };
+        // Cheap statistics of the graph, for choosing a solver
+        struct GraphStats {
+            // cliqueSizes[k] is the number of cliques of size k
+            std::vector<CliqueId> cliqueSizes;
+            CliqueId pairwise = 0;
+            // Cliques whose energy table is already submodular, and so
+            // don't need an upper bound (only counted if requested)
+            CliqueId submodular = 0;
+            // Nonsubmodular cliques of size 2
+            CliqueId nonsubmodularPairwise = 0;
+            // Nodes with more source than sink capacity, and vice versa,
+            // once the cliques are normalized
+            NodeId sourceNodes = 0;
+            NodeId sinkNodes = 0;
+            REAL sourceCap = 0;
+            REAL sinkCap = 0;
+        };
+        GraphStats ComputeStats(bool checkSubmodular = true) const;
+        // Recount only the source and sink fields of stats, which are the
+        // only ones that depend on the unaries
+        void CountBalance(GraphStats& stats) const;
+
+        /** Fix nodes which are on the same side of some minimum cut
+         * regardless of the rest of the graph.
+         *
+         * A node whose residual source capacity exceeds its residual sink
+         * capacity by at least the capacity of all its outgoing clique arcs
+         * is in S, and symmetrically for T. Flow is routed so that in every
+         * clique the set of S-fixed nodes (and the complement of the T-fixed
+         * nodes) is tight, hence no augmenting path can pass through a fixed
+         * node, and their state is set to S or T, so the flow solvers can
+         * leave them out of the search. Must be called after
+         * UpperBoundCliques.
+         *
+         * \return Number of nodes fixed
+         */
+        NodeId FixPersistentNodes(ReductionStats* stats = 0);
+
+        /** Compute a node order with better locality than insertion order
+         *
+         * \return order, where order[k] is the node to put in position k
+         */
+        std::vector<NodeId> ComputeOrder(NodeOrder nodeOrder) const;
+        /** Renumber the nodes so that node order[k] becomes node k, and the
+         * cliques by their first node in the new order, so that the cliques
+         * and nodes that a search touches together are close in memory.
+         * Must be called before the flow is set up.
+         *
+         * \return cliqueOrder, where cliqueOrder[k] is the clique that
+         * became clique k
+         */
+        std::vector<CliqueId> Reorder(const std::vector<NodeId>& order);
+
+        // Next layer of a search tree, found by FindLayer
+        struct Layer {
+            std::vector<NodeId> nodes;
+            std::vector<NodeId> parents;
+            std::vector<ArcIdx> parentArcs;
+            // Scratch space of FindLayer. position is -1 except at the
+            // frontier during a bottom-up search
+            std::vector<int> mark;
+            int stamp = 0;
+            std::vector<NodeId> position;
+        };
+        /** Find the next layer of the search tree of the given state (S or
+         * T), from frontier, its nodes at distance d.
+         *
+         * The new nodes are found in the order that scanning frontier
+         * serially would find them, each with its first admissible arc as
+         * parent arc, so the tree is the same as IBFS would grow. Expands
+         * top-down from the frontier, or bottom-up from the nodes outside
+         * the tree when the frontier has more arcs than outsideArcs / 2, the
+         * number of arcs (neighbor list entries) of nodes outside the tree,
+         * on up to numThreads threads (0 for one per core), from pool if
+         * given and SharedWorkerPool otherwise. Only reads the graph, so
+         * both trees can be searched at once, each with its own pool.
+         *
+         * \return false if a node of the frontier has a residual arc to the
+         * other tree, since IBFS has to augment there.
+         */
+        bool FindLayer(NodeState state, int d, const std::vector<NodeId>& frontier,
+                Layer& layer, size_t outsideArcs, int numThreads,
+                SearchStats* stats = 0, WorkerPool* pool = nullptr);
+        // Label the nodes of a layer found by FindLayer
+        void AddLayer(NodeState state, int d, const Layer& layer);
 
         NodeId m_num_nodes;
         NodeId s,t;
@@ -262,24 +506,43 @@ class SoSGraph {
         CliqueId m_num_cliques;
         CliqueVec m_cliques;
         std::vector<NeighborList> m_neighbors;
+        // Cliques before this are in the neighbor lists, see AddCliques
+        CliqueId m_num_linked;
+        // Energy tables by hash of their content, so that cliques added
+        // with the same table share it. Dropped once the flow is set up
+        std::unordered_multimap<size_t, IBFSEnergyTableClique::TablePtr> m_tables;
+        IBFSEnergyTableClique::TablePtr InternTable(const REAL* table, size_t size);
+        IBFSEnergyTableClique::TablePtr InternTable(std::vector<REAL>&& table);
 
     protected:
-        std::vector<Node> m_nodes;
+        // Per-node search state for the flow solvers, stored as dense
+        // arrays of length NumNodes() + 2 (including s and t)
+        std::vector<NodeState> m_state;
+        std::vector<int> m_dis;
+        std::vector<NodeId> m_parent;
+        std::vector<ArcIdx> m_parent_arc;
 };
 
+inline void SoSGraph::Reserve(NodeId numNodes, CliqueId numCliques) {
+    // Room for s and t as well
+    m_c_si.reserve(numNodes);
+    m_c_it.reserve(numNodes);
+    m_phi_si.reserve(numNodes + 2);
+    m_phi_it.reserve(numNodes + 2);
+    m_neighbors.reserve(numNodes);
+    m_cliques.reserve(numCliques);
+}
+
 inline SoSGraph::NodeId SoSGraph::AddNode(int n) {
     ASSERT(n >= 1);
     ASSERT(s == -1);
     NodeId first_node = m_num_nodes;
-    for (int i = 0; i < n; ++i) {
-        m_nodes.push_back(Node(m_num_nodes));
-        m_c_si.push_back(0);
-        m_c_it.push_back(0);
-        m_phi_si.push_back(0);
-        m_phi_it.push_back(0);
-        m_neighbors.push_back(NeighborList());
-        m_num_nodes++;
-    }
+    m_num_nodes += n;
+    m_c_si.resize(m_num_nodes, 0);
+    m_c_it.resize(m_num_nodes, 0);
+    m_phi_si.resize(m_num_nodes, 0);
+    m_phi_it.resize(m_num_nodes, 0);
+    m_neighbors.resize(m_num_nodes);
     return first_node;
 }
 
@@ -296,32 +559,123 @@ inline void SoSGraph::ClearTerminals() {
 }
         
 inline SoSGraph::IBFSEnergyTableClique& SoSGraph::AddClique(const std::vector<NodeId>& nodes, const std::vector<REAL>& energyTable) {
+    return AddClique(std::vector<NodeId>(nodes), std::vector<REAL>(energyTable));
+}
+
+inline SoSGraph::IBFSEnergyTableClique& SoSGraph::AddClique(std::vector<NodeId>&& nodes, std::vector<REAL>&& energyTable) {
     ASSERT(s == -1);
-    m_cliques.emplace_back(nodes, energyTable);
-    for (NodeId i : nodes) {
+    ASSERT(energyTable.size() == (size_t(1) << nodes.size()));
+    for (NodeId i : nodes)
         ASSERT(0 <= i && i < m_num_nodes);
-        m_neighbors[i].push_back(m_num_cliques);
+    m_cliques.emplace_back(std::move(nodes), InternTable(std::move(energyTable)));
+    if (m_num_linked == m_num_cliques) {
+        auto& neighborIdx = m_cliques.back().NeighborIdx();
+        for (NodeId i : m_cliques.back().Nodes()) {
+            neighborIdx.push_back(m_neighbors[i].size());
+            m_neighbors[i].push_back(m_num_cliques);
+        }
+        m_num_linked++;
     }
     return m_cliques[m_num_cliques++];
 }
 
+inline void SoSGraph::AddCliques(int k, CliqueId count, const NodeId* nodes, const REAL* energyTables) {
+    ASSERT(s == -1);
+    ASSERT(1 <= k && k <= 31);
+    const size_t tableSize = size_t(1) << k;
+    for (CliqueId c = 0; c < count; ++c) {
+        const NodeId* cliqueNodes = nodes + size_t(c) * k;
+        for (int i = 0; i < k; ++i)
+            ASSERT(0 <= cliqueNodes[i] && cliqueNodes[i] < m_num_nodes);
+        auto table = energyTables
+            ? InternTable(energyTables + c * tableSize, tableSize)
+            : InternTable(std::vector<REAL>(tableSize, 0));
+        m_cliques.emplace_back(std::vector<NodeId>(cliqueNodes, cliqueNodes + k), std::move(table));
+        m_num_cliques++;
+    }
+}
+
+inline size_t TableHash(const REAL* table, size_t size) {
+    size_t h = size;
+    for (size_t i = 0; i < size; ++i)
+        h = (h ^ std::hash<REAL>()(table[i])) * 1099511628211ull;
+    return h;
+}
+
+inline SoSGraph::IBFSEnergyTableClique::TablePtr SoSGraph::InternTable(const REAL* table, size_t size) {
+    const size_t h = TableHash(table, size);
+    auto range = m_tables.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it) {
+        const auto& t = *it->second;
+        if (t.size() == size && std::equal(t.begin(), t.end(), table))
+            return it->second;
+    }
+    auto t = std::make_shared<std::vector<REAL>>(table, table + size);
+    m_tables.emplace(h, t);
+    return t;
+}
+
+inline SoSGraph::IBFSEnergyTableClique::TablePtr SoSGraph::InternTable(std::vector<REAL>&& table) {
+    const size_t h = TableHash(table.data(), table.size());
+    auto range = m_tables.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (*it->second == table)
+            return it->second;
+    }
+    auto t = std::make_shared<std::vector<REAL>>(std::move(table));
+    m_tables.emplace(h, t);
+    return t;
+}
+
+inline void SoSGraph::UnshareTables() {
+    for (auto& c : m_cliques)
+        c.MutableEnergyTable();
+}
+
+inline void SoSGraph::Freeze() {
+    if (m_num_linked == m_num_cliques)
+        return;
+    // Size each neighbor list once
+    std::vector<size_t> degree(m_num_nodes, 0);
+    for (CliqueId cid = m_num_linked; cid < m_num_cliques; ++cid) {
+        for (NodeId i : m_cliques[cid].Nodes())
+            degree[i]++;
+    }
+    for (NodeId i = 0; i < m_num_nodes; ++i) {
+        if (degree[i] > 0)
+            m_neighbors[i].reserve(m_neighbors[i].size() + degree[i]);
+    }
+    for (CliqueId cid = m_num_linked; cid < m_num_cliques; ++cid) {
+        auto& c = m_cliques[cid];
+        auto& neighborIdx = c.NeighborIdx();
+        neighborIdx.reserve(c.Size());
+        for (NodeId i : c.Nodes()) {
+            neighborIdx.push_back(m_neighbors[i].size());
+            m_neighbors[i].push_back(cid);
+        }
+    }
+    m_num_linked = m_num_cliques;
+}
+
 inline void SoSGraph::ResetFlow() {
+    Freeze();
     // Initialize source, sink (only do once)
     if (s == -1) {
         s = m_num_nodes; t = m_num_nodes + 1;
-        m_nodes.push_back(Node(s));
+        m_tables.clear();
         m_phi_si.push_back(0);
         m_phi_it.push_back(0);
-        m_nodes.push_back(Node(t));
         m_phi_si.push_back(0);
         m_phi_it.push_back(0);
     }
     // reset distance, state and parent
-    for (int i = 0; i < m_num_nodes + 2; ++i) {
-        Node& node = m_nodes[i];
-        node.dis = std::numeric_limits<int>::max();
-        node.state = NodeState::N;
-        node.parent = i;
+    const NodeId numNodes = m_num_nodes + 2;
+    m_state.assign(numNodes, NodeState::N);
+    m_dis.assign(numNodes, std::numeric_limits<int>::max());
+    m_parent.resize(numNodes);
+    m_parent_arc.assign(numNodes, 0);
+    for (NodeId i = 0; i < numNodes; ++i) {
+        m_parent[i] = i;
         m_phi_si[i] = m_phi_it[i] = 0;
     }
     
@@ -377,28 +731,29 @@ inline void CheckSubmodular(size_t n, const std::vector<REAL>& m_energy) {
 inline void SoSGraph::IBFSEnergyTableClique::NormalizeEnergy(std::vector<REAL>& psi, REAL& constantTerm) {
     ASSERT(false /* Should not be calling this function*/);
     const size_t n = this->m_nodes.size();
-    CheckSubmodular(n, m_energy);
+    auto& energy = MutableEnergyTable();
+    CheckSubmodular(n, energy);
     const Assignment num_assignments = 1 << n;
-    REAL allOnes = m_energy[num_assignments - 1];
+    REAL allOnes = energy[num_assignments - 1];
     constantTerm += allOnes;
     psi.resize(n);
     Assignment assgn = num_assignments - 1; // The all 1 assignment
     for (size_t i = 0; i < n; ++i) {
         Assignment next_assgn = assgn ^ (1 << i);
-        psi[i] = (m_energy[assgn] - m_energy[next_assgn]);
+        psi[i] = (energy[assgn] - energy[next_assgn]);
         assgn = next_assgn;
     }
 
     for (Assignment a = 0; a < num_assignments; ++a) {
-        m_energy[a] -= allOnes;
+        energy[a] -= allOnes;
         for (size_t i = 0; i < n; ++i) {
-            if (!(a & (1 << i))) m_energy[a] += psi[i];
+            if (!(a & (1 << i))) energy[a] += psi[i];
         }
-        ASSERT(m_energy[a] >= 0);
-        m_alpha_energy[a] = m_energy[a];
+        ASSERT(energy[a] >= 0);
+        m_alpha_energy[a] = energy[a];
     }
     ComputeMinTightSets();
-    CheckSubmodular(n, m_energy);
+    CheckSubmodular(n, energy);
 }
 
 inline REAL SoSGraph::IBFSEnergyTableClique::ComputeEnergy(const std::vector<int>& labels) const {
@@ -409,7 +764,7 @@ inline REAL SoSGraph::IBFSEnergyTableClique::ComputeEnergy(const std::vector<int
             assgn |= 1 << i;
         }
     }
-    return m_energy[assgn];
+    return (*m_energy)[assgn];
 }
 
 inline REAL SoSGraph::IBFSEnergyTableClique::ComputeAlphaEnergy(const std::vector<int>& labels) const {
@@ -504,8 +859,110 @@ inline void SoSGraph::IBFSEnergyTableClique::ResetAlpha() {
     const size_t n = this->m_nodes.size();
     const Assignment num_assignments = 1 << n;
     for (Assignment a = 0; a < num_assignments; ++a) {
-        m_alpha_energy[a] = m_energy[a];
+        m_alpha_energy[a] = (*m_energy)[a];
+    }
+}
+
+inline SoSGraph::NodeId SoSGraph::FixPersistentNodes(ReductionStats* stats) {
+    typedef IBFSEnergyTableClique::Assignment Assignment;
+    NodeId numFixed = 0;
+    for (NodeId i = 0; i < m_num_nodes; ++i) {
+        // Total capacity of arcs out of (and into) i, over all cliques.
+        // By submodularity, the marginal cost of adding i to S is at most
+        // g({i}), and the cost of removing it at most g(C \ {i})
+        REAL out_cap = 0;
+        REAL in_cap = 0;
+        for (CliqueId cid : m_neighbors[i]) {
+            const auto& c = m_cliques[cid];
+            const Assignment full = (1 << c.Size()) - 1;
+            const Assignment i_mask = 1 << c.GetIndex(i);
+            out_cap += c.AlphaEnergy()[i_mask];
+            in_cap += c.AlphaEnergy()[full & ~i_mask];
+        }
+        REAL excess = (m_c_si[i] - m_phi_si[i]) - (m_c_it[i] - m_phi_it[i]);
+        if (excess > 0 && excess >= out_cap) {
+            // Route the flow s -> i -> j for each clique neighbor j not
+            // already fixed to S, so that the set of S-fixed nodes becomes
+            // tight in every clique. Pushes between unfixed nodes don't
+            // change the value of that set, so it stays tight.
+            for (CliqueId cid : m_neighbors[i]) {
+                auto& c = m_cliques[cid];
+                const size_t i_idx = c.GetIndex(i);
+                for (size_t j_idx = 0; j_idx < c.Size(); ++j_idx) {
+                    if (j_idx == i_idx || m_state[c.Nodes()[j_idx]] == NodeState::S)
+                        continue;
+                    REAL delta = c.ExchangeCapacity(i_idx, j_idx);
+                    if (delta > 0) {
+                        c.Push(i_idx, j_idx, delta);
+                        m_phi_si[i] += delta;
+                        m_phi_si[c.Nodes()[j_idx]] -= delta;
+                    }
+                }
+            }
+            m_state[i] = NodeState::S;
+            numFixed++;
+        } else if (excess < 0 && -excess >= in_cap) {
+            // Route the flow j -> i -> t for each clique neighbor j not
+            // already fixed to T, so that the complement of the T-fixed nodes
+            // becomes tight in every clique.
+            for (CliqueId cid : m_neighbors[i]) {
+                auto& c = m_cliques[cid];
+                const size_t i_idx = c.GetIndex(i);
+                for (size_t j_idx = 0; j_idx < c.Size(); ++j_idx) {
+                    if (j_idx == i_idx || m_state[c.Nodes()[j_idx]] == NodeState::T)
+                        continue;
+                    REAL delta = c.ExchangeCapacity(j_idx, i_idx);
+                    if (delta > 0) {
+                        c.Push(j_idx, i_idx, delta);
+                        m_phi_it[i] += delta;
+                        m_phi_it[c.Nodes()[j_idx]] -= delta;
+                    }
+                }
+            }
+            m_state[i] = NodeState::T;
+            numFixed++;
+        }
     }
+    if (stats) {
+        stats->nodes = m_num_nodes;
+        stats->fixed = numFixed;
+    }
+    return numFixed;
+}
+
+/** Set the alpha energy of c to its normalized upper bound, and its alpha
+ * to -psi, where psi is the flow from each node to t that normalizing takes
+ */
+template <SoSGraph::BoundFn UB>
+inline void UpperBoundClique(SoSGraph::IBFSEnergyTableClique& c, const std::vector<bool>& fixedVars,
+        std::vector<REAL>& psi, SoSGraph::NormStats* stats) {
+    auto& newEnergy = c.AlphaEnergy();
+    int k = c.Size();
+    psi.resize(k);
+    // Compute upper bound g of clique energy
+    UB(k, c.EnergyTable(), newEnergy);
+
+    if (!fixedVars.empty()) {
+        uint32_t fixedSet = 0;
+        for (int i = 0; i < k; ++i)
+            fixedSet |= (fixedVars[c.Nodes()[i]] << i);
+        ZeroMarginalSet(k, newEnergy, fixedSet);
+    }
+
+    if (stats) {
+        stats->L1 += DiffL1(c.EnergyTable(), newEnergy);
+        stats->L2 += DiffL2(c.EnergyTable(), newEnergy);
+        stats->LInfty += DiffLInfty(c.EnergyTable(), newEnergy);
+    }
+    // Modify g, find psi so that g'(S) = g(S) + psi(S) >= 0
+    Normalize(k, newEnergy, psi);
+    /*
+     *AddLinear(k, c.EnergyTable(), psi);
+     */
+
+    auto& alpha_Ci = c.AlphaCi();
+    for (int i = 0; i < k; ++i)
+        alpha_Ci[i] = -psi[i];
 }
 
 template <SoSGraph::BoundFn UB>
@@ -525,35 +982,9 @@ void SoSGraph::UpperBoundCliques(const std::vector<bool>& fixedVars, NormStats*
          *}
          */
         cliquesDone++;
-        auto& newEnergy = c.AlphaEnergy();
-        int k = c.Size();
-        psi.resize(k);
-        // Compute upper bound g of clique energy
-        UB(k, c.EnergyTable(), newEnergy);
-
-        if (!fixedVars.empty()) {
-            uint32_t fixedSet = 0;
-            for (int i = 0; i < k; ++i)
-                fixedSet |= (fixedVars[c.Nodes()[i]] << i);
-            ZeroMarginalSet(k, newEnergy, fixedSet);
-        }
-
-        if (stats) {
-            stats->L1 += DiffL1(c.EnergyTable(), newEnergy);
-            stats->L2 += DiffL2(c.EnergyTable(), newEnergy);
-            stats->LInfty += DiffLInfty(c.EnergyTable(), newEnergy);
-        }
-        // Modify g, find psi so that g'(S) = g(S) + psi(S) >= 0
-        Normalize(k, newEnergy, psi);
-        /*
-         *AddLinear(k, c.EnergyTable(), psi);
-         */
-
-        auto& alpha_Ci = c.AlphaCi();
-        for (int i = 0; i < k; ++i) {
-            alpha_Ci[i] = -psi[i];
+        UpperBoundClique<UB>(c, fixedVars, psi, stats);
+        for (size_t i = 0; i < c.Size(); ++i)
             m_phi_it[c.Nodes()[i]] += psi[i];
-        }
         c.ComputeMinTightSets();
     }
     /*
@@ -562,6 +993,525 @@ void SoSGraph::UpperBoundCliques(const std::vector<bool>& fixedVars, NormStats*
      */
 }
 
+inline std::vector<SoSGraph::NodeId> SoSGraph::ComputeOrder(NodeOrder nodeOrder) const {
+    std::vector<NodeId> order;
+    order.reserve(m_num_nodes);
+    if (nodeOrder == NodeOrder::none) {
+        for (NodeId i = 0; i < m_num_nodes; ++i)
+            order.push_back(i);
+        return order;
+    }
+    const bool rcm = (nodeOrder == NodeOrder::rcm);
+    // Degree is the number of arcs out of a node
+    std::vector<size_t> degree(m_num_nodes, 0);
+    for (NodeId i = 0; i < m_num_nodes; ++i) {
+        for (CliqueId cid : m_neighbors[i])
+            degree[i] += m_cliques[cid].Size() - 1;
+    }
+    std::vector<NodeId> starts;
+    for (NodeId i = 0; i < m_num_nodes; ++i)
+        starts.push_back(i);
+    auto byDegree = [&](NodeId i, NodeId j) { return degree[i] < degree[j]; };
+    if (rcm)
+        std::stable_sort(starts.begin(), starts.end(), byDegree);
+
+    std::vector<bool> visited(m_num_nodes, false);
+    for (NodeId start : starts) {
+        if (visited[start])
+            continue;
+        visited[start] = true;
+        order.push_back(start);
+        for (size_t head = order.size() - 1; head < order.size(); ++head) {
+            const NodeId i = order[head];
+            const size_t first = order.size();
+            for (CliqueId cid : m_neighbors[i]) {
+                for (NodeId j : m_cliques[cid].Nodes()) {
+                    if (!visited[j]) {
+                        visited[j] = true;
+                        order.push_back(j);
+                    }
+                }
+            }
+            if (rcm)
+                std::stable_sort(order.begin() + first, order.end(), byDegree);
+        }
+    }
+    if (rcm)
+        std::reverse(order.begin(), order.end());
+    return order;
+}
+
+inline std::vector<SoSGraph::CliqueId> SoSGraph::Reorder(const std::vector<NodeId>& order) {
+    ASSERT(s == -1);
+    Freeze();
+    ASSERT(NodeId(order.size()) == m_num_nodes);
+    std::vector<NodeId> newId(m_num_nodes, -1);
+    for (NodeId k = 0; k < m_num_nodes; ++k) {
+        ASSERT(newId[order[k]] == -1);
+        newId[order[k]] = k;
+    }
+    std::vector<REAL> c_si(m_num_nodes), c_it(m_num_nodes);
+    for (NodeId k = 0; k < m_num_nodes; ++k) {
+        c_si[k] = m_c_si[order[k]];
+        c_it[k] = m_c_it[order[k]];
+    }
+    m_c_si.swap(c_si);
+    m_c_it.swap(c_it);
+
+    std::vector<NodeId> firstNode(m_num_cliques, m_num_nodes);
+    std::vector<CliqueId> cliqueOrder(m_num_cliques);
+    for (CliqueId cid = 0; cid < m_num_cliques; ++cid) {
+        cliqueOrder[cid] = cid;
+        for (NodeId i : m_cliques[cid].Nodes())
+            firstNode[cid] = std::min(firstNode[cid], newId[i]);
+    }
+    std::stable_sort(cliqueOrder.begin(), cliqueOrder.end(),
+            [&](CliqueId a, CliqueId b) { return firstNode[a] < firstNode[b]; });
+    CliqueVec cliques;
+    cliques.reserve(m_num_cliques);
+    for (CliqueId cid : cliqueOrder)
+        cliques.push_back(std::move(m_cliques[cid]));
+    m_cliques.swap(cliques);
+
+    for (auto& neighborList : m_neighbors)
+        neighborList.clear();
+    for (CliqueId cid = 0; cid < m_num_cliques; ++cid) {
+        auto& c = m_cliques[cid];
+        c.RenameNodes(newId);
+        auto& neighborIdx = c.NeighborIdx();
+        neighborIdx.clear();
+        for (NodeId i : c.Nodes()) {
+            neighborIdx.push_back(m_neighbors[i].size());
+            m_neighbors[i].push_back(cid);
+        }
+    }
+    return cliqueOrder;
+}
+
+inline SoSGraph::GraphStats SoSGraph::ComputeStats(bool checkSubmodular) const {
+    GraphStats stats;
+    for (const auto& c : m_cliques) {
+        const size_t k = c.Size();
+        if (stats.cliqueSizes.size() <= k)
+            stats.cliqueSizes.resize(k+1, 0);
+        stats.cliqueSizes[k]++;
+        if (k == 2)
+            stats.pairwise++;
+        if (!checkSubmodular)
+            continue;
+        if (::CheckSubmodular(int(k), c.EnergyTable()))
+            stats.submodular++;
+        else if (k == 2)
+            stats.nonsubmodularPairwise++;
+    }
+    CountBalance(stats);
+    return stats;
+}
+
+inline void SoSGraph::CountBalance(GraphStats& stats) const {
+    stats.sourceNodes = stats.sinkNodes = 0;
+    stats.sourceCap = stats.sinkCap = 0;
+    // Normalizing a clique moves the marginals along the chain of its first
+    // i nodes onto the terminal edges, so count those too
+    std::vector<REAL> balance(m_num_nodes);
+    for (NodeId i = 0; i < m_num_nodes; ++i)
+        balance[i] = m_c_si[i] - m_c_it[i];
+    for (const auto& c : m_cliques) {
+        const auto& energy = c.EnergyTable();
+        Assgn last_assgn = 0;
+        for (size_t i = 0; i < c.Size(); ++i) {
+            Assgn this_assgn = last_assgn | (1 << i);
+            balance[c.Nodes()[i]] += energy[last_assgn] - energy[this_assgn];
+            last_assgn = this_assgn;
+        }
+    }
+    for (NodeId i = 0; i < m_num_nodes; ++i) {
+        if (balance[i] > 0) {
+            stats.sourceNodes++;
+            stats.sourceCap += balance[i];
+        } else if (balance[i] < 0) {
+            stats.sinkNodes++;
+            stats.sinkCap -= balance[i];
+        }
+    }
+}
+
+/** Threads kept between calls to ParallelChunks, which runs several
+ * times per iteration of a solve, so that it doesn't start and join new
+ * threads every time. Threads are started as they are first needed.
+ */
+class WorkerPool {
+    public:
+        WorkerPool() = default;
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+        ~WorkerPool();
+
+        /** Run job(chunk) for every chunk in [0, numChunks), chunk 0 on the
+         * calling thread, and wait for all of them. job must not throw.
+         * Returns false without running anything if the pool is already
+         * running a job, from another thread or an enclosing call
+         */
+        bool TryRun(size_t numChunks, const std::function<void(size_t)>& job);
+
+    private:
+        void Work(size_t chunk, size_t generation);
+
+        std::atomic<bool> m_busy{false};
+        std::mutex m_mutex;
+        std::condition_variable m_start;
+        std::condition_variable m_done;
+        // m_threads[i] runs chunk i+1
+        std::vector<std::thread> m_threads;
+        const std::function<void(size_t)>* m_job = nullptr;
+        size_t m_num_chunks = 0;
+        size_t m_pending = 0;
+        // Incremented for each job, so the threads can tell a new one
+        size_t m_generation = 0;
+        bool m_stop = false;
+};
+
+inline WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_start.notify_all();
+    for (auto& th : m_threads)
+        th.join();
+}
+
+inline bool WorkerPool::TryRun(size_t numChunks, const std::function<void(size_t)>& job) {
+    bool idle = false;
+    if (!m_busy.compare_exchange_strong(idle, true))
+        return false;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (m_threads.size() + 1 < numChunks)
+        m_threads.emplace_back(&WorkerPool::Work, this, m_threads.size() + 1, m_generation);
+    m_job = &job;
+    m_num_chunks = numChunks;
+    m_pending = numChunks - 1;
+    m_generation++;
+    lock.unlock();
+    m_start.notify_all();
+    job(0);
+    lock.lock();
+    m_done.wait(lock, [&] { return m_pending == 0; });
+    m_job = nullptr;
+    lock.unlock();
+    m_busy = false;
+    return true;
+}
+
+inline void WorkerPool::Work(size_t chunk, size_t generation) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_start.wait(lock, [&] { return m_stop || m_generation != generation; });
+        if (m_stop)
+            return;
+        generation = m_generation;
+        if (chunk >= m_num_chunks)
+            continue;
+        const auto& job = *m_job;
+        lock.unlock();
+        job(chunk);
+        lock.lock();
+        if (--m_pending == 0)
+            m_done.notify_one();
+    }
+}
+
+/** The pool used by ParallelChunks, shared by every solver in the process:
+ * the solvers only hold it for the length of one ParallelChunks call, and
+ * a pool per solver would keep idle threads for every solver alive
+ */
+inline WorkerPool& SharedWorkerPool() {
+    static WorkerPool pool;
+    return pool;
+}
+
+/** Number of chunks to split count items into, with at least grain items
+ * per chunk and at most numThreads chunks (0 for one per core)
+ */
+inline size_t NumChunks(size_t count, int numThreads, size_t grain) {
+    if (numThreads <= 0)
+        numThreads = std::max<int>(std::thread::hardware_concurrency(), 1);
+    return std::max<size_t>(std::min<size_t>(numThreads, (count + grain - 1) / grain), 1);
+}
+
+/** Split [0, count) into numChunks contiguous chunks, and run
+ * f(chunk, begin, end) on each on its own thread of pool, with chunk 0 on
+ * the calling thread. Starts new threads instead if the pool is in use by
+ * another solve, or by an enclosing ParallelChunks. Exceptions are
+ * rethrown on the calling thread.
+ */
+template <typename F>
+inline void ParallelChunks(size_t count, size_t numChunks, F f,
+        WorkerPool& pool = SharedWorkerPool()) {
+    std::vector<std::exception_ptr> errors(numChunks);
+    auto worker = [&](size_t chunk) {
+        try {
+            f(chunk, count * chunk / numChunks, count * (chunk + 1) / numChunks);
+        } catch (...) {
+            errors[chunk] = std::current_exception();
+        }
+    };
+    if (numChunks <= 1) {
+        worker(0);
+    } else if (!pool.TryRun(numChunks, worker)) {
+        std::vector<std::thread> threads;
+        for (size_t chunk = 1; chunk < numChunks; ++chunk)
+            threads.emplace_back(worker, chunk);
+        worker(0);
+        for (auto& th : threads)
+            th.join();
+    }
+    for (const auto& e : errors) {
+        if (e)
+            std::rethrow_exception(e);
+    }
+}
+
+inline bool SoSGraph::FindLayer(NodeState state, int d, const std::vector<NodeId>& frontier,
+        Layer& layer, size_t outsideArcs, int numThreads,
+        SearchStats* stats, WorkerPool* pool) {
+    // Chunks smaller than this aren't worth a thread
+    const size_t grain = 2048;
+    // Direction of the residual arcs of the tree, from the frontier
+    const bool forward = (state == NodeState::S);
+    auto inOtherTree = [&](NodeId j) {
+        return m_state[j] != state && m_state[j] != NodeState::N;
+    };
+    size_t frontierArcs = 0;
+    for (NodeId i : frontier)
+        frontierArcs += m_neighbors[i].size();
+    std::atomic<bool> blocked(false);
+    std::atomic<size_t> arcScans(0);
+    WorkerPool& workers = pool ? *pool : SharedWorkerPool();
+    layer.nodes.clear();
+    layer.parents.clear();
+    layer.parentArcs.clear();
+
+    if (frontierArcs <= outsideArcs / 2) {
+        // Top-down: scan the frontier in order, collecting the unlabeled
+        // nodes found by each chunk
+        const size_t numChunks = NumChunks(frontier.size(), numThreads, grain);
+        std::vector<std::vector<NodeId>> found(numChunks);
+        ParallelChunks(frontier.size(), numChunks,
+            [&](size_t chunk, size_t begin, size_t end) {
+                size_t scans = 0;
+                auto& out = found[chunk];
+                for (size_t f = begin; f < end && !blocked; ++f) {
+                    NodeId i = frontier[f];
+                    auto arcsEnd = ArcsEnd(i);
+                    for (auto arc = ArcsBegin(i); arc != arcsEnd; ++arc) {
+                        scans++;
+                        if (!NonzeroCap(arc, forward))
+                            continue;
+                        NodeId j = arc.Target();
+                        if (m_state[j] == NodeState::N) {
+                            out.push_back(j);
+                        } else if (inOtherTree(j)) {
+                            blocked = true;
+                            break;
+                        }
+                    }
+                }
+                arcScans += scans;
+            }, workers);
+        if (blocked) {
+            if (stats)
+                stats->arcScans += arcScans;
+            return false;
+        }
+        // Keep the first time each node is found
+        if (layer.mark.size() != size_t(m_num_nodes))
+            layer.mark.assign(m_num_nodes, layer.stamp);
+        layer.stamp++;
+        for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+            for (NodeId j : found[chunk]) {
+                if (layer.mark[j] == layer.stamp)
+                    continue;
+                layer.mark[j] = layer.stamp;
+                layer.nodes.push_back(j);
+            }
+        }
+        // The parent arc is the first arc to the frontier with capacity
+        // toward the new node
+        const size_t numAdded = layer.nodes.size();
+        layer.parents.resize(numAdded);
+        layer.parentArcs.resize(numAdded);
+        ParallelChunks(numAdded, NumChunks(numAdded, numThreads, grain),
+            [&](size_t, size_t begin, size_t end) {
+                size_t scans = 0;
+                for (size_t a = begin; a < end; ++a) {
+                    NodeId j = layer.nodes[a];
+                    auto arcsEnd = ArcsEnd(j);
+                    for (auto arc = ArcsBegin(j); arc != arcsEnd; ++arc) {
+                        scans++;
+                        NodeId i = arc.Target();
+                        if (m_state[i] == state && m_dis[i] == d && NonzeroCap(arc, !forward)) {
+                            layer.parentArcs[a] = arc.Index();
+                            layer.parents[a] = i;
+                            break;
+                        }
+                    }
+                }
+                arcScans += scans;
+            }, workers);
+    } else {
+        // Bottom-up: every node outside the tree looks for arcs from the
+        // frontier. New nodes are ordered by the position of the first
+        // frontier node (and its arc) that would find them
+        auto& position = layer.position;
+        if (position.size() != size_t(m_num_nodes))
+            position.assign(m_num_nodes, -1);
+        for (size_t f = 0; f < frontier.size(); ++f)
+            position[frontier[f]] = f;
+        struct Found {
+            int64_t key;
+            NodeId node;
+            NodeId parent;
+            ArcIdx parentArc;
+        };
+        const size_t numChunks = NumChunks(m_num_nodes, numThreads, grain);
+        std::vector<std::vector<Found>> found(numChunks);
+        ParallelChunks(m_num_nodes, numChunks,
+            [&](size_t chunk, size_t begin, size_t end) {
+                size_t scans = 0;
+                auto& out = found[chunk];
+                for (NodeId j = begin; j < NodeId(end) && !blocked; ++j) {
+                    if (m_state[j] == state)
+                        continue;
+                    const bool unlabeled = (m_state[j] == NodeState::N);
+                    Found result = { std::numeric_limits<int64_t>::max(), j, -1, 0 };
+                    auto arcsEnd = ArcsEnd(j);
+                    for (auto arc = ArcsBegin(j); arc != arcsEnd; ++arc) {
+                        scans++;
+                        NodeId i = arc.Target();
+                        if (position[i] == -1 || !NonzeroCap(arc, !forward))
+                            continue;
+                        if (!unlabeled) {
+                            blocked = true;
+                            break;
+                        }
+                        int64_t key = (int64_t(position[i]) << 32) | uint32_t(arc.Reverse().Index());
+                        if (result.parent == -1) {
+                            result.parent = i;
+                            result.parentArc = arc.Index();
+                        }
+                        result.key = std::min(result.key, key);
+                    }
+                    if (result.parent != -1)
+                        out.push_back(result);
+                }
+                arcScans += scans;
+            }, workers);
+        for (NodeId i : frontier)
+            position[i] = -1;
+        if (blocked) {
+            if (stats)
+                stats->arcScans += arcScans;
+            return false;
+        }
+        std::vector<Found> all;
+        for (size_t chunk = 0; chunk < numChunks; ++chunk)
+            all.insert(all.end(), found[chunk].begin(), found[chunk].end());
+        std::sort(all.begin(), all.end(),
+                [](const Found& a, const Found& b) { return a.key < b.key; });
+        for (const auto& f : all) {
+            layer.nodes.push_back(f.node);
+            layer.parents.push_back(f.parent);
+            layer.parentArcs.push_back(f.parentArc);
+        }
+    }
+    if (stats)
+        stats->arcScans += arcScans;
+    return true;
+}
+
+inline void SoSGraph::AddLayer(NodeState state, int d, const Layer& layer) {
+    for (size_t a = 0; a < layer.nodes.size(); ++a) {
+        NodeId j = layer.nodes[a];
+        m_state[j] = state;
+        m_dis[j] = d + 1;
+        m_parent[j] = layer.parents[a];
+        m_parent_arc[j] = layer.parentArcs[a];
+    }
+}
+
+template <SoSGraph::BoundFn UB>
+void SoSGraph::SetupFlow(const std::vector<bool>& fixedVars, NormStats* stats, int numThreads) {
+    Freeze();
+    // Chunks smaller than this aren't worth a thread
+    const size_t grain = 1024;
+    if (s == -1) {
+        s = m_num_nodes; t = m_num_nodes + 1;
+        m_tables.clear();
+        m_phi_si.resize(m_num_nodes + 2);
+        m_phi_it.resize(m_num_nodes + 2);
+    }
+    const NodeId numNodes = m_num_nodes + 2;
+    m_state.resize(numNodes);
+    m_dis.resize(numNodes);
+    m_parent.resize(numNodes);
+    m_parent_arc.resize(numNodes);
+
+    // Bound each clique, which overwrites all of its alpha, so there's no
+    // need to reset it first, and compute its tight sets only once
+    const size_t cliqueChunks = NumChunks(m_num_cliques, numThreads, grain);
+    std::vector<NormStats> chunkStats(cliqueChunks);
+    ParallelChunks(m_num_cliques, cliqueChunks,
+        [&](size_t chunk, size_t begin, size_t end) {
+            std::vector<REAL> psi;
+            for (size_t cid = begin; cid < end; ++cid) {
+                auto& c = m_cliques[cid];
+                UpperBoundClique<UB>(c, fixedVars, psi, stats ? &chunkStats[chunk] : 0);
+                c.ComputeMinTightSets();
+            }
+        });
+    if (stats) {
+        for (const auto& cs : chunkStats) {
+            stats->L1 += cs.L1;
+            stats->L2 += cs.L2;
+            stats->LInfty += cs.LInfty;
+        }
+    }
+
+    // Reset each node, gather the flow to t that normalizing its cliques
+    // took, and saturate its s-i-t path
+    const size_t nodeChunks = NumChunks(numNodes, numThreads, grain);
+    ParallelChunks(numNodes, nodeChunks,
+        [&](size_t, size_t begin, size_t end) {
+            for (NodeId i = begin; i < NodeId(end); ++i) {
+                m_state[i] = NodeState::N;
+                m_dis[i] = std::numeric_limits<int>::max();
+                m_parent[i] = i;
+                m_parent_arc[i] = 0;
+                m_phi_si[i] = m_phi_it[i] = 0;
+                if (i >= m_num_nodes)
+                    continue;
+                for (CliqueId cid : m_neighbors[i]) {
+                    const auto& c = m_cliques[cid];
+                    m_phi_it[i] -= c.AlphaCi()[c.GetIndex(i)];
+                }
+                REAL min_cap = std::min(m_c_si[i] - m_phi_si[i], m_c_it[i] - m_phi_it[i]);
+                m_phi_si[i] += min_cap;
+                m_phi_it[i] += min_cap;
+            }
+        });
+}
+
+inline void SoSGraph::SetupFlow(UBfn ub, const std::vector<bool>& fixedVars, NormStats* stats, int numThreads) {
+    switch (ub) {
+        case UBfn::chen: SetupFlow<ChenUpperBound>(fixedVars, stats, numThreads);
+                    break;
+        case UBfn::cvpr14: SetupFlow<UpperBoundCVPR14>(fixedVars, stats, numThreads);
+                    break;
+        case UBfn::automatic: ASSERT(false); // Resolved by SubmodularIBFS
+    }
+}
+
 inline void SoSGraph::UpperBoundCliques(UBfn ub, NormStats* stats) {
     UpperBoundCliques(ub, std::vector<bool>{}, std::vector<int>{}, stats);
 }
@@ -572,6 +1522,7 @@ inline void SoSGraph::UpperBoundCliques(UBfn ub, const std::vector<bool>& fixedV
                     break;
         case UBfn::cvpr14: UpperBoundCliques<UpperBoundCVPR14>(fixedVars, stats);
                     break;
+        case UBfn::automatic: ASSERT(false); // Resolved by SubmodularIBFS
     }
 }
 
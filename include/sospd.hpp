@@ -8,6 +8,7 @@
 #include "energy-common.hpp"
 #include <vector>
 #include <functional>
+#include <limits>
 
 #include "multilabel-energy.hpp"
 #include "submodular-ibfs.hpp"
@@ -34,6 +35,11 @@ class SoSPD {
                    std::vector<Label>& proposed)
             > ProposalCallback;
 
+        /** Progress callbacks take as input the iteration number and the
+         * energy of the labeling after that iteration.
+         */
+        typedef std::function<void(int niter, REAL energy)> ProgressCallback;
+
         /** Set up SoSPD to optimize a particular energy function
          *
          * \param energy Energy function to optimize.
@@ -53,6 +59,15 @@ class SoSPD {
          */
         void Solve(int niters = std::numeric_limits<int>::max());
 
+        /** As Solve(niters), but stop once token expires, which is checked
+         * between iterations and inside the flow solves. An interrupted
+         * iteration is dropped, leaving the labeling and dual of the last
+         * complete one.
+         *
+         * \return False if the token expired
+         */
+        bool Solve(int niters, const SolveToken& token);
+
         /** Return label of a node i, returns -1 if Solve has not been called.*/
         int GetLabel(VarId i) const;
 
@@ -66,15 +81,55 @@ class SoSPD {
          */
         void SetLowerBound(bool b) { m_lower_bound = b; }
 
+        /** Choose whether to apply the post-edit correction in the same pass
+         * over cliques as the dual update (the default), reusing the fusion
+         * tables instead of evaluating each clique again.
+         */
+        void SetFusedDualUpdate(bool b) { m_fused_dual_update = b; }
+
         /** Specify method for choosing proposals. */
-        void SetProposalCallback(const ProposalCallback& pc) { m_pc = pc; }
+        void SetProposalCallback(const ProposalCallback& pc) {
+            m_alpha_expansion = false;
+            m_pc = pc;
+        }
+
+        /** Evaluate the count alpha-expansion proposals with the highest
+         * height scores in parallel at each iteration, and keep the move
+         * that lowers the energy the most. Each proposal has its own flow
+         * graph, so this takes count copies of it. A count of 1 (the
+         * default) uses the proposal callback instead.
+         */
+        void SetSpeculativeProposals(int count) { m_num_candidates = count; }
+
+        /** Restrict each node to count candidate labels: its current label
+         * and the others of least unary cost. Proposals only move nodes to
+         * their candidates, and heights and duals are only stored for them.
+         * If refreshIters is positive, the candidates are chosen again every
+         * refreshIters iterations, as the labels of least height. A count
+         * of 0 (the default) keeps all labels. Takes effect at the first
+         * Solve.
+         */
+        void SetCandidateLabels(int count, int refreshIters = 0) {
+            m_candidate_labels = count;
+            m_candidate_refresh = refreshIters;
+        }
+
+        /** Specify a function to call after each iteration. */
+        void SetProgressCallback(const ProgressCallback& cb) { m_progress = cb; }
 
         /** Set the proposal method to alpha-expansion 
          *
          * Alpha-expansion proposals simply cycle through the labels, proposing
-         * a constant labeling (i.e., all "alpha") at each iteration.
+         * a constant labeling (i.e., all "alpha") at each iteration. Solve
+         * stops after a full cycle of labels that neither lowered the energy
+         * nor raised the dual bound.
          */
         void SetAlphaExpansion() { 
+            m_alpha_expansion = true;
+            m_next_alpha = 0;
+            m_unchanged_labels = 0;
+            m_best_energy = std::numeric_limits<REAL>::max();
+            m_best_dual = -std::numeric_limits<double>::max();
             m_pc = [&](int, const std::vector<Label>&, std::vector<Label>&) {
                 AlphaProposal();
             };
@@ -87,45 +142,73 @@ class SoSPD {
          * heights.
          */
         void SetHeightAlphaExpansion() { 
+            m_alpha_expansion = false;
             m_pc = [&](int, const std::vector<Label>&, std::vector<Label>&) {
                 HeightAlphaProposal();
             };
         }
 
+        /** Stop Solve once the gap between the energy and LowerBound() is
+         * at most gap times the energy. A gap of 0 (the default) never
+         * stops early. After the first iteration, Solve checks the gap
+         * against the bound at scales of the dual near the one that was
+         * best the iteration before, rather than searching them all again
+         * as LowerBound does.
+         */
+        void SetGapTarget(double gap) { m_gap_target = gap; }
+
         /** Return lower bound on optimum, determined by current dual */
-        double LowerBound();
+        double LowerBound() const;
 
         REAL dualVariable(int alpha, VarId i, Label l) const;
         Flow* GetFlow() { return &m_ibfs; }
 
     private:
         typedef MultilabelEnergy::CliquePtr CliquePtr;
-        typedef std::vector<REAL> LambdaAlpha;
-        typedef std::vector<std::pair<size_t, size_t>> NodeNeighborList;
-        typedef std::vector<NodeNeighborList> NodeCliqueList;
 
+        bool Run(int niters, const SolveToken* token);
         REAL ComputeHeight(VarId, Label);
+        REAL PrimalEnergy() const;
+        double DualBound(double scale) const;
+        // LowerBound from scales near m_bound_scale only
+        double NearbyLowerBound() const;
         REAL ComputeHeightDiff(VarId i, Label l1, Label l2) const;
+        void RefreshHeights(VarId i, Label x, Label y, bool moved, REAL* scoreDelta);
+        void AddScoreRow(VarId i, bool add, REAL* scores) const;
+        void AddScoreDelta(const std::vector<REAL>& scoreDelta);
+        const std::vector<REAL>& LabelScores();
         void SetupGraph(Flow& crf);
         // TODO(afix): redo this
-        void SetupAlphaEnergy(Flow& crf);
+        void SetupAlphaEnergy(Flow& crf, const std::vector<Label>& fusion);
         void InitialLabeling();
         void InitialDual();
         void InitialNodeCliqueList();
         bool InitialFusionLabeling();
-        void PreEditDual(Flow& crf);
+        void PreEditDual(Flow& crf, const std::vector<Label>& fusion);
         bool UpdatePrimalDual(Flow& crf);
+        bool ApplyMove(Flow& crf);
+        bool SpeculativeStep();
+        REAL MoveDelta(Flow& crf, const std::vector<Label>& fusion);
+        void CountProgress();
         void PostEditDual();
+        void CorrectDual(size_t clique_index, int k, const Label* labels, REAL energy);
         void DualFit();
-        REAL& Height(VarId i, Label l) { return m_heights[i*m_num_labels+l]; }
+        void ChooseLabels(VarId i, const std::vector<REAL>& cost,
+                std::vector<Label>& order, Label* out);
+        void RefreshLabelSets();
+        size_t Slot(VarId i, Label l) const;
+        Label SlotLabel(VarId i, size_t s) const;
+        size_t CliqueSlot(int alpha, VarId i, Label l) const;
+        REAL& Height(VarId i, Label l) { return m_heights[i*m_slots+Slot(i, l)]; }
+        REAL Height(VarId i, Label l) const { return m_heights[i*m_slots+Slot(i, l)]; }
 
         REAL& dualVariable(int alpha, VarId i, Label l);
-        REAL dualVariable(const LambdaAlpha& lambdaAlpha, 
-                VarId i, Label l) const;
-        REAL& dualVariable(LambdaAlpha& lambdaAlpha, 
-                VarId i, Label l);
-        LambdaAlpha& lambdaAlpha(int alpha);
-        const LambdaAlpha& lambdaAlpha(int alpha) const;
+        REAL dualVariable(const REAL* lambdaAlpha, 
+                VarId i, size_t slot) const;
+        REAL& dualVariable(REAL* lambdaAlpha, 
+                VarId i, size_t slot);
+        REAL* lambdaAlpha(int alpha);
+        const REAL* lambdaAlpha(int alpha) const;
 
         // Move Proposals
         void HeightAlphaProposal();
@@ -138,16 +221,51 @@ class SoSPD {
         std::vector<Label> m_labels;
         /// The proposed labeling in a given iteration
         std::vector<Label> m_fusion_labels;
-        // Factor this list back into a node list?
-        NodeCliqueList m_node_clique_list;
-        // FIXME(afix) change way m_dual is stored. Put lambda_alpha as separate
-        // REAL* for each clique, indexed by i, l. 
-        std::vector<LambdaAlpha> m_dual;
+        /// Node i is in the cliques whose rows of duals start at
+        /// m_dual[m_node_dual_rows[j]], for j from m_node_clique_offsets[i]
+        /// to m_node_clique_offsets[i+1]
+        std::vector<uint32_t> m_node_clique_offsets;
+        std::vector<uint32_t> m_node_dual_rows;
+        /// The duals of all cliques, those of clique alpha starting at
+        /// m_dual_offsets[alpha] and indexed by i, l
+        std::vector<REAL> m_dual;
+        std::vector<uint32_t> m_dual_offsets;
         std::vector<REAL> m_heights;
         bool m_expansion_submodular;
         bool m_lower_bound;
+        bool m_fused_dual_update;
+        /// Per label sums of positive height differences, used by
+        /// HeightAlphaProposal, and only maintained once it has run
+        std::vector<REAL> m_label_scores;
+        bool m_scores_valid;
+        /// Alpha-expansion schedule: whether it is in use, the next label
+        /// to try, the number of iterations since the last progress, the
+        /// least energy so far, and the greatest DualBound(1) since then
+        bool m_alpha_expansion;
+        Label m_next_alpha;
+        Label m_unchanged_labels;
+        REAL m_best_energy;
+        double m_best_dual;
+        double m_gap_target;
+        /// Scale of the dual that gave the last LowerBound or
+        /// NearbyLowerBound (-1 before the first)
+        mutable double m_bound_scale;
+        /// Flow graphs for the proposals evaluated by SpeculativeStep
+        int m_num_candidates;
+        std::vector<std::unique_ptr<Flow>> m_candidates;
+        /// Candidate labels: the number per node (0 for all), how often
+        /// they are chosen again, the number of labels stored per node,
+        /// and the sorted candidates of each node (empty if all labels are
+        /// kept). Heights and duals are indexed by position in these sets.
+        /// m_other_unary is the least unary of the labels each node leaves out
+        int m_candidate_labels;
+        int m_candidate_refresh;
+        size_t m_slots;
+        std::vector<Label> m_label_sets;
+        std::vector<REAL> m_other_unary;
         int m_iter;
         ProposalCallback m_pc;
+        ProgressCallback m_progress;
 };
 
 #endif
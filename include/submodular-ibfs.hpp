@@ -15,7 +15,14 @@
 
 struct SubmodularIBFSParams {
     enum class FlowAlgorithm {
-        bidirectional, source, parametric
+        bidirectional, source, parametric, pairwise_bk,
+        // Reduce to a pairwise graph with auxiliary nodes (see
+        // PairwiseReduction)
+        reduction,
+        // Exact message passing on hypertrees (see TreeDP)
+        tree_dp,
+        // Chosen per solve from the SoSGraph::GraphStats
+        automatic
     };
     static std::vector<std::pair<FlowAlgorithm, std::string>> algNames;
 
@@ -27,6 +34,56 @@ struct SubmodularIBFSParams {
     FlowAlgorithm alg = FlowAlgorithm::bidirectional;
     SoSGraph::UBfn ub = SoSGraph::UBfn::cvpr14;
     std::vector<bool> fixedVars;
+    // Use PairwiseBK whenever all cliques have size 2
+    bool pairwiseFastPath = true;
+    // Fix persistent nodes before each IBFS solve (see
+    // SoSGraph::FixPersistentNodes). Off by default, since it changes
+    // which minimum cut is returned when there are several
+    bool reducePersistent = false;
+    // Split the graph into connected components and solve them
+    // independently, on up to numThreads threads (0 for one per core).
+    // Each solve pays for the union-find and for copying the components
+    // into subproblems, so this only helps graphs with several large
+    // components
+    bool decompose = false;
+    // Threads for the parallel passes (decompose, parallelInitialSearch,
+    // fusedSetup and the SoSPD dual updates), 0 for one per core. The
+    // default of 1 keeps Solve on the calling thread
+    int numThreads = 1;
+    // Recompute the IBFS distance labels by BFS once orphan relabels have
+    // scanned globalRelabelFreq times the number of arcs (0 to disable)
+    double globalRelabelFreq = 0;
+    // Grow the IBFS search trees layer by layer on numThreads threads until
+    // they meet, before the serial search takes over
+    bool parallelInitialSearch = false;
+    // During the initial search of BidirectionalIBFS (see
+    // parallelInitialSearch), grow the source and sink trees on separate
+    // threads. Augmentation and adoption afterwards stay serial
+    bool concurrentInitialTrees = false;
+    // Solve BidirectionalIBFS in phases that only use arcs with residual
+    // capacity at least delta, halving delta from the largest power of two
+    // below the terminal capacities down to 1. IBFS is not sensitive to
+    // the size of the capacities, and this was 2.5-14 times slower on
+    // every energy measured, including capacities spread over nine orders
+    // of magnitude (see bench/capacity-scaling), so leave it off unless
+    // that benchmark shows a gain on your energies
+    bool capacityScaling = false;
+    // Bound the cliques and reset the flow in a single sweep on numThreads
+    // threads (see SoSGraph::SetupFlow). This makes one pass over the
+    // cliques instead of two; on one thread the setup time was within
+    // noise of the two-pass version on 200-300 wide grids (see
+    // bench/setup-time), so the gain depends on memory bandwidth
+    bool fusedSetup = true;
+    // Renumber the nodes and cliques in this order on the first Solve, for
+    // locality. Node and clique ids passed to and from SubmodularIBFS stay
+    // the same, but Graph() and GetLabels() use the new order
+    SoSGraph::NodeOrder nodeOrder = SoSGraph::NodeOrder::none;
+    // With alg == automatic, time the candidate solvers in turn on the
+    // first autoProbe solves, and then keep the fastest
+    int autoProbe = 0;
+    // Deadline and cancellation flag polled by the flow solvers, which throw
+    // SolveInterrupted once it expires (none if null)
+    const SolveToken* interrupt = nullptr;
 };
 
 class FlowSolver;
@@ -35,6 +92,7 @@ class FlowSolver;
 class SubmodularIBFS {
     public:
         typedef SoSGraph::NodeId NodeId;
+        typedef SoSGraph::CliqueId CliqueId;
 
         SubmodularIBFS(SubmodularIBFSParams params = {});
         ~SubmodularIBFS(); // Needed for unique_ptr with incomplete type
@@ -45,6 +103,11 @@ class SubmodularIBFS {
          */
         NodeId AddNode(int n = 1);
 
+        /** Reserve space for numNodes nodes and numCliques cliques in total
+         * (see SoSGraph::Reserve)
+         */
+        void Reserve(NodeId numNodes, CliqueId numCliques);
+
         /** Get cut label of node
          *
          * \return 1, 0 or -1 if n is in S, not in S, or haven't computed flow 
@@ -65,6 +128,10 @@ class SubmodularIBFS {
 
         // Add Clique defined by nodes and energy table given
         void AddClique(const std::vector<NodeId>& nodes, const std::vector<REAL>& energyTable);
+        void AddClique(std::vector<NodeId>&& nodes, std::vector<REAL>&& energyTable);
+        // Add count cliques of size k from flat arrays (see
+        // SoSGraph::AddCliques). Solve freezes the graph first
+        void AddCliques(int k, CliqueId count, const NodeId* nodes, const REAL* energyTables = 0);
         void AddPairwiseTerm(NodeId i, NodeId j, REAL E00, REAL E01, REAL E10, REAL E11);
 
         void Solve();
@@ -74,18 +141,84 @@ class SubmodularIBFS {
         REAL ComputeEnergy(const std::vector<int>& labels) const;
 
         SoSGraph& Graph() { return m_graph; }
+        // Clique c, in the order it was added
+        SoSGraph::IBFSEnergyTableClique& GetClique(CliqueId c) {
+            return m_graph.clique(m_clique_index.empty() ? c : m_clique_index[c]);
+        }
         const SubmodularIBFSParams& Params() const { return m_params; }
         SubmodularIBFSParams& Params() { return m_params; }
         SoSGraph::NormStats* NormStats() { return &m_normStats; }
+        // Statistics of the persistency reduction in the most recent Solve
+        SoSGraph::ReductionStats* ReductionStats() { return &m_reductionStats; }
+        // Search work of the flow solver in the most recent Solve
+        SoSGraph::SearchStats* SearchStats() { return &m_searchStats; }
+        // Graph statistics used by the most recent automatic Solve. All but
+        // the source and sink counts are computed on the first automatic
+        // Solve after cliques are added, so energy tables edited through
+        // Graph() after that are not checked for submodularity again
+        SoSGraph::GraphStats* GraphStats() { return &m_graphStats; }
+        // Time spent in SetupFlow by the most recent Solve
+        SoSGraph::SetupStats* SetupStats() { return &m_setupStats; }
+
+        // Reset the flow and bound the cliques, before a flow solver starts
+        void SetupFlow();
 
     protected:
+        /** Solve each connected component of the graph separately
+         *
+         * Components are found by union-find over the cliques, ignoring
+         * fixedVars (which have no capacity to their clique neighbors).
+         * Single nodes are cut directly, and the rest are copied into
+         * independent subproblems which are solved in parallel, and their
+         * flow and labels written back into m_graph.
+         *
+         * \return false if the graph doesn't split, and nothing was done
+         */
+        bool SolveComponents();
+
+        /** Replace automatic alg and ub in params by a concrete choice
+         *
+         * The upper bound only matters for nonsubmodular cliques, and Chen's
+         * bound is only tighter for pairwise ones. All-pairwise graphs use
+         * PairwiseBK, graphs whose cliques form a hypertree use TreeDP,
+         * and graphs with cliques of size at most 3 use
+         * PairwiseReduction. Otherwise source IBFS is chosen if the nodes
+         * with source and sink excess are unbalanced, and bidirectional
+         * IBFS if not. While probing, the candidate solvers are taken in turn
+         * instead, and afterwards the fastest one is kept.
+         */
+        void ChooseSolver(SubmodularIBFSParams& params);
+        void SolveChosen();
+        REAL ComputeInternalEnergy(const std::vector<int>& labels) const;
+        void SolveFlow();
+        // Renumber the graph in m_params.nodeOrder
+        void Reorder();
+        NodeId Internal(NodeId n) const { return m_node_index.empty() ? n : m_node_index[n]; }
+
         /* Graph and energy function definitions */
         SubmodularIBFSParams m_params;
         SoSGraph m_graph;
         REAL m_constant_term = 0;
         std::vector<int> m_labels;
         std::unique_ptr<FlowSolver> m_flowSolver;
+        SubmodularIBFSParams::FlowAlgorithm m_flowSolverAlg;
+        int m_autoSolves = 0;
+        // Whether the cliques form a hypertree, found by the first
+        // automatic solve (-1 if not known yet)
+        int m_hypertree = -1;
+        // Whether m_graphStats has been computed for the current cliques
+        bool m_haveGraphStats = false;
+        std::vector<double> m_probeTime;
+        std::vector<int> m_probeCount;
         SoSGraph::NormStats m_normStats;
+        SoSGraph::ReductionStats m_reductionStats;
+        SoSGraph::SearchStats m_searchStats;
+        SoSGraph::GraphStats m_graphStats;
+        SoSGraph::SetupStats m_setupStats;
+        // Position in m_graph of each node and clique, by the id it was
+        // added with (empty if not reordered)
+        std::vector<NodeId> m_node_index;
+        std::vector<CliqueId> m_clique_index;
 
     public:
         REAL GetConstantTerm() const { return m_constant_term; }
@@ -0,0 +1,347 @@
+#include "flow-solver.hpp"
+
+#include <iostream>
+#include <limits>
+#include <chrono>
+
+#include "submodular-ibfs.hpp"
+
+typedef std::chrono::system_clock::time_point TimePt;
+typedef std::chrono::duration<double> Duration;
+typedef std::chrono::system_clock Clock;
+
+void PairwiseBK::BuildGraph() {
+    const NodeId n = m_graph->NumNodes();
+    const CliqueId m = m_graph->GetNumCliques();
+
+    m_first.assign(n, None());
+    m_arc_head.resize(2*m);
+    m_arc_next.resize(2*m);
+    m_arc_cap.resize(2*m);
+    for (CliqueId cid = 0; cid < m; ++cid) {
+        const auto& c = m_graph->clique(cid);
+        ASSERT(c.Size() == 2);
+        NodeId u = c.Nodes()[0];
+        NodeId v = c.Nodes()[1];
+        ArcId uv = 2*cid;
+        ArcId vu = 2*cid+1;
+        // Exchange capacity from u to v is the (normalized) cost of the
+        // assignment with u in S and v not in S, and vice versa
+        m_arc_head[uv] = v;
+        m_arc_cap[uv] = c.ExchangeCapacity(0, 1);
+        m_arc_next[uv] = m_first[u];
+        m_first[u] = uv;
+        m_arc_head[vu] = u;
+        m_arc_cap[vu] = c.ExchangeCapacity(1, 0);
+        m_arc_next[vu] = m_first[v];
+        m_first[v] = vu;
+    }
+    m_orig_arc_cap = m_arc_cap;
+
+    m_tr_cap.resize(n);
+    for (NodeId i = 0; i < n; ++i) {
+        m_tr_cap[i] = (m_graph->m_c_si[i] - m_graph->m_phi_si[i])
+            - (m_graph->m_c_it[i] - m_graph->m_phi_it[i]);
+    }
+    m_orig_tr_cap = m_tr_cap;
+}
+
+PairwiseBK::ArcId PairwiseBK::AddEdge(NodeId u, NodeId v, REAL cap, REAL rev_cap) {
+    ArcId uv = m_arc_head.size();
+    ArcId vu = uv + 1;
+    m_arc_head.push_back(v);
+    m_arc_cap.push_back(cap);
+    m_arc_next.push_back(m_first[u]);
+    m_first[u] = uv;
+    m_arc_head.push_back(u);
+    m_arc_cap.push_back(rev_cap);
+    m_arc_next.push_back(m_first[v]);
+    m_first[v] = vu;
+    return uv;
+}
+
+void PairwiseBK::SetActive(NodeId i) {
+    if (!m_is_active[i]) {
+        m_is_active[i] = true;
+        m_active.push_back(i);
+    }
+}
+
+PairwiseBK::NodeId PairwiseBK::NextActive() {
+    while (!m_active.empty()) {
+        NodeId i = m_active.front();
+        m_active.pop_front();
+        m_is_active[i] = false;
+        if (m_parent[i] != None())
+            return i;
+    }
+    return -1;
+}
+
+void PairwiseBK::SetOrphanFront(NodeId i) {
+    m_parent[i] = Orphan();
+    m_orphans.push_front(i);
+}
+
+void PairwiseBK::SetOrphanRear(NodeId i) {
+    m_parent[i] = Orphan();
+    m_orphans.push_back(i);
+}
+
+void PairwiseBK::MaxFlow() {
+    auto start = Clock::now();
+    // May include auxiliary nodes beyond those of m_graph
+    const NodeId n = m_first.size();
+
+    m_parent.assign(n, None());
+    m_ts.assign(n, 0);
+    m_dist.assign(n, 0);
+    m_is_sink.assign(n, false);
+    m_is_active.assign(n, false);
+    m_active.clear();
+    m_orphans.clear();
+    m_time = 0;
+
+    for (NodeId i = 0; i < n; ++i) {
+        if (m_tr_cap[i] != 0) {
+            m_is_sink[i] = (m_tr_cap[i] < 0);
+            m_parent[i] = Terminal();
+            m_dist[i] = 1;
+            SetActive(i);
+        }
+    }
+
+    NodeId current = -1;
+    while (true) {
+        Poll();
+        NodeId i = current;
+        if (i != -1 && m_parent[i] == None())
+            i = -1;
+        if (i == -1) {
+            i = NextActive();
+            if (i == -1)
+                break;
+        }
+
+        // Grow the tree containing i until we find an arc to the other tree
+        ArcId a = None();
+        if (!m_is_sink[i]) {
+            for (ArcId a0 = m_first[i]; a0 != None(); a0 = m_arc_next[a0]) {
+                if (m_arc_cap[a0] == 0)
+                    continue;
+                NodeId j = m_arc_head[a0];
+                if (m_parent[j] == None()) {
+                    m_is_sink[j] = false;
+                    m_parent[j] = Sister(a0);
+                    m_ts[j] = m_ts[i];
+                    m_dist[j] = m_dist[i] + 1;
+                    SetActive(j);
+                } else if (m_is_sink[j]) {
+                    a = a0;
+                    break;
+                } else if (m_ts[j] <= m_ts[i] && m_dist[j] > m_dist[i]) {
+                    m_parent[j] = Sister(a0);
+                    m_ts[j] = m_ts[i];
+                    m_dist[j] = m_dist[i] + 1;
+                }
+            }
+        } else {
+            for (ArcId a0 = m_first[i]; a0 != None(); a0 = m_arc_next[a0]) {
+                if (m_arc_cap[Sister(a0)] == 0)
+                    continue;
+                NodeId j = m_arc_head[a0];
+                if (m_parent[j] == None()) {
+                    m_is_sink[j] = true;
+                    m_parent[j] = Sister(a0);
+                    m_ts[j] = m_ts[i];
+                    m_dist[j] = m_dist[i] + 1;
+                    SetActive(j);
+                } else if (!m_is_sink[j]) {
+                    a = Sister(a0);
+                    break;
+                } else if (m_ts[j] <= m_ts[i] && m_dist[j] > m_dist[i]) {
+                    m_parent[j] = Sister(a0);
+                    m_ts[j] = m_ts[i];
+                    m_dist[j] = m_dist[i] + 1;
+                }
+            }
+        }
+
+        m_time++;
+        if (a != None()) {
+            // i may have more arcs to the other tree, so keep scanning it
+            current = i;
+            Augment(a);
+            while (!m_orphans.empty()) {
+                NodeId o = m_orphans.front();
+                m_orphans.pop_front();
+                ProcessOrphan(o, m_is_sink[o]);
+            }
+        } else {
+            current = -1;
+        }
+    }
+    m_totalTime += Duration{ Clock::now() - start }.count();
+}
+
+void PairwiseBK::Augment(ArcId middle_arc) {
+    m_num_augmentations++;
+    // Find bottleneck capacity
+    REAL bottleneck = m_arc_cap[middle_arc];
+    NodeId i;
+    ArcId a;
+    for (i = m_arc_head[Sister(middle_arc)]; ; i = m_arc_head[a]) {
+        a = m_parent[i];
+        if (a == Terminal())
+            break;
+        bottleneck = std::min(bottleneck, m_arc_cap[Sister(a)]);
+    }
+    bottleneck = std::min(bottleneck, m_tr_cap[i]);
+    for (i = m_arc_head[middle_arc]; ; i = m_arc_head[a]) {
+        a = m_parent[i];
+        if (a == Terminal())
+            break;
+        bottleneck = std::min(bottleneck, m_arc_cap[a]);
+    }
+    bottleneck = std::min(bottleneck, -m_tr_cap[i]);
+    ASSERT(bottleneck > 0);
+
+    // Augment along the path
+    m_arc_cap[Sister(middle_arc)] += bottleneck;
+    m_arc_cap[middle_arc] -= bottleneck;
+    for (i = m_arc_head[Sister(middle_arc)]; ; i = m_arc_head[a]) {
+        a = m_parent[i];
+        if (a == Terminal())
+            break;
+        m_arc_cap[a] += bottleneck;
+        m_arc_cap[Sister(a)] -= bottleneck;
+        if (m_arc_cap[Sister(a)] == 0)
+            SetOrphanFront(i);
+    }
+    m_tr_cap[i] -= bottleneck;
+    if (m_tr_cap[i] == 0)
+        SetOrphanFront(i);
+    for (i = m_arc_head[middle_arc]; ; i = m_arc_head[a]) {
+        a = m_parent[i];
+        if (a == Terminal())
+            break;
+        m_arc_cap[Sister(a)] += bottleneck;
+        m_arc_cap[a] -= bottleneck;
+        if (m_arc_cap[a] == 0)
+            SetOrphanFront(i);
+    }
+    m_tr_cap[i] += bottleneck;
+    if (m_tr_cap[i] == 0)
+        SetOrphanFront(i);
+}
+
+void PairwiseBK::ProcessOrphan(NodeId i, bool sink) {
+    const int infinite_d = std::numeric_limits<int>::max();
+    ArcId a0_min = None();
+    int d_min = infinite_d;
+
+    // Try to find a new valid parent, preferring the one closest to the
+    // terminal
+    for (ArcId a0 = m_first[i]; a0 != None(); a0 = m_arc_next[a0]) {
+        REAL cap = sink ? m_arc_cap[a0] : m_arc_cap[Sister(a0)];
+        if (cap == 0)
+            continue;
+        NodeId j = m_arc_head[a0];
+        if (m_is_sink[j] != sink || m_parent[j] == None())
+            continue;
+        // Check the origin of j
+        int d = 0;
+        while (true) {
+            if (m_ts[j] == m_time) {
+                d += m_dist[j];
+                break;
+            }
+            ArcId a = m_parent[j];
+            d++;
+            if (a == Terminal()) {
+                m_ts[j] = m_time;
+                m_dist[j] = 1;
+                break;
+            }
+            if (a == Orphan()) {
+                d = infinite_d;
+                break;
+            }
+            j = m_arc_head[a];
+        }
+        if (d < infinite_d) {
+            if (d < d_min) {
+                a0_min = a0;
+                d_min = d;
+            }
+            // Set marks along the path
+            for (j = m_arc_head[a0]; m_ts[j] != m_time; j = m_arc_head[m_parent[j]]) {
+                m_ts[j] = m_time;
+                m_dist[j] = d--;
+            }
+        }
+    }
+
+    m_parent[i] = a0_min;
+    if (a0_min != None()) {
+        m_ts[i] = m_time;
+        m_dist[i] = d_min + 1;
+    } else {
+        // No parent found, i becomes free. Process neighbors
+        for (ArcId a0 = m_first[i]; a0 != None(); a0 = m_arc_next[a0]) {
+            NodeId j = m_arc_head[a0];
+            ArcId a = m_parent[j];
+            if (m_is_sink[j] != sink || a == None())
+                continue;
+            REAL cap = sink ? m_arc_cap[a0] : m_arc_cap[Sister(a0)];
+            if (cap > 0)
+                SetActive(j);
+            if (a != Terminal() && a != Orphan() && m_arc_head[a] == i)
+                SetOrphanRear(j);
+        }
+    }
+}
+
+void PairwiseBK::WriteBackFlow() {
+    const NodeId n = m_graph->NumNodes();
+    const CliqueId m = m_graph->GetNumCliques();
+    for (CliqueId cid = 0; cid < m; ++cid) {
+        // Net flow from Nodes()[0] to Nodes()[1]
+        REAL flow = m_orig_arc_cap[2*cid] - m_arc_cap[2*cid];
+        auto& c = m_graph->clique(cid);
+        if (flow > 0)
+            c.Push(0, 1, flow);
+        else if (flow < 0)
+            c.Push(1, 0, -flow);
+    }
+    for (NodeId i = 0; i < n; ++i) {
+        // Terminal residuals of i after the flow: m_tr_cap never changes
+        // sign, so only one of these is nonzero
+        REAL res_s = std::max<REAL>(m_tr_cap[i], 0);
+        REAL res_t = std::max<REAL>(-m_tr_cap[i], 0);
+        m_graph->m_phi_si[i] = m_graph->m_c_si[i] - res_s;
+        m_graph->m_phi_it[i] = m_graph->m_c_it[i] - res_t;
+    }
+}
+
+void PairwiseBK::ComputeMinCut() {
+    // Source side is exactly the set of nodes still in the source tree
+    auto& labels = m_energy->GetLabels();
+    for (NodeId i = 0; i < m_graph->NumNodes(); ++i) {
+        if (m_parent[i] != None() && !m_is_sink[i])
+            labels[i] = 1;
+        else
+            labels[i] = 0;
+    }
+}
+
+void PairwiseBK::Solve(SubmodularIBFS* energy) {
+    m_energy = energy;
+    m_interrupt = energy->Params().interrupt;
+    m_graph = &energy->Graph();
+    energy->SetupFlow();
+    BuildGraph();
+    MaxFlow();
+    WriteBackFlow();
+    ComputeMinCut();
+}
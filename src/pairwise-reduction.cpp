@@ -0,0 +1,176 @@
+#include "flow-solver.hpp"
+
+#include "submodular-ibfs.hpp"
+
+bool PairwiseReduction::ReduceClique(CliqueId cid) {
+    const auto& c = m_graph->clique(cid);
+    const auto& nodes = c.Nodes();
+    const size_t k = c.Size();
+    const Assignment num_assgns = 1 << k;
+
+    // Moebius transform, so that m_coeffs[T] is the coefficient of the
+    // product of x_i for i in T
+    m_coeffs = c.AlphaEnergy();
+    for (size_t i = 0; i < k; ++i) {
+        for (Assignment t = 0; t < num_assgns; ++t) {
+            if (t & (1 << i))
+                m_coeffs[t] -= m_coeffs[t ^ (1 << i)];
+        }
+    }
+    ASSERT(m_coeffs[0] == 0);
+    const size_t linear = m_linear.size();
+    for (size_t i = 0; i < k; ++i)
+        m_linear.push_back(m_coeffs[1 << i]);
+
+    // Higher order terms first, since the positive ones add quadratic terms
+    for (Assignment t = 0; t < num_assgns; ++t) {
+        const int order = __builtin_popcount(t);
+        const REAL a = m_coeffs[t];
+        if (order < 3 || a == 0)
+            continue;
+        const int f = __builtin_ctz(t);
+        const NodeId w = m_first.size();
+        m_first.push_back(None());
+        if (a < 0) {
+            // a x_f prod(x_b) = -a x_f (1 - prod(x_b)) + a x_f, where the
+            // first term is the min over w of the cut with edges x_f -> w
+            // and w -> x_b
+            AddEdge(nodes[f], w, -a, 0);
+            for (size_t b = f+1; b < k; ++b) {
+                if (t & (1 << b))
+                    AddEdge(w, nodes[b], -a, 0);
+            }
+            m_linear[linear+f] += a;
+        } else if (order == 3) {
+            // a x_f x_b x_c = a (1 - x_f)(x_b + x_c - x_b x_c)
+            //      - a (x_b + x_c) + a (x_b x_c + x_f x_b + x_f x_c)
+            // where the first term is the min over w of the cut with
+            // edges w -> x_f, x_b -> w and x_c -> w
+            const Assignment rest = t ^ (1 << f);
+            const int b = __builtin_ctz(rest);
+            const int c = __builtin_ctz(rest ^ (1 << b));
+            AddEdge(w, nodes[f], a, 0);
+            AddEdge(nodes[b], w, a, 0);
+            AddEdge(nodes[c], w, a, 0);
+            m_linear[linear+b] -= a;
+            m_linear[linear+c] -= a;
+            m_coeffs[rest] += a;
+            m_coeffs[(1 << f) | (1 << b)] += a;
+            m_coeffs[(1 << f) | (1 << c)] += a;
+        } else {
+            return false;
+        }
+    }
+
+    // Quadratic terms a x_i x_j = -a x_i (1 - x_j) + a x_i, which is an edge
+    // i -> j if a <= 0
+    for (Assignment t = 0; t < num_assgns; ++t) {
+        const REAL a = m_coeffs[t];
+        if (__builtin_popcount(t) != 2 || a == 0)
+            continue;
+        if (a > 0)
+            return false;
+        const int i = __builtin_ctz(t);
+        const int j = __builtin_ctz(t ^ (1 << i));
+        AddEdge(nodes[i], nodes[j], -a, 0);
+        m_linear[linear+i] += a;
+    }
+    return true;
+}
+
+bool PairwiseReduction::BuildReducedGraph() {
+    const NodeId n = m_graph->NumNodes();
+    const CliqueId m = m_graph->GetNumCliques();
+
+    m_first.assign(n, None());
+    m_arc_head.clear();
+    m_arc_next.clear();
+    m_arc_cap.clear();
+    m_clique_arcs.clear();
+    m_clique_linear.clear();
+    m_linear.clear();
+    for (CliqueId cid = 0; cid < m; ++cid) {
+        m_clique_arcs.push_back(m_arc_head.size());
+        m_clique_linear.push_back(m_linear.size());
+        if (!ReduceClique(cid))
+            return false;
+    }
+    m_clique_arcs.push_back(m_arc_head.size());
+    m_orig_arc_cap = m_arc_cap;
+
+    // Auxiliary nodes have no terminal edges
+    m_tr_cap.assign(m_first.size(), 0);
+    for (NodeId i = 0; i < n; ++i) {
+        m_tr_cap[i] = (m_graph->m_c_si[i] - m_graph->m_phi_si[i])
+            - (m_graph->m_c_it[i] - m_graph->m_phi_it[i]);
+    }
+    // A linear term a x_i costs a if i is in S, which is an edge i -> t
+    for (CliqueId cid = 0; cid < m; ++cid) {
+        const auto& nodes = m_graph->clique(cid).Nodes();
+        for (size_t i = 0; i < nodes.size(); ++i)
+            m_tr_cap[nodes[i]] -= m_linear[m_clique_linear[cid]+i];
+    }
+    m_orig_tr_cap = m_tr_cap;
+    return true;
+}
+
+void PairwiseReduction::WriteBackReducedFlow() {
+    const NodeId n = m_graph->NumNodes();
+    const CliqueId m = m_graph->GetNumCliques();
+    std::vector<REAL> beta;
+    for (CliqueId cid = 0; cid < m; ++cid) {
+        auto& c = m_graph->clique(cid);
+        const size_t k = c.Size();
+        // Net flow out of each node of c, through the edges of c and its
+        // linear term
+        beta.assign(m_linear.begin() + m_clique_linear[cid],
+                m_linear.begin() + m_clique_linear[cid] + k);
+        for (ArcId a = m_clique_arcs[cid]; a < m_clique_arcs[cid+1]; a += 2) {
+            REAL flow = m_orig_arc_cap[a] - m_arc_cap[a];
+            NodeId u = m_arc_head[Sister(a)];
+            NodeId v = m_arc_head[a];
+            if (u < n)
+                beta[c.GetIndex(u)] += flow;
+            if (v < n)
+                beta[c.GetIndex(v)] -= flow;
+        }
+        // beta sums to 0, so push it from the nodes with positive net flow
+        // to those with negative net flow
+        size_t u = 0, v = 0;
+        while (true) {
+            while (u < k && beta[u] <= 0)
+                u++;
+            while (v < k && beta[v] >= 0)
+                v++;
+            if (u == k || v == k)
+                break;
+            REAL delta = std::min(beta[u], -beta[v]);
+            c.Push(u, v, delta);
+            beta[u] -= delta;
+            beta[v] += delta;
+        }
+        ASSERT(u == k && v == k);
+    }
+    for (NodeId i = 0; i < n; ++i) {
+        REAL res_s = std::max<REAL>(m_tr_cap[i], 0);
+        REAL res_t = std::max<REAL>(-m_tr_cap[i], 0);
+        m_graph->m_phi_si[i] = m_graph->m_c_si[i] - res_s;
+        m_graph->m_phi_it[i] = m_graph->m_c_it[i] - res_t;
+    }
+}
+
+void PairwiseReduction::Solve(SubmodularIBFS* energy) {
+    m_energy = energy;
+    m_interrupt = energy->Params().interrupt;
+    m_graph = &energy->Graph();
+    energy->SetupFlow();
+    if (!BuildReducedGraph()) {
+        if (!m_fallback)
+            m_fallback.reset(new BidirectionalIBFS{});
+        m_fallback->Solve(energy);
+        return;
+    }
+    MaxFlow();
+    WriteBackReducedFlow();
+    ComputeMinCut();
+}
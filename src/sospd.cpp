@@ -2,6 +2,12 @@
 #include "multilabel-energy.hpp"
 
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+
+// Chunks of cliques or nodes smaller than this aren't worth a thread
+static const size_t cliqueGrain = 1024;
+static const size_t nodeGrain = 4096;
 
 template <typename Flow>
 SoSPD<Flow>::SoSPD(const MultilabelEnergy* energy)
@@ -12,6 +18,19 @@ SoSPD<Flow>::SoSPD(const MultilabelEnergy* energy)
     m_fusion_labels(energy->numVars(), 0),
     m_expansion_submodular(false),
     m_lower_bound(false),
+    m_fused_dual_update(true),
+    m_scores_valid(false),
+    m_alpha_expansion(false),
+    m_next_alpha(0),
+    m_unchanged_labels(0),
+    m_best_energy(std::numeric_limits<REAL>::max()),
+    m_best_dual(-std::numeric_limits<double>::max()),
+    m_gap_target(0),
+    m_bound_scale(-1),
+    m_num_candidates(1),
+    m_candidate_labels(0),
+    m_candidate_refresh(0),
+    m_slots(energy->numLabels()),
     m_iter(0),
     m_pc([&](int, const std::vector<Label>&, std::vector<Label>&) { HeightAlphaProposal(); })
 { }
@@ -25,6 +44,19 @@ SoSPD<Flow>::SoSPD(const MultilabelEnergy* energy, SubmodularIBFSParams& params)
     m_fusion_labels(energy->numVars(), 0),
     m_expansion_submodular(false),
     m_lower_bound(false),
+    m_fused_dual_update(true),
+    m_scores_valid(false),
+    m_alpha_expansion(false),
+    m_next_alpha(0),
+    m_unchanged_labels(0),
+    m_best_energy(std::numeric_limits<REAL>::max()),
+    m_best_dual(-std::numeric_limits<double>::max()),
+    m_gap_target(0),
+    m_bound_scale(-1),
+    m_num_candidates(1),
+    m_candidate_labels(0),
+    m_candidate_refresh(0),
+    m_slots(energy->numLabels()),
     m_iter(0),
     m_pc([&](int, const std::vector<Label>&, std::vector<Label>&) { HeightAlphaProposal(); })
 { }
@@ -50,16 +82,48 @@ void SoSPD<Flow>::InitialLabeling() {
 
 template <typename Flow>
 void SoSPD<Flow>::InitialDual() {
+    // Pick the candidate labels of each node by unary cost. The initial
+    // labeling has the smallest unary, so it is always among them
+    const VarId n = m_energy->numVars();
+    m_slots = m_num_labels;
+    m_label_sets.clear();
+    m_other_unary.clear();
+    if (0 < m_candidate_labels && size_t(m_candidate_labels) < m_num_labels) {
+        m_slots = m_candidate_labels;
+        m_label_sets.resize(n*m_slots);
+        m_other_unary.resize(n);
+        std::vector<REAL> cost(m_num_labels);
+        std::vector<Label> order;
+        for (VarId i = 0; i < n; ++i) {
+            for (Label l = 0; l < m_num_labels; ++l)
+                cost[l] = m_energy->unary(i, l);
+            ChooseLabels(i, cost, order, &m_label_sets[i*m_slots]);
+        }
+    }
+
     // Initialize heights
-    m_heights = std::vector<REAL>(m_energy->numVars()*m_num_labels, 0);
-    for (VarId i = 0; i < m_energy->numVars(); ++i)
-        for (Label l = 0; l < m_num_labels; ++l)
-            Height(i, l) = m_energy->unary(i, l);
+    m_heights = std::vector<REAL>(n*m_slots, 0);
+    m_scores_valid = false;
+    for (VarId i = 0; i < n; ++i)
+        for (size_t s = 0; s < m_slots; ++s)
+            m_heights[i*m_slots+s] = m_energy->unary(i, SlotLabel(i, s));
+
+    // The duals of all cliques share one buffer, clique alpha starting at
+    // m_dual_offsets[alpha]
+    const auto& cliques = m_energy->cliques();
+    m_dual_offsets.resize(cliques.size()+1);
+    size_t offset = 0;
+    for (size_t alpha = 0; alpha < cliques.size(); ++alpha) {
+        m_dual_offsets[alpha] = offset;
+        offset += cliques[alpha]->size()*m_slots;
+        ASSERT(offset <= std::numeric_limits<uint32_t>::max());
+    }
+    m_dual_offsets.back() = offset;
+    m_dual.assign(offset, 0);
 
-    m_dual.clear();
     Label labelBuf[32];
-    for (const CliquePtr& cp : m_energy->cliques()) {
-        const Clique& c = *cp;
+    for (size_t alpha = 0; alpha < cliques.size(); ++alpha) {
+        const Clique& c = *cliques[alpha];
 		const VarId* nodes = c.nodes();
 		int k = c.size();
         ASSERT(k < 32);
@@ -67,15 +131,14 @@ void SoSPD<Flow>::InitialDual() {
             labelBuf[i] = m_labels[nodes[i]];
 		}
 		REAL energy = c.energy(labelBuf);
-        m_dual.emplace_back(k*m_num_labels, 0);
-		LambdaAlpha& lambda_a = m_dual.back();
+		REAL* lambda_a = lambdaAlpha(alpha);
 
         ASSERT(energy >= 0);
         REAL avg = energy / k;
         int remainder = energy % k;
         for (int i = 0; i < k; ++i) {
             Label l = m_labels[nodes[i]];
-            REAL& lambda_ail = dualVariable(lambda_a, i, l);
+            REAL& lambda_ail = dualVariable(lambda_a, i, Slot(nodes[i], l));
             lambda_ail = avg;
             if (i < remainder) // Have to distribute remainder to maintain average
                 lambda_ail += 1;
@@ -86,174 +149,257 @@ void SoSPD<Flow>::InitialDual() {
 
 template <typename Flow>
 void SoSPD<Flow>::InitialNodeCliqueList() {
+    // For each node, the offsets in m_dual of its rows of duals, one per
+    // clique it is in, laid out by node as in a CSR matrix. Needs the
+    // offsets from InitialDual
     size_t n = m_labels.size();
-    m_node_clique_list.clear();
-    m_node_clique_list.resize(n);
+    const auto& cliques = m_energy->cliques();
+    m_node_clique_offsets.assign(n+1, 0);
+    for (const CliquePtr& cp : cliques) {
+        const VarId* nodes = cp->nodes();
+        for (size_t i = 0; i < cp->size(); ++i)
+            m_node_clique_offsets[nodes[i]+1]++;
+    }
+    for (size_t i = 0; i < n; ++i)
+        m_node_clique_offsets[i+1] += m_node_clique_offsets[i];
+    m_node_dual_rows.resize(m_node_clique_offsets[n]);
+    std::vector<uint32_t> next(m_node_clique_offsets.begin(), m_node_clique_offsets.end()-1);
+    for (size_t alpha = 0; alpha < cliques.size(); ++alpha) {
+        const VarId* nodes = cliques[alpha]->nodes();
+        for (size_t i = 0; i < cliques[alpha]->size(); ++i)
+            m_node_dual_rows[next[nodes[i]]++] = m_dual_offsets[alpha] + i*m_slots;
+    }
+}
 
-    int clique_index = 0;
-    for (const CliquePtr& cp : m_energy->cliques()) {
-        const Clique& c = *cp;
-        const VarId* nodes = c.nodes();
-        const size_t k = c.size();
-        for (size_t i = 0; i < k; ++i) {
-            m_node_clique_list[nodes[i]].push_back(std::make_pair(clique_index, i));
+template <typename Flow>
+void SoSPD<Flow>::ChooseLabels(VarId i, const std::vector<REAL>& cost,
+        std::vector<Label>& order, Label* out) {
+    // The current label, and the m_slots-1 others of least cost
+    order.resize(m_num_labels);
+    for (Label l = 0; l < m_num_labels; ++l)
+        order[l] = l;
+    std::swap(order[0], order[m_labels[i]]);
+    std::nth_element(order.begin()+1, order.begin()+m_slots, order.end(),
+            [&](Label a, Label b) {
+                return cost[a] < cost[b] || (cost[a] == cost[b] && a < b);
+            });
+    std::copy(order.begin(), order.begin()+m_slots, out);
+    std::sort(out, out+m_slots);
+    REAL other = std::numeric_limits<REAL>::max();
+    for (size_t j = m_slots; j < m_num_labels; ++j)
+        other = std::min(other, m_energy->unary(i, order[j]));
+    m_other_unary[i] = other;
+}
+
+template <typename Flow>
+void SoSPD<Flow>::RefreshLabelSets() {
+    // Each node keeps its current label and the others of least height,
+    // where a label without duals has its unary as height. Kept labels
+    // keep their duals, and so their heights; new ones start at a dual of 0
+    const size_t n = m_labels.size();
+    const int numThreads = m_ibfs.Params().numThreads;
+    std::vector<Label> sets(n*m_slots);
+    std::vector<REAL> heights(n*m_slots);
+    ParallelChunks(n, NumChunks(n, numThreads, nodeGrain),
+            [&](size_t, size_t begin, size_t end) {
+        std::vector<REAL> cost(m_num_labels);
+        std::vector<Label> order;
+        for (size_t i = begin; i < end; ++i) {
+            for (Label l = 0; l < m_num_labels; ++l)
+                cost[l] = m_energy->unary(i, l);
+            for (size_t s = 0; s < m_slots; ++s)
+                cost[SlotLabel(i, s)] = m_heights[i*m_slots+s];
+            Label* row = &sets[i*m_slots];
+            ChooseLabels(i, cost, order, row);
+            for (size_t s = 0; s < m_slots; ++s)
+                heights[i*m_slots+s] = cost[row[s]];
         }
-        ++clique_index;
-    }
+    });
+    const auto& cliques = m_energy->cliques();
+    ParallelChunks(cliques.size(), NumChunks(cliques.size(), numThreads, cliqueGrain),
+            [&](size_t, size_t begin, size_t end) {
+        std::vector<REAL> lambda;
+        for (size_t c = begin; c < end; ++c) {
+            const VarId* nodes = cliques[c]->nodes();
+            const size_t k = cliques[c]->size();
+            REAL* lambda_a = lambdaAlpha(c);
+            lambda.assign(k*m_slots, 0);
+            for (size_t j = 0; j < k; ++j) {
+                for (size_t s = 0; s < m_slots; ++s) {
+                    const size_t old = Slot(nodes[j], sets[nodes[j]*m_slots+s]);
+                    if (old < m_slots)
+                        lambda[j*m_slots+s] = lambda_a[j*m_slots+old];
+                }
+            }
+            std::copy(lambda.begin(), lambda.end(), lambda_a);
+        }
+    });
+    m_label_sets.swap(sets);
+    m_heights.swap(heights);
+    m_scores_valid = false;
 }
 
 template <typename Flow>
-void SoSPD<Flow>::PreEditDual(Flow& crf) {
+void SoSPD<Flow>::PreEditDual(Flow& crf, const std::vector<Label>& fusion) {
     auto& fixedVars = crf.Params().fixedVars;
     fixedVars.resize(m_labels.size());
     for (size_t i = 0; i < m_labels.size(); ++i)
-            fixedVars[i] = (m_labels[i] == m_fusion_labels[i]);
-
-    // Allocate all the buffers we need in one place, resize as necessary
-    Label label_buf[32];
-    std::vector<Label> current_labels;
-    std::vector<Label> fusion_labels;
-    std::vector<REAL> psi;
-    std::vector<REAL> current_lambda;
-    std::vector<REAL> fusion_lambda;
-
-    auto& ibfs_cliques = crf.Graph().GetCliques();
-    ASSERT(ibfs_cliques.size() == m_energy->cliques().size());
-    int clique_index = 0;
-    for (const CliquePtr& cp : m_energy->cliques()) {
-        const Clique& c = *cp;
-        const size_t k = c.size();
-        ASSERT(k < 32);
+            fixedVars[i] = (m_labels[i] == fusion[i]);
+
+    ASSERT(crf.Graph().GetCliques().size() == m_energy->cliques().size());
+    // Cliques are independent, so they are split between threads, each
+    // with its own buffers
+    const auto& cliques = m_energy->cliques();
+    ParallelChunks(cliques.size(), NumChunks(cliques.size(), crf.Params().numThreads, cliqueGrain),
+            [&](size_t, size_t begin, size_t end) {
+        // Allocate all the buffers we need in one place, resize as necessary
+        std::vector<Label> current_labels;
+        std::vector<Label> fusion_labels;
+        std::vector<REAL> psi;
+        std::vector<REAL> current_lambda;
+        std::vector<REAL> fusion_lambda;
+
+        for (size_t clique_index = begin; clique_index < end; ++clique_index) {
+            const Clique& c = *cliques[clique_index];
+            const size_t k = c.size();
+            ASSERT(k < 32);
+
+            const REAL* lambda_a = lambdaAlpha(clique_index);
+
+            auto& ibfs_c = crf.GetClique(clique_index);
+            ASSERT(k == ibfs_c.Size());
+            std::vector<REAL>& energy_table = ibfs_c.MutableEnergyTable();
+            Assgn max_assgn = 1 << k;
+            ASSERT(energy_table.size() == max_assgn);
+
+            psi.resize(k);
+            current_labels.resize(k);
+            fusion_labels.resize(k);
+            current_lambda.resize(k);
+            fusion_lambda.resize(k);
+            for (size_t i = 0; i < k; ++i) {
+                current_labels[i] = m_labels[c.nodes()[i]];
+                fusion_labels[i] = fusion[c.nodes()[i]];
+                /*
+                 *ASSERT(0 <= c.nodes()[i] && c.nodes()[i] < m_labels.size());
+                 *ASSERT(0 <= current_labels[i] && current_labels[i] < m_num_labels);
+                 *ASSERT(0 <= fusion_labels[i] && fusion_labels[i] < m_num_labels);
+                 */
+                current_lambda[i] = dualVariable(lambda_a, i,
+                        Slot(c.nodes()[i], current_labels[i]));
+                fusion_lambda[i] = dualVariable(lambda_a, i,
+                        Slot(c.nodes()[i], fusion_labels[i]));
+            }
 
-        auto& lambda_a = lambdaAlpha(clique_index);
-
-        auto& ibfs_c = ibfs_cliques[clique_index];
-        ASSERT(k == ibfs_c.Size());
-        std::vector<REAL>& energy_table = ibfs_c.EnergyTable();
-        Assgn max_assgn = 1 << k;
-        ASSERT(energy_table.size() == max_assgn);
-
-        psi.resize(k);
-        current_labels.resize(k);
-        fusion_labels.resize(k);
-        current_lambda.resize(k);
-        fusion_lambda.resize(k);
-        for (size_t i = 0; i < k; ++i) {
-            current_labels[i] = m_labels[c.nodes()[i]];
-            fusion_labels[i] = m_fusion_labels[c.nodes()[i]];
-            /*
-             *ASSERT(0 <= c.nodes()[i] && c.nodes()[i] < m_labels.size());
-             *ASSERT(0 <= current_labels[i] && current_labels[i] < m_num_labels);
-             *ASSERT(0 <= fusion_labels[i] && fusion_labels[i] < m_num_labels);
-             */
-            current_lambda[i] = dualVariable(lambda_a, i, current_labels[i]);
-            fusion_lambda[i] = dualVariable(lambda_a, i, fusion_labels[i]);
-        }
+            // Compute costs of all fusion assignments
+            c.fusionTable(current_labels.data(), fusion_labels.data(),
+                    energy_table.data());
 
-        // Compute costs of all fusion assignments
-        {
-            Assgn last_gray = 0;
-            for (size_t i_idx = 0; i_idx < k; ++i_idx)
-                label_buf[i_idx] = current_labels[i_idx];
-            energy_table[0] = c.energy(label_buf);
-            for (Assgn a = 1; a < max_assgn; ++a) {
-                Assgn gray = a ^ (a >> 1);
-                Assgn diff = gray ^ last_gray;
-                int changed_idx = __builtin_ctz(diff);
-                if (diff & gray)
-                    label_buf[changed_idx] = fusion_labels[changed_idx];
-                else
-                    label_buf[changed_idx] = current_labels[changed_idx];
-                last_gray = gray;
-                energy_table[gray] = c.energy(label_buf);
-            }
+            // Compute the residual function 
+            // g(S) - lambda_fusion(S) - lambda_current(C\S)
+            SubtractLinear(k, energy_table, fusion_lambda, current_lambda);
+            ASSERT(energy_table[0] == 0); // Check tightness of current labeling
         }
-
-        // Compute the residual function 
-        // g(S) - lambda_fusion(S) - lambda_current(C\S)
-        SubtractLinear(k, energy_table, fusion_lambda, current_lambda);
-        ASSERT(energy_table[0] == 0); // Check tightness of current labeling
-
-        // Debugging code
-        /*
-         *if (clique_index == 582) {
-         *    std::cout << "Examining clique " << clique_index << "\n";
-         *    std::cout << "Energy: ";
-         *    for (auto e : ibfs_c.EnergyTable())
-         *        std::cout << e << ", ";
-         *    std::cout << "\n";
-         *    std::cout << "AlphaEnergy: ";
-         *    for (auto e : ibfs_c.AlphaEnergy())
-         *        std::cout << e << ", ";
-         *    std::cout << "\n";
-         *    std::cout << "AlphaCi: ";
-         *    for (auto a : ibfs_c.AlphaCi())
-         *        std::cout << a << ", ";
-         *    std::cout << "\n";
-         *    std::cout << "Labeling: ";
-         *    uint32_t assgn = 0;
-         *    for (size_t j = 0; j < ibfs_c.Nodes().size(); ++j) {
-         *        int l = crf.GetLabel(ibfs_c.Nodes()[j]);
-         *        std::cout << l << ", ";
-         *        assgn |= (l << j);
-         *    }
-         *    std::cout << "\t hex: " << assgn << "\n";
-         *    std::cout << "lambda current: ";
-         *    for (size_t j = 0; j < ibfs_c.Nodes().size(); ++j)
-         *        std::cout << dualVariable(clique_index, j, m_labels[c.nodes()[j]]) << ", ";
-         *    std::cout << "\n";
-         *    std::cout << "lambda fusion: ";
-         *    for (size_t j = 0; j < ibfs_c.Nodes().size(); ++j)
-         *        std::cout << dualVariable(clique_index, j, m_fusion_labels[c.nodes()[j]]) << ", ";
-         *    std::cout << "\n";
-         *}
-         */
-        ++clique_index;
-    }
+    });
 }
 
 template <typename Flow>
 REAL SoSPD<Flow>::ComputeHeight(VarId i, Label x) {
     REAL ret = m_energy->unary(i, x);
-    for (const auto& p : m_node_clique_list[i]) {
-        ret += dualVariable(p.first, p.second, x);
-    }
+    const size_t s = Slot(i, x);
+    for (uint32_t j = m_node_clique_offsets[i]; j < m_node_clique_offsets[i+1]; ++j)
+        ret += m_dual[m_node_dual_rows[j]+s];
     return ret;
 }
 
 template <typename Flow>
 REAL SoSPD<Flow>::ComputeHeightDiff(VarId i, Label l1, Label l2) const {
     REAL ret = m_energy->unary(i, l1) - m_energy->unary(i, l2);
-    for (const auto& p : m_node_clique_list[i]) {
-        ret += dualVariable(p.first, p.second, l1)
-            - dualVariable(p.first, p.second, l2);
+    const size_t s1 = Slot(i, l1);
+    const size_t s2 = Slot(i, l2);
+    for (uint32_t j = m_node_clique_offsets[i]; j < m_node_clique_offsets[i+1]; ++j) {
+        const REAL* row = &m_dual[m_node_dual_rows[j]];
+        ret += row[s1] - row[s2];
     }
     return ret;
 }
 
+template <typename Flow>
+void SoSPD<Flow>::RefreshHeights(VarId i, Label x, Label y, bool moved, REAL* scoreDelta) {
+    const REAL hx = ComputeHeight(i, x);
+    const REAL hy = (y == x) ? hx : ComputeHeight(i, y);
+    if (!scoreDelta) {
+        Height(i, x) = hx;
+        Height(i, y) = hy;
+        return;
+    }
+    const Label c = m_labels[i];
+    const REAL hc = (x == c) ? hx : (y == c) ? hy : Height(i, c);
+    if (moved || hc != Height(i, c)) {
+        // The height every other label is compared against changed, so
+        // the whole row of the node is redone
+        if (!moved)
+            AddScoreRow(i, false, scoreDelta);
+        Height(i, x) = hx;
+        Height(i, y) = hy;
+        AddScoreRow(i, true, scoreDelta);
+    } else {
+        const Label ls[2] = { x, y };
+        const REAL hs[2] = { hx, hy };
+        for (int j = 0; j < 2; ++j) {
+            if (ls[j] == c || (j == 1 && y == x))
+                continue;
+            scoreDelta[ls[j]] -= std::max<REAL>(hc - Height(i, ls[j]), 0);
+            Height(i, ls[j]) = hs[j];
+            scoreDelta[ls[j]] += std::max<REAL>(hc - hs[j], 0);
+        }
+    }
+}
+
+template <typename Flow>
+void SoSPD<Flow>::AddScoreRow(VarId i, bool add, REAL* scores) const {
+    const REAL* h = &m_heights[i*m_slots];
+    const REAL hc = h[Slot(i, m_labels[i])];
+    for (size_t s = 0; s < m_slots; ++s) {
+        const REAL diff = hc - h[s];
+        if (diff > 0)
+            scores[SlotLabel(i, s)] += add ? diff : -diff;
+    }
+}
+
+template <typename Flow>
+void SoSPD<Flow>::AddScoreDelta(const std::vector<REAL>& scoreDelta) {
+    for (size_t j = 0; j < scoreDelta.size(); ++j)
+        m_label_scores[j % m_num_labels] += scoreDelta[j];
+}
+
 template <typename Flow>
 void SoSPD<Flow>::SetupGraph(Flow& crf) {
-    typedef int32_t Assgn;
     const size_t n = m_labels.size();
+    crf.Reserve(n, m_energy->cliques().size());
     crf.AddNode(n);
 
+    // The energy tables are filled in by PreEditDual, so the cliques start
+    // out with zero tables, and are linked to their nodes all at once
     for (const CliquePtr& cp : m_energy->cliques()) {
         const Clique& c = *cp;
         const size_t k = c.size();
         ASSERT(k < 32);
-        const Assgn max_assgn = 1 << k;
-        std::vector<typename Flow::NodeId> nodes(c.nodes(), c.nodes() + c.size());
-        crf.AddClique(nodes, std::vector<REAL>(max_assgn, 0));
+        crf.AddCliques(k, 1, c.nodes());
     }
+    crf.Graph().Freeze();
+    // The zero tables are all shared, and PreEditDual rewrites them from
+    // several threads
+    crf.Graph().UnshareTables();
 }
 
 template <typename Flow>
-void SoSPD<Flow>::SetupAlphaEnergy(Flow& crf) {
+void SoSPD<Flow>::SetupAlphaEnergy(Flow& crf, const std::vector<Label>& fusion) {
     const size_t n = m_labels.size();
     crf.ClearUnaries();
     crf.AddConstantTerm(-crf.GetConstantTerm());
     for (size_t i = 0; i < n; ++i) {
-        REAL height_diff = ComputeHeightDiff(i, m_labels[i], m_fusion_labels[i]);
+        REAL height_diff = ComputeHeightDiff(i, m_labels[i], fusion[i]);
         if (height_diff > 0) {
             crf.AddUnaryTerm(i, height_diff, 0);
         }
@@ -265,109 +411,131 @@ void SoSPD<Flow>::SetupAlphaEnergy(Flow& crf) {
 
 template <typename Flow>
 bool SoSPD<Flow>::UpdatePrimalDual(Flow& crf) {
-    bool ret = false;
-    SetupAlphaEnergy(crf);
+    SetupAlphaEnergy(crf, m_fusion_labels);
     crf.Solve();
+    return ApplyMove(crf);
+}
+
+template <typename Flow>
+bool SoSPD<Flow>::ApplyMove(Flow& crf) {
+    bool ret = false;
     VarId n = m_labels.size();
+    // Nodes changing label take their old row out of the label scores now,
+    // while their heights still match it
+    std::vector<bool> moved(m_scores_valid ? n : 0, false);
     for (VarId i = 0; i < n; ++i) {
         int crf_label = crf.GetLabel(i);
         if (crf_label == 1) {
             Label alpha = m_fusion_labels[i];
-            if (m_labels[i] != alpha) ret = true;
+            if (m_labels[i] != alpha) {
+                ret = true;
+                if (m_scores_valid) {
+                    AddScoreRow(i, false, m_label_scores.data());
+                    moved[i] = true;
+                }
+            }
             m_labels[i] = alpha;
         }
     }
-    const auto& clique = crf.Graph().GetCliques();
-    size_t i = 0;
-    for (const CliquePtr& cp : m_energy->cliques()) {
-        const Clique& c = *cp;
-        auto& ibfs_c = clique[i];
-        const std::vector<REAL>& phiCi = ibfs_c.AlphaCi();
-        for (size_t j = 0; j < phiCi.size(); ++j) {
-            dualVariable(i, j, m_fusion_labels[c.nodes()[j]]) += phiCi[j];
-            Height(c.nodes()[j], m_fusion_labels[c.nodes()[j]]) += phiCi[j];
+    // Each clique only changes its own duals. The heights they add up to
+    // are recomputed per node afterwards, so no two threads write the same
+    // height
+    const auto& cliques = m_energy->cliques();
+    const int numThreads = m_ibfs.Params().numThreads;
+    const bool fused = m_fused_dual_update;
+    ParallelChunks(cliques.size(), NumChunks(cliques.size(), numThreads, cliqueGrain),
+            [&](size_t, size_t begin, size_t end) {
+        Label labelBuf[32];
+        for (size_t i = begin; i < end; ++i) {
+            const Clique& c = *cliques[i];
+            const VarId* nodes = c.nodes();
+            const auto& ibfs_c = crf.GetClique(i);
+            const std::vector<REAL>& phiCi = ibfs_c.AlphaCi();
+            const int k = phiCi.size();
+            // The residual table from PreEditDual plus the duals before this
+            // update gives the energy of the new labeling, which saves
+            // PostEditDual from evaluating the clique again
+            REAL energy = 0;
+            if (fused) {
+                const std::vector<REAL>& table = ibfs_c.EnergyTable();
+                Assgn a = 0;
+                for (int j = 0; j < k; ++j) {
+                    labelBuf[j] = m_labels[nodes[j]];
+                    if (labelBuf[j] == m_fusion_labels[nodes[j]])
+                        a |= 1 << j;
+                    energy += dualVariable(i, j, labelBuf[j]);
+                }
+                energy += table[a];
+            }
+            for (int j = 0; j < k; ++j)
+                dualVariable(i, j, m_fusion_labels[nodes[j]]) += phiCi[j];
+            if (fused)
+                CorrectDual(i, k, labelBuf, energy);
         }
-        // Debugging code
-        /*
-         *if (i == 582) {
-         *    std::cout << "Examining clique " << i << "\n";
-         *    std::cout << "Energy: ";
-         *    for (auto e : ibfs_c.EnergyTable())
-         *        std::cout << e << ", ";
-         *    std::cout << "\n";
-         *    std::cout << "AlphaEnergy: ";
-         *    for (auto e : ibfs_c.AlphaEnergy())
-         *        std::cout << e << ", ";
-         *    std::cout << "\n";
-         *    std::cout << "AlphaCi: ";
-         *    for (auto a : ibfs_c.AlphaCi())
-         *        std::cout << a << ", ";
-         *    std::cout << "\n";
-         *    std::cout << "Labeling: ";
-         *    uint32_t assgn = 0;
-         *    for (size_t j = 0; j < ibfs_c.Nodes().size(); ++j) {
-         *        int l = crf.GetLabel(ibfs_c.Nodes()[j]);
-         *        std::cout << l << ", ";
-         *        assgn |= (l << j);
-         *    }
-         *    std::cout << "\t hex: " << assgn << "\n";
-         *    std::cout << "lambda current: ";
-         *    for (size_t j = 0; j < ibfs_c.Nodes().size(); ++j)
-         *        std::cout << dualVariable(i, j, m_labels[c.nodes()[j]]) << ", ";
-         *    std::cout << "\n";
-         *    std::cout << "lambda fusion: ";
-         *    for (size_t j = 0; j < ibfs_c.Nodes().size(); ++j)
-         *        std::cout << dualVariable(i, j, m_fusion_labels[c.nodes()[j]]) << ", ";
-         *    std::cout << "\n";
-         *}
-         */
-        ++i;
-    }
+    });
+    const size_t nodeChunks = NumChunks(n, numThreads, nodeGrain);
+    std::vector<REAL> scoreDelta(m_scores_valid ? nodeChunks*m_num_labels : 0, 0);
+    ParallelChunks(n, nodeChunks, [&](size_t chunk, size_t begin, size_t end) {
+        REAL* delta = m_scores_valid ? &scoreDelta[chunk*m_num_labels] : nullptr;
+        for (size_t i = begin; i < end; ++i) {
+            const Label y = fused ? m_labels[i] : m_fusion_labels[i];
+            RefreshHeights(i, m_fusion_labels[i], y,
+                    m_scores_valid && moved[i], delta);
+        }
+    });
+    AddScoreDelta(scoreDelta);
     return ret;
 }
 
+template <typename Flow>
+void SoSPD<Flow>::CorrectDual(size_t clique_index, int k, const Label* labels, REAL energy) {
+    REAL lambdaSum = 0;
+    for (int i = 0; i < k; ++i)
+        lambdaSum += dualVariable(clique_index, i, labels[i]);
+    REAL correction = energy - lambdaSum;
+    ASSERT(correction <= 0);
+    REAL avg = correction / k;
+    int remainder = correction % k;
+    if (remainder < 0) {
+        avg -= 1;
+        remainder += k;
+    }
+    for (int i = 0; i < k; ++i) {
+        auto& lambda_ail = dualVariable(clique_index,  i, labels[i]);
+        lambda_ail += avg;
+        if (i < remainder)
+            lambda_ail += 1;
+    }
+}
+
 template <typename Flow>
 void SoSPD<Flow>::PostEditDual() {
-    Label labelBuf[32];
-    int clique_index = 0;
-    for (const CliquePtr& cp : m_energy->cliques()) {
-        const Clique& c = *cp;
-        const VarId* nodes = c.nodes();
-        int k = c.size();
-        ASSERT(k < 32);
-        REAL lambdaSum = 0;
-		for (int i = 0; i < k; ++i) {
-            labelBuf[i] = m_labels[nodes[i]];
-            lambdaSum += dualVariable(clique_index, i, labelBuf[i]);
-		}
-		REAL energy = c.energy(labelBuf);
-        REAL correction = energy - lambdaSum;
-        if (correction > 0) {
-            std::cout << "Bad clique in PostEditDual!\t Id:" << clique_index << "\n";
-            std::cout << "Correction: " << correction << "\tenergy: " << energy << "\tlambdaSum " << lambdaSum << "\n";
-            const auto& c = m_ibfs.Graph().GetCliques()[clique_index];
-            std::cout << "EnergyTable: ";
-            for (const auto& e : c.EnergyTable())
-                std::cout << e << ", ";
-            std::cout << "\n";
-        }
-        ASSERT(correction <= 0);
-        REAL avg = correction / k;
-        int remainder = correction % k;
-        if (remainder < 0) {
-            avg -= 1;
-            remainder += k;
+    // As in UpdatePrimalDual, cliques fix up their own duals in parallel,
+    // and then each node recomputes the height of its label
+    const auto& cliques = m_energy->cliques();
+    const int numThreads = m_ibfs.Params().numThreads;
+    ParallelChunks(cliques.size(), NumChunks(cliques.size(), numThreads, cliqueGrain),
+            [&](size_t, size_t begin, size_t end) {
+        Label labelBuf[32];
+        for (size_t clique_index = begin; clique_index < end; ++clique_index) {
+            const Clique& c = *cliques[clique_index];
+            const VarId* nodes = c.nodes();
+            int k = c.size();
+            ASSERT(k < 32);
+            for (int i = 0; i < k; ++i)
+                labelBuf[i] = m_labels[nodes[i]];
+            CorrectDual(clique_index, k, labelBuf, c.energy(labelBuf));
         }
-		for (int i = 0; i < k; ++i) {
-            auto& lambda_ail = dualVariable(clique_index,  i, labelBuf[i]);
-            Height(nodes[i], labelBuf[i]) -= lambda_ail;
-		    lambda_ail += avg;
-            if (i < remainder)
-                lambda_ail += 1;
-            Height(nodes[i], labelBuf[i]) += lambda_ail;
-		}
-		++clique_index;
-    }
+    });
+    const size_t n = m_labels.size();
+    const size_t nodeChunks = NumChunks(n, numThreads, nodeGrain);
+    std::vector<REAL> scoreDelta(m_scores_valid ? nodeChunks*m_num_labels : 0, 0);
+    ParallelChunks(n, nodeChunks, [&](size_t chunk, size_t begin, size_t end) {
+        REAL* delta = m_scores_valid ? &scoreDelta[chunk*m_num_labels] : nullptr;
+        for (size_t i = begin; i < end; ++i)
+            RefreshHeights(i, m_labels[i], m_labels[i], false, delta);
+    });
+    AddScoreDelta(scoreDelta);
 }
 
 template <typename Flow>
@@ -390,26 +558,36 @@ bool SoSPD<Flow>::InitialFusionLabeling() {
     for (size_t i = 0; i < m_labels.size(); ++i) {
         if (m_fusion_labels[i] < 0) m_fusion_labels[i] = 0;
         if (m_fusion_labels[i] >= m_num_labels) m_fusion_labels[i] = m_num_labels-1;
+        if (Slot(i, m_fusion_labels[i]) == m_slots) m_fusion_labels[i] = m_labels[i];
         if (m_labels[i] != m_fusion_labels[i])
             allDiff = true;
     }
     return allDiff;
 }
 
+template <typename Flow>
+const std::vector<REAL>& SoSPD<Flow>::LabelScores() {
+    // The score of l is the sum of the positive Height(i, m_labels[i]) -
+    // Height(i, l). It is computed once, and after that kept up to date by
+    // the passes that change heights or labels
+    if (!m_scores_valid) {
+        m_label_scores.assign(m_num_labels, 0);
+        for (size_t i = 0; i < m_labels.size(); ++i)
+            AddScoreRow(i, true, m_label_scores.data());
+        m_scores_valid = true;
+    }
+    return m_label_scores;
+}
+
 template <typename Flow>
 void SoSPD<Flow>::HeightAlphaProposal() {
     const size_t n = m_labels.size();
+    const std::vector<REAL>& scores = LabelScores();
     REAL max_s_capacity = 0;
     Label alpha = 0;
     for (Label l = 0; l < m_num_labels; ++l) {
-        REAL s_capacity = 0;
-        for (size_t i = 0; i < n; ++i) {
-            REAL diff = Height(i, m_labels[i]) - Height(i, l);
-            if (diff > 0)
-                s_capacity += diff;
-        }
-        if (s_capacity > max_s_capacity) {
-            max_s_capacity = s_capacity;
+        if (scores[l] > max_s_capacity) {
+            max_s_capacity = scores[l];
             alpha = l;
         }
     }
@@ -419,16 +597,155 @@ void SoSPD<Flow>::HeightAlphaProposal() {
 
 template <typename Flow>
 void SoSPD<Flow>::AlphaProposal() {
-    Label alpha = m_iter % m_num_labels;
+    // Labels are tried in turn. Once a whole cycle of labels has gone by
+    // without progress (see CountProgress), the current labeling is
+    // proposed, which stops Solve
+    if (m_unchanged_labels >= m_num_labels) {
+        m_fusion_labels = m_labels;
+        return;
+    }
+    const Label alpha = m_next_alpha;
+    m_next_alpha = (alpha + 1) % m_num_labels;
     const size_t n = m_labels.size();
     for (size_t i = 0; i < n; ++i)
         m_fusion_labels[i] = alpha;
 }
 
 
+template <typename Flow>
+void SoSPD<Flow>::CountProgress() {
+    // An iteration makes progress if it lowers the energy below the least
+    // so far, or raises DualBound(1) above the greatest since then. The
+    // duals can move back and forth without either, so counting any change
+    // in them would rarely stop. Both are integers, and DualBound(1) is a
+    // lower bound on the energy, so progress stops after finitely many
+    // iterations
+    const REAL energy = PrimalEnergy();
+    if (energy < m_best_energy) {
+        m_best_energy = energy;
+        m_best_dual = -std::numeric_limits<double>::max();
+        m_unchanged_labels = 0;
+        return;
+    }
+    const double dual = DualBound(1);
+    if (dual > m_best_dual) {
+        m_best_dual = dual;
+        m_unchanged_labels = 0;
+    } else {
+        m_unchanged_labels++;
+    }
+}
+
+template <typename Flow>
+bool SoSPD<Flow>::SpeculativeStep() {
+    // The candidates are the alphas with the highest scores, as in
+    // HeightAlphaProposal, leaving out any that no node could move to
+    const std::vector<REAL>& scores = LabelScores();
+    std::vector<Label> alphas(m_num_labels);
+    for (Label l = 0; l < m_num_labels; ++l)
+        alphas[l] = l;
+    std::stable_sort(alphas.begin(), alphas.end(),
+            [&](Label a, Label b) { return scores[a] > scores[b]; });
+    std::vector<Label> chosen;
+    for (Label l : alphas) {
+        if (chosen.size() == size_t(m_num_candidates))
+            break;
+        for (size_t i = 0; i < m_labels.size(); ++i) {
+            if (m_labels[i] != l && Slot(i, l) < m_slots) {
+                chosen.push_back(l);
+                break;
+            }
+        }
+    }
+    if (chosen.empty())
+        return false;
+
+    // Each candidate has its own flow graph, solved on one thread. They only
+    // read the labeling and dual, which don't change until the best move is
+    // applied
+    while (m_candidates.size() < chosen.size()) {
+        SubmodularIBFSParams params = m_ibfs.Params();
+        params.numThreads = 1;
+        m_candidates.emplace_back(new Flow(params));
+        SetupGraph(*m_candidates.back());
+    }
+    const size_t numCandidates = chosen.size();
+    std::vector<std::vector<Label>> fusion(numCandidates);
+    std::vector<REAL> delta(numCandidates);
+    ParallelChunks(numCandidates, numCandidates, [&](size_t j, size_t, size_t) {
+        Flow& crf = *m_candidates[j];
+        crf.Params().interrupt = m_ibfs.Params().interrupt;
+        fusion[j].resize(m_labels.size());
+        for (size_t i = 0; i < m_labels.size(); ++i)
+            fusion[j][i] = (Slot(i, chosen[j]) < m_slots) ? chosen[j] : m_labels[i];
+        PreEditDual(crf, fusion[j]);
+        SetupAlphaEnergy(crf, fusion[j]);
+        crf.Solve();
+        delta[j] = MoveDelta(crf, fusion[j]);
+    });
+    const size_t best = std::min_element(delta.begin(), delta.end()) - delta.begin();
+    m_fusion_labels.swap(fusion[best]);
+    ApplyMove(*m_candidates[best]);
+    return true;
+}
+
+template <typename Flow>
+REAL SoSPD<Flow>::MoveDelta(Flow& crf, const std::vector<Label>& fusion) {
+    // The fusion table entry of the labeling a clique moves to is its energy
+    // less the duals at that labeling (and it is 0 for the current one), so
+    // the change in energy is the entry plus the change in those duals
+    const size_t n = m_labels.size();
+    REAL delta = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (crf.GetLabel(i) == 1 && fusion[i] != m_labels[i])
+            delta += m_energy->unary(i, fusion[i]) - m_energy->unary(i, m_labels[i]);
+    }
+    const auto& cliques = m_energy->cliques();
+    for (size_t c = 0; c < cliques.size(); ++c) {
+        const VarId* nodes = cliques[c]->nodes();
+        const int k = cliques[c]->size();
+        Assgn a = 0;
+        REAL lambdaDiff = 0;
+        for (int j = 0; j < k; ++j) {
+            const VarId i = nodes[j];
+            if (crf.GetLabel(i) == 1 && fusion[i] != m_labels[i]) {
+                a |= 1 << j;
+                lambdaDiff += dualVariable(c, j, fusion[i])
+                    - dualVariable(c, j, m_labels[i]);
+            }
+        }
+        if (a != 0)
+            delta += crf.GetClique(c).EnergyTable()[a] + lambdaDiff;
+    }
+    return delta;
+}
+
 template <typename Flow>
 void SoSPD<Flow>::Solve(int niters) {
-    if (m_iter == 0) {
+    Run(niters, nullptr);
+}
+
+template <typename Flow>
+bool SoSPD<Flow>::Solve(int niters, const SolveToken& token) {
+    // The flow solves poll the token through the params of m_ibfs
+    const SolveToken* interrupt = m_ibfs.Params().interrupt;
+    m_ibfs.Params().interrupt = &token;
+    bool finished;
+    try {
+        finished = Run(niters, &token);
+    } catch (...) {
+        m_ibfs.Params().interrupt = interrupt;
+        throw;
+    }
+    m_ibfs.Params().interrupt = interrupt;
+    return finished;
+}
+
+template <typename Flow>
+bool SoSPD<Flow>::Run(int niters, const SolveToken* token) {
+    // Set up on the first call, which may have been interrupted before
+    // completing an iteration
+    if (m_heights.empty()) {
         SetupGraph(m_ibfs);
         InitialLabeling();
         InitialDual();
@@ -441,100 +758,242 @@ void SoSPD<Flow>::Solve(int niters) {
 	bool labelChanged = true;
     int this_iter = 0;
 	while (labelChanged && this_iter < niters){
-        labelChanged = InitialFusionLabeling();
-        if (!labelChanged) break;
-	    PreEditDual(m_ibfs);
-        UpdatePrimalDual(m_ibfs);
-		PostEditDual();
+        // Nothing in SoSPD changes until the flow solve in
+        // UpdatePrimalDual returns, so an iteration interrupted before then
+        // is simply dropped
+        const Label next_alpha = m_next_alpha;
+        try {
+            if (token)
+                token->Check();
+            if (m_num_candidates > 1) {
+                labelChanged = SpeculativeStep();
+                if (!labelChanged) break;
+            } else {
+                labelChanged = InitialFusionLabeling();
+                if (!labelChanged) {
+                    // With candidate label sets, alpha may be a candidate
+                    // of no node. That try makes no progress, and only the
+                    // current labeling, proposed after a whole cycle of
+                    // such tries, stops Solve
+                    if (!m_alpha_expansion || m_unchanged_labels >= m_num_labels)
+                        break;
+                    m_unchanged_labels++;
+                    labelChanged = true;
+                    continue;
+                }
+                PreEditDual(m_ibfs, m_fusion_labels);
+                if (token)
+                    token->Check();
+                UpdatePrimalDual(m_ibfs);
+            }
+        } catch (const SolveInterrupted&) {
+            m_next_alpha = next_alpha;
+            return false;
+        }
+        if (!m_fused_dual_update)
+            PostEditDual();
+        if (m_alpha_expansion && m_num_candidates <= 1)
+            CountProgress();
         this_iter++;
         m_iter++;
+        if (m_candidate_refresh > 0 && !m_label_sets.empty()
+                && m_iter % m_candidate_refresh == 0)
+            RefreshLabelSets();
+        if (m_progress)
+            m_progress(m_iter, PrimalEnergy());
+        if (m_gap_target > 0) {
+            const REAL energy = PrimalEnergy();
+            const double bound = (m_bound_scale < 0) ? LowerBound() : NearbyLowerBound();
+            if (energy - bound <= m_gap_target * std::abs(double(energy)))
+                break;
+        }
 		#ifdef PROGRESS_DISPLAY
 			energy = m_energy->computeEnergy(m_labels);
 			std::cout << "Iteration " << m_iter << ": " << energy << std::endl;
 		#endif
 	}
-    //LowerBound();
+    return true;
+}
+
+template <typename Flow>
+size_t SoSPD<Flow>::Slot(VarId i, Label l) const {
+    if (m_label_sets.empty())
+        return l;
+    const Label* first = &m_label_sets[i*m_slots];
+    const Label* it = std::lower_bound(first, first+m_slots, l);
+    return (it != first+m_slots && *it == l) ? it - first : m_slots;
+}
+
+template <typename Flow>
+typename SoSPD<Flow>::Label SoSPD<Flow>::SlotLabel(VarId i, size_t s) const {
+    return m_label_sets.empty() ? s : m_label_sets[i*m_slots+s];
+}
+
+template <typename Flow>
+size_t SoSPD<Flow>::CliqueSlot(int alpha, VarId i, Label l) const {
+    if (m_label_sets.empty())
+        return l;
+    return Slot(m_energy->cliques()[alpha]->nodes()[i], l);
 }
 
 template <typename Flow>
 REAL SoSPD<Flow>::dualVariable(int alpha, VarId i, Label l) const {
-    return m_dual[alpha][i*m_num_labels+l];
+    // Labels outside the candidate set of the node have a dual of 0
+    const size_t s = CliqueSlot(alpha, i, l);
+    return (s < m_slots) ? lambdaAlpha(alpha)[i*m_slots+s] : 0;
 }
 
 template <typename Flow>
 REAL& SoSPD<Flow>::dualVariable(int alpha, VarId i, Label l) {
-    return m_dual[alpha][i*m_num_labels+l];
+    return lambdaAlpha(alpha)[i*m_slots+CliqueSlot(alpha, i, l)];
 }
 
 template <typename Flow>
-REAL SoSPD<Flow>::dualVariable(const LambdaAlpha& lambdaAlpha,
-        VarId i, Label l) const {
-    return lambdaAlpha[i*m_num_labels+l];
+REAL SoSPD<Flow>::dualVariable(const REAL* lambdaAlpha,
+        VarId i, size_t slot) const {
+    return lambdaAlpha[i*m_slots+slot];
 }
 
 template <typename Flow>
-REAL& SoSPD<Flow>::dualVariable(LambdaAlpha& lambdaAlpha,
-        VarId i, Label l) {
-    return lambdaAlpha[i*m_num_labels+l];
+REAL& SoSPD<Flow>::dualVariable(REAL* lambdaAlpha,
+        VarId i, size_t slot) {
+    return lambdaAlpha[i*m_slots+slot];
 }
 
 template <typename Flow>
-typename SoSPD<Flow>::LambdaAlpha& SoSPD<Flow>::lambdaAlpha(int alpha) {
-    return m_dual[alpha];
+REAL* SoSPD<Flow>::lambdaAlpha(int alpha) {
+    return &m_dual[m_dual_offsets[alpha]];
 }
 
 template <typename Flow>
-const typename SoSPD<Flow>::LambdaAlpha& SoSPD<Flow>::lambdaAlpha(int alpha) const {
-    return m_dual[alpha];
+const REAL* SoSPD<Flow>::lambdaAlpha(int alpha) const {
+    return &m_dual[m_dual_offsets[alpha]];
 }
 
 template <typename Flow>
-double SoSPD<Flow>::LowerBound() {
-    std::cout << "Computing Lower Bound\n";
-    double max_ratio = 0;
-    int clique_index = 0;
-    for (const CliquePtr& cp : m_energy->cliques()) {
-        const Clique& c = *cp;
-        const size_t k = c.size();
-        ASSERT(k == 3); // Lower bound doesn't work for larger numbers
-        Label buf[3];
-        for (buf[0] = 0; buf[0] < m_num_labels; ++buf[0]) {
-            for (buf[1] = 0; buf[1] < m_num_labels; ++buf[1]) {
-                for (buf[2] = 0; buf[2] < m_num_labels; ++buf[2]) {
-                    REAL energy = c.energy(buf);
-                    REAL dualSum = dualVariable(clique_index, 0, buf[0])
-                        + dualVariable(clique_index, 1, buf[1])
-                        + dualVariable(clique_index, 2, buf[2]);
-                    if (energy == 0) {
-                        for (int i = 0; i < 3; ++i) {
-                            if (buf[i] != m_labels[c.nodes()[i]]) {
-                                dualVariable(clique_index, i, buf[i]) -= dualSum - energy;
-                                Height(c.nodes()[i], buf[i]) -= dualSum - energy;
-                                dualSum = energy;
-                                break;
-                            }
-                        }
-                        ASSERT(dualSum == energy);
-                    } else {
-                        max_ratio = std::max(max_ratio, double(dualSum)/double(energy));
-                    }
-                }
+double SoSPD<Flow>::DualBound(double scale) const {
+    // For any dual, the energy is at least the sum over nodes of their
+    // smallest height, plus the sum over cliques of the least
+    // f_C(x_C) - sum_i lambda_C(i, x_i). Scaling the dual by scale scales
+    // the clique part of every height. Labels outside the candidate set of
+    // a node have no duals, so their height is their unary
+    const size_t n = m_labels.size();
+    const int numThreads = m_ibfs.Params().numThreads;
+    const size_t nodeChunks = NumChunks(n, numThreads, nodeGrain);
+    std::vector<double> nodeSums(nodeChunks, 0);
+    ParallelChunks(n, nodeChunks, [&](size_t chunk, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            double minHeight = m_label_sets.empty()
+                ? std::numeric_limits<double>::max() : m_other_unary[i];
+            for (size_t s = 0; s < m_slots; ++s) {
+                const REAL u = m_energy->unary(i, SlotLabel(i, s));
+                minHeight = std::min(minHeight,
+                        u + scale*(m_heights[i*m_slots+s] - u));
             }
+            nodeSums[chunk] += minHeight;
+        }
+    });
+    const auto& cliques = m_energy->cliques();
+    const size_t m = cliques.size();
+    const size_t cliqueChunks = NumChunks(m, numThreads, cliqueGrain);
+    std::vector<double> cliqueSums(cliqueChunks, 0);
+    ParallelChunks(m, cliqueChunks, [&](size_t chunk, size_t begin, size_t end) {
+        std::vector<REAL> lambda;
+        for (size_t c = begin; c < end; ++c) {
+            if (m_label_sets.empty()) {
+                cliqueSums[chunk] += cliques[c]->dualBound(lambdaAlpha(c),
+                        m_num_labels, scale);
+                continue;
+            }
+            // Spread the duals out to all labels for dualBound
+            const VarId* nodes = cliques[c]->nodes();
+            const size_t k = cliques[c]->size();
+            lambda.assign(k*m_num_labels, 0);
+            for (size_t j = 0; j < k; ++j)
+                for (size_t s = 0; s < m_slots; ++s)
+                    lambda[j*m_num_labels+SlotLabel(nodes[j], s)] = lambdaAlpha(c)[j*m_slots+s];
+            cliqueSums[chunk] += cliques[c]->dualBound(lambda.data(),
+                    m_num_labels, scale);
+        }
+    });
+    double bound = 0;
+    for (double s : nodeSums)
+        bound += s;
+    for (double s : cliqueSums)
+        bound += s;
+    return bound;
+}
+
+template <typename Flow>
+double SoSPD<Flow>::LowerBound() const {
+    // SoSPD only keeps its dual feasible up to a factor, so the bound is
+    // usually best for some scale in (0, 1). It is concave in the scale,
+    // so a golden section search finds it
+    const double ratio = (std::sqrt(5.0) - 1) / 2;
+    double lo = 0, hi = 1;
+    double a = hi - ratio*(hi - lo), b = lo + ratio*(hi - lo);
+    double fa = DualBound(a), fb = DualBound(b);
+    for (int iter = 0; iter < 16; ++iter) {
+        if (fa < fb) {
+            lo = a;
+            a = b;
+            fa = fb;
+            b = lo + ratio*(hi - lo);
+            fb = DualBound(b);
+        } else {
+            hi = b;
+            b = a;
+            fb = fa;
+            a = hi - ratio*(hi - lo);
+            fa = DualBound(a);
         }
-        clique_index++;
     }
-    REAL dual_objective = 0;
-    for (VarId i = 0; i < m_energy->numVars(); ++i) {
-        REAL min_height = std::numeric_limits<REAL>::max();
-        for (Label l = 0; l < m_num_labels; ++l)
-            min_height = std::min(min_height, Height(i, l));
-        dual_objective += min_height;
+    const double scales[] = { a, b, 0, 1 };
+    const double bounds[] = { fa, fb, DualBound(0), DualBound(1) };
+    const int best = std::max_element(bounds, bounds + 4) - bounds;
+    m_bound_scale = scales[best];
+    return bounds[best];
+}
+
+template <typename Flow>
+double SoSPD<Flow>::NearbyLowerBound() const {
+    // The best scale moves little between iterations, so instead of a
+    // full search, climb from the last one in small steps while the bound
+    // improves, which finds the best scale to within a step since the
+    // bound is concave in it
+    const double step = 1.0 / 64;
+    double scale = m_bound_scale;
+    double best = DualBound(scale);
+    for (double dir : { step, -step }) {
+        bool moved = false;
+        while (true) {
+            const double next = std::max(std::min(scale + dir, 1.0), 0.0);
+            if (next == scale)
+                break;
+            const double bound = DualBound(next);
+            if (bound <= best)
+                break;
+            best = bound;
+            scale = next;
+            moved = true;
+        }
+        if (moved)
+            break;
     }
-    std::cout << "Max Ratio: " << max_ratio << "\n";
-    std::cout << "Dual objective: " << dual_objective << "\n";
-    return dual_objective / max_ratio;
+    m_bound_scale = scale;
+    return best;
 }
 
+template <typename Flow>
+REAL SoSPD<Flow>::PrimalEnergy() const {
+    // After each iteration the duals of every clique at the current labeling
+    // sum to its energy, so the heights of the current labels add up to
+    // the energy of the labeling
+    REAL energy = 0;
+    for (size_t i = 0; i < m_labels.size(); ++i)
+        energy += Height(i, m_labels[i]);
+    return energy;
+}
 
 // Template instantiations
 template class SoSPD<SubmodularIBFS>;
@@ -16,18 +16,22 @@ void SourceIBFS::IBFSInit()
 
     const int n = m_graph->NumNodes();
 
-    m_source_layers = std::vector<NodeQueue>(n+1);
+    m_source_layers.Reset(n+2, n+1);
 
     m_source_orphans.clear();
 
-    auto& nodes = m_graph->GetNodes();
-    auto& sNode = nodes[m_graph->GetS()];
-    sNode.state = NodeState::S;
-    sNode.dis = 0;
-    m_source_layers[0].push_back(sNode);
-    auto& tNode = nodes[m_graph->GetT()];
-    tNode.state = NodeState::T;
-    tNode.dis = 0;
+    m_num_arcs = 0;
+    for (const auto& c : m_graph->GetCliques())
+        m_num_arcs += c.Size() * c.Size();
+    m_relabel_work = 0;
+
+    NodeId s = m_graph->GetS();
+    m_graph->state(s) = NodeState::S;
+    m_graph->dis(s) = 0;
+    m_source_layers.PushBack(0, s);
+    NodeId t = m_graph->GetT();
+    m_graph->state(t) = NodeState::T;
+    m_graph->dis(t) = 0;
 
     // saturate all s-i-t paths
     for (NodeId i = 0; i < n; ++i) {
@@ -35,18 +39,22 @@ void SourceIBFS::IBFSInit()
                 m_graph->m_c_it[i]-m_graph->m_phi_it[i]);
         m_graph->m_phi_si[i] += min_cap;
         m_graph->m_phi_it[i] += min_cap;
-        if (m_graph->m_c_si[i] > m_graph->m_phi_si[i]) {
-            auto& node = m_graph->node(i);
-            node.state = NodeState::S;
-            node.dis = 1;
+        if (m_graph->state(i) != NodeState::N) {
+            // Persistent node: make it a leaf of its tree, but never search
+            // from it, since all its clique arcs are saturated
+            m_graph->dis(i) = 1;
+            m_graph->parentArc(i) = m_graph->ArcsEndIdx(i);
+            m_graph->parent(i) = (m_graph->state(i) == NodeState::S) ? m_graph->GetS() : m_graph->GetT();
+        } else if (m_graph->m_c_si[i] > m_graph->m_phi_si[i]) {
+            m_graph->state(i) = NodeState::S;
+            m_graph->dis(i) = 1;
             AddToLayer(i);
-            node.parent_arc = m_graph->ArcsEnd(i);
-            node.parent = m_graph->GetS();
+            m_graph->parentArc(i) = m_graph->ArcsEndIdx(i);
+            m_graph->parent(i) = m_graph->GetS();
         } else if (m_graph->m_c_it[i] > m_graph->m_phi_it[i]) {
-            auto& node = m_graph->node(i);
-            node.state = NodeState::T;
-            node.parent_arc = m_graph->ArcsEnd(i);
-            node.parent = m_graph->GetT();
+            m_graph->state(i) = NodeState::T;
+            m_graph->parentArc(i) = m_graph->ArcsEndIdx(i);
+            m_graph->parent(i) = m_graph->GetT();
         } else {
             ASSERT(m_graph->m_c_si[i] == m_graph->m_phi_si[i] 
                 && m_graph->m_c_it[i] == m_graph->m_phi_it[i]);
@@ -55,64 +63,124 @@ void SourceIBFS::IBFSInit()
     m_initTime += Duration{ Clock::now() - start }.count();
 }
 
+void SourceIBFS::GrowInitialLayers() {
+    auto start = Clock::now();
+    const int n = m_graph->NumNodes();
+    const auto& neighbors = m_graph->GetNeighbors();
+    size_t totalArcs = 0;
+    size_t treeArcs = 0;
+    for (NodeId i = 0; i < n; ++i) {
+        totalArcs += neighbors[i].size();
+        if (m_graph->state(i) == NodeState::S)
+            treeArcs += neighbors[i].size();
+    }
+
+    // Stop at the first layer with an arc to a sink node, or which is empty
+    std::vector<NodeId> frontier;
+    int d = 1;
+    while (true) {
+        Poll();
+        frontier.clear();
+        for (NodeId i = m_source_layers.Front(d); i != NodeLayers::End(); i = m_source_layers.Next(i))
+            frontier.push_back(i);
+        if (frontier.empty())
+            break;
+        if (!m_graph->FindLayer(NodeState::S, d, frontier, m_source_next,
+                    totalArcs - treeArcs, m_num_threads, &m_search_stats))
+            break;
+        m_graph->AddLayer(NodeState::S, d, m_source_next);
+        for (NodeId i : m_source_next.nodes) {
+            AddToLayer(i);
+            treeArcs += neighbors[i].size();
+        }
+        d++;
+    }
+
+    // Make it look like layer d-1 was just scanned
+    m_source_tree_d = d - 1;
+    m_initTime += Duration{ Clock::now() - start }.count();
+}
+
 void SourceIBFS::IBFS() {
     auto start = Clock::now();
+    size_t arc_scans = 0;
     m_source_tree_d = 0;
 
     IBFSInit();
+    if (m_initial_search)
+        GrowInitialLayers();
 
     // Set up initial current_q and search nodes to make it look like
-    // we just finished scanning the source node
-    NodeQueue* current_q = &(m_source_layers[0]);
-    m_search_node_iter = current_q->end();
-    m_search_node_end = current_q->end();
+    // we just finished scanning the last layer
+    m_search_node = NodeLayers::End();
 
-    while (!current_q->empty()) {
-        if (m_search_node_iter == m_search_node_end) {
+    while (!m_source_layers.Empty(m_source_tree_d)) {
+        Poll();
+        if (m_search_node == NodeLayers::End()) {
             // Swap queues and continue
             m_source_tree_d++;
-            current_q = &(m_source_layers[m_source_tree_d]);
-            m_search_node_iter = current_q->begin();
-            m_search_node_end = current_q->end();
-            if (!current_q->empty()) {
-                Node& n = *m_search_node_iter;
-                NodeId nodeIdx = n.id;
-                ASSERT(n.state == NodeState::S);
+            if (m_global_relabel_freq > 0
+                    && m_relabel_work > m_global_relabel_freq * m_num_arcs) {
+                GlobalRelabel();
+                m_relabel_work = 0;
+            }
+            m_search_node = m_source_layers.Front(m_source_tree_d);
+            if (m_search_node != NodeLayers::End()) {
+                NodeId nodeIdx = m_search_node;
+                ASSERT(m_graph->state(nodeIdx) == NodeState::S);
                 m_search_arc = m_graph->ArcsBegin(nodeIdx);
                 m_search_arc_end = m_graph->ArcsEnd(nodeIdx);
             }
             continue;
         }
-        Node& n = *m_search_node_iter;
-        NodeId search_node = n.id;
+        NodeId search_node = m_search_node;
+        NodeState search_state = m_graph->state(search_node);
+        int search_dis = m_graph->dis(search_node);
         int distance = m_source_tree_d;
-        ASSERT(n.dis == distance);
+        ASSERT(search_dis == distance);
         // Advance m_search_arc until we find a residual arc
-        while (m_search_arc != m_search_arc_end && !m_graph->NonzeroCap(m_search_arc, true))
+        while (m_search_arc != m_search_arc_end && !m_graph->NonzeroCap(m_search_arc, true)) {
+            arc_scans++;
             ++m_search_arc;
+        }
 
         if (m_search_arc != m_search_arc_end) {
             NodeId neighbor = m_search_arc.Target();
-            NodeState neighbor_state = m_graph->node(neighbor).state;
-            if (neighbor_state == n.state) {
-                ASSERT(m_graph->node(neighbor).dis <= n.dis + 1);
-                if (m_graph->node(neighbor).dis == n.dis+1) {
-                    auto reverseArc = m_search_arc.Reverse();
-                    if (reverseArc < m_graph->node(neighbor).parent_arc) {
-                        m_graph->node(neighbor).parent_arc = reverseArc;
-                        m_graph->node(neighbor).parent = search_node;
+            NodeState neighbor_state = m_graph->state(neighbor);
+            if (neighbor_state == search_state) {
+                ASSERT(m_graph->dis(neighbor) <= search_dis + 1);
+                if (m_graph->dis(neighbor) == search_dis+1) {
+                    // Keep the current arc the first admissible arc
+                    ArcIdx reverseArc = m_search_arc.Reverse().Index();
+                    if (reverseArc < m_graph->parentArc(neighbor)) {
+                        m_graph->parentArc(neighbor) = reverseArc;
+                        m_graph->parent(neighbor) = search_node;
                     }
                 }
+                arc_scans++;
                 ++m_search_arc;
             } else if (neighbor_state == NodeState::N) {
                 // Then we found an unlabeled node, add it to the tree
-                m_graph->node(neighbor).state = n.state;
-                m_graph->node(neighbor).dis = n.dis + 1;
+                m_graph->state(neighbor) = search_state;
+                m_graph->dis(neighbor) = search_dis + 1;
                 AddToLayer(neighbor);
                 auto reverseArc = m_search_arc.Reverse();
-                m_graph->node(neighbor).parent_arc = reverseArc;
-                ASSERT(m_graph->NonzeroCap(m_graph->node(neighbor).parent_arc, false));
-                m_graph->node(neighbor).parent = search_node;
+                m_graph->parentArc(neighbor) = reverseArc.Index();
+                ASSERT(m_graph->NonzeroCap(reverseArc, false));
+                m_graph->parent(neighbor) = search_node;
+                // Pushes may have given neighbor an earlier admissible arc
+                // from a node that was already scanned
+                for (auto arc = m_graph->ArcsBegin(neighbor); arc.Index() < reverseArc.Index(); ++arc) {
+                    arc_scans++;
+                    NodeId j = arc.Target();
+                    if (m_graph->state(j) == search_state && m_graph->dis(j) == search_dis
+                            && m_graph->NonzeroCap(arc, false)) {
+                        m_graph->parentArc(neighbor) = arc.Index();
+                        m_graph->parent(neighbor) = j;
+                        break;
+                    }
+                }
+                arc_scans++;
                 ++m_search_arc;
             } else {
                 // Then we found an arc to the other tree
@@ -126,6 +194,7 @@ void SourceIBFS::IBFS() {
             AdvanceSearchNode();
         }
     } // End while
+    m_search_stats.arcScans += arc_scans;
     m_totalTime += Duration{ Clock::now() - start }.count();
 
     //std::cout << "Total time:      " << m_totalTime << "\n";
@@ -142,39 +211,39 @@ void SourceIBFS::Augment(ArcIterator& arc) {
     j = arc.Target();
     REAL bottleneck = m_graph->ResCap(arc, true);
     NodeId current = i;
-    NodeId parent = m_graph->node(current).parent;
+    NodeId parent = m_graph->parent(current);
     while (parent != m_graph->GetS()) {
-        ASSERT(m_graph->node(current).state == NodeState::S);
-        auto& a = m_graph->node(current).parent_arc;
+        ASSERT(m_graph->state(current) == NodeState::S);
+        auto a = m_graph->Arc(current, m_graph->parentArc(current));
         bottleneck = std::min(bottleneck, m_graph->ResCap(a, false));
         current = parent;
-        parent = m_graph->node(current).parent;
+        parent = m_graph->parent(current);
     }
-    ASSERT(m_graph->node(current).parent == m_graph->GetS());
+    ASSERT(m_graph->parent(current) == m_graph->GetS());
     bottleneck = std::min(bottleneck, m_graph->m_c_si[current] - m_graph->m_phi_si[current]);
 
     current = j;
-    ASSERT(m_graph->node(current).parent == m_graph->GetT());
+    ASSERT(m_graph->parent(current) == m_graph->GetT());
     bottleneck = std::min(bottleneck, m_graph->m_c_it[current] - m_graph->m_phi_it[current]);
     ASSERT(bottleneck > 0);
 
     // Found the bottleneck, now do pushes on the arcs in the path
     Push(arc, true, bottleneck);
     current = i;
-    parent = m_graph->node(current).parent;
+    parent = m_graph->parent(current);
     while (parent != m_graph->GetS()) {
-        auto& a = m_graph->node(current).parent_arc;
+        auto a = m_graph->Arc(current, m_graph->parentArc(current));
         Push(a, false, bottleneck);
         current = parent;
-        parent = m_graph->node(current).parent;
+        parent = m_graph->parent(current);
     }
-    ASSERT(m_graph->node(current).parent == m_graph->GetS());
+    ASSERT(m_graph->parent(current) == m_graph->GetS());
     m_graph->m_phi_si[current] += bottleneck;
     if (m_graph->m_phi_si[current] == m_graph->m_c_si[current])
         MakeOrphan(current);
 
     current = j;
-    ASSERT(m_graph->node(current).parent == m_graph->GetT());
+    ASSERT(m_graph->parent(current) == m_graph->GetT());
     m_graph->m_phi_it[current] += bottleneck;
     if (m_graph->m_phi_it[current] == m_graph->m_c_it[current])
         MakeOrphan(current);
@@ -184,69 +253,89 @@ void SourceIBFS::Augment(ArcIterator& arc) {
 
 void SourceIBFS::Adopt() {
     auto start = Clock::now();
+    size_t arc_scans = 0;
+    size_t relabel_scans = 0;
     while (!m_source_orphans.empty()) {
-        Node& n = m_source_orphans.front();
-        NodeId i = n.id;
+        NodeId i = m_source_orphans.front();
         m_source_orphans.pop_front();
-        int old_dist = n.dis;
-        while (n.parent_arc != m_graph->ArcsEnd(i)
-                && (m_graph->node(n.parent).state == NodeState::T
-                    || m_graph->node(n.parent).state == NodeState::N
-                    || m_graph->node(n.parent).dis != old_dist - 1
-                    || !m_graph->NonzeroCap(n.parent_arc, false))) {
-            ++n.parent_arc;
-            if (n.parent_arc != m_graph->ArcsEnd(i))
-                n.parent = n.parent_arc.Target();
+        // Orphans can be cut off by a gap while in the queue
+        if (m_graph->state(i) != NodeState::S_orphan)
+            continue;
+        int old_dist = m_graph->dis(i);
+        auto parentArc = m_graph->Arc(i, m_graph->parentArc(i));
+        auto arcsEnd = m_graph->ArcsEnd(i);
+        NodeId parent = m_graph->parent(i);
+        while (parentArc != arcsEnd
+                && (m_graph->state(parent) == NodeState::T
+                    || m_graph->state(parent) == NodeState::N
+                    || m_graph->dis(parent) != old_dist - 1
+                    || !m_graph->NonzeroCap(parentArc, false))) {
+            arc_scans++;
+            ++parentArc;
+            if (parentArc != arcsEnd)
+                parent = parentArc.Target();
         }
-        if (n.parent_arc == m_graph->ArcsEnd(i)) {
+        if (parentArc == arcsEnd) {
             RemoveFromLayer(i);
-            // We didn't find a new parent with the same label, so do a relabel
-            n.dis = std::numeric_limits<int>::max()-1;
-            for (auto newParentArc = m_graph->ArcsBegin(i); newParentArc != m_graph->ArcsEnd(i); ++newParentArc) {
+            // We didn't find a new parent with the same label, so do a
+            // relabel. The current arc is always the first admissible arc,
+            // so the label must increase.
+            int dis = std::numeric_limits<int>::max()-1;
+            for (auto newParentArc = m_graph->ArcsBegin(i); newParentArc != arcsEnd; ++newParentArc) {
+                arc_scans++;
+                relabel_scans++;
                 auto target = newParentArc.Target();
-                if (m_graph->node(target).dis < n.dis
-                        && (m_graph->node(target).state == NodeState::S
-                            || m_graph->node(target).state == NodeState::S_orphan)
+                if (m_graph->dis(target) < dis
+                        && (m_graph->state(target) == NodeState::S
+                            || m_graph->state(target) == NodeState::S_orphan)
                         && m_graph->NonzeroCap(newParentArc, false)) {
-                    n.dis = m_graph->node(target).dis;
-                    n.parent_arc = newParentArc;
-                    ASSERT(m_graph->NonzeroCap(n.parent_arc, false));
-                    n.parent = target;
+                    dis = m_graph->dis(target);
+                    parentArc = newParentArc;
+                    ASSERT(m_graph->NonzeroCap(parentArc, false));
+                    parent = target;
                 }
             }
-            n.dis++;
+            dis++;
+            m_graph->dis(i) = dis;
+            m_graph->parentArc(i) = parentArc.Index();
+            m_graph->parent(i) = parent;
             int cutoff_distance = m_source_tree_d + 1;
-            if (n.dis > cutoff_distance) {
-                n.state = NodeState::N;
+            if (dis > cutoff_distance) {
+                m_graph->state(i) = NodeState::N;
             } else {
-                n.state = NodeState::S;
+                m_graph->state(i) = NodeState::S;
                 AddToLayer(i);
             }
-            // FIXME(afix) Should really assert that n.dis > old_dis
-            // but current-arc heuristic isn't watertight at the moment...
-            if (n.dis > old_dist) {
-                for (auto arc = m_graph->ArcsBegin(i); arc != m_graph->ArcsEnd(i); ++arc) {
-                    if (m_graph->node(arc.Target()).parent == i)
-                        MakeOrphan(arc.Target());
-                }
+            for (auto arc = m_graph->ArcsBegin(i); arc != arcsEnd; ++arc) {
+                arc_scans++;
+                if (m_graph->parent(arc.Target()) == i)
+                    MakeOrphan(arc.Target());
             }
+            ASSERT(dis > old_dist);
+            m_search_stats.relabels++;
+            if (m_source_layers.Empty(old_dist))
+                Gap(old_dist);
         } else {
-            ASSERT(m_graph->NonzeroCap(n.parent_arc, false));
-            n.state = NodeState::S;
+            ASSERT(m_graph->NonzeroCap(parentArc, false));
+            m_graph->parentArc(i) = parentArc.Index();
+            m_graph->parent(i) = parent;
+            m_graph->state(i) = NodeState::S;
         }
     }
+    m_search_stats.arcScans += arc_scans;
+    m_relabel_work += relabel_scans;
     m_adoptTime += Duration{ Clock::now() - start }.count();
 }
 
 void SourceIBFS::MakeOrphan(NodeId i) {
-    Node& n = m_graph->node(i);
-    if (n.state != NodeState::S && n.state != NodeState::T)
+    NodeState& state = m_graph->state(i);
+    if (state != NodeState::S && state != NodeState::T)
         return;
-    if (n.state == NodeState::S) {
-        n.state = NodeState::S_orphan;
-        m_source_orphans.push_back(n);
-    } else if (n.state == NodeState::T) {
-        n.state = NodeState::N;
+    if (state == NodeState::S) {
+        state = NodeState::S_orphan;
+        m_source_orphans.push_back(i);
+    } else if (state == NodeState::T) {
+        state = NodeState::N;
     }
 }
 
@@ -256,18 +345,125 @@ void SourceIBFS::Push(ArcIterator& arc, bool forwardArc, REAL delta) {
     //ASSERT(delta > -1e-7);//Chen
     m_num_clique_pushes++;
     //std::cout << "Pushing on clique arc (" << arc.i << ", " << arc.j << ") -- delta = " << delta << std::endl;
-    auto& c = m_graph->clique(arc.cliqueId());
+    const CliqueId cid = arc.cliqueId();
+    auto& c = m_graph->clique(cid);
     if (forwardArc)
         c.Push(arc.SourceIdx(), arc.TargetIdx(), delta);
     else
         c.Push(arc.TargetIdx(), arc.SourceIdx(), delta);
-    for (NodeId n : c.Nodes()) {
-        if (m_graph->node(n).state == NodeState::N)
+    const auto& nodes = c.Nodes();
+    for (size_t n_idx = 0; n_idx < nodes.size(); ++n_idx) {
+        NodeId n = nodes[n_idx];
+        NodeState state = m_graph->state(n);
+        if (state == NodeState::N)
             continue;
-        auto& parent_arc = m_graph->node(n).parent_arc;
-        if (parent_arc != m_graph->ArcsEnd(n) && parent_arc.cliqueId() == arc.cliqueId() && !m_graph->NonzeroCap(parent_arc, m_graph->node(n).state == NodeState::T)) {
+        ArcIdx parent_arc = m_graph->parentArc(n);
+        if (parent_arc != m_graph->ArcsEndIdx(n) && m_graph->ArcCliqueId(n, parent_arc) == cid && !m_graph->NonzeroCap(m_graph->Arc(n, parent_arc), state == NodeState::T)) {
             MakeOrphan(n);
         }
+        // A push can give capacity to any arc in c, so check if some arc of
+        // c before the current arc of n became admissible
+        if ((state != NodeState::S && state != NodeState::S_orphan)
+                || m_graph->CliqueArcIdx(cid, n_idx, 0) > m_graph->parentArc(n))
+            continue;
+        int parent_dis = m_graph->dis(n) - 1;
+        for (size_t j_idx = 0; j_idx < nodes.size(); ++j_idx) {
+            NodeId j = nodes[j_idx];
+            if (j_idx == n_idx || m_graph->dis(j) != parent_dis)
+                continue;
+            NodeState j_state = m_graph->state(j);
+            if ((j_state != NodeState::S && j_state != NodeState::S_orphan)
+                    || !c.NonzeroCapacity(j_idx, n_idx))
+                continue;
+            ArcIdx a = m_graph->CliqueArcIdx(cid, n_idx, j_idx);
+            if (a < m_graph->parentArc(n)) {
+                m_graph->parentArc(n) = a;
+                m_graph->parent(n) = j;
+            }
+        }
+    }
+}
+
+void SourceIBFS::Gap(int d) {
+    // No node at distance d is left, so no node further away can have a
+    // path back to the source through the tree
+    const int max_d = std::min(m_source_tree_d + 1, m_graph->NumNodes());
+    for (int gap_d = d + 1; gap_d <= max_d; ++gap_d) {
+        while (!m_source_layers.Empty(gap_d)) {
+            NodeId i = m_source_layers.Front(gap_d);
+            RemoveFromLayer(i);
+            m_graph->state(i) = NodeState::N;
+            m_search_stats.gapNodes++;
+        }
+    }
+}
+
+void SourceIBFS::GlobalRelabel() {
+    // Recompute exact distances in the tree with a BFS from the source.
+    // Only called between passes, so there are no orphans or partly
+    // scanned nodes.
+    const int max_d = m_source_tree_d;
+    const int unreached = std::numeric_limits<int>::max();
+    m_search_stats.globalRelabels++;
+
+    m_relabel_queue.clear();
+    std::vector<NodeId> tree_nodes;
+    for (int d = 1; d <= std::min(max_d + 1, m_graph->NumNodes()); ++d) {
+        while (!m_source_layers.Empty(d)) {
+            NodeId i = m_source_layers.Front(d);
+            m_source_layers.Erase(d, i);
+            tree_nodes.push_back(i);
+            if (m_graph->m_c_si[i] > m_graph->m_phi_si[i]) {
+                m_graph->dis(i) = 1;
+                m_relabel_queue.push_back(i);
+            } else {
+                m_graph->dis(i) = unreached;
+            }
+        }
+    }
+    for (size_t head = 0; head < m_relabel_queue.size(); ++head) {
+        NodeId i = m_relabel_queue[head];
+        int child_dis = m_graph->dis(i) + 1;
+        if (child_dis > max_d)
+            continue;
+        auto arcsEnd = m_graph->ArcsEnd(i);
+        for (auto arc = m_graph->ArcsBegin(i); arc != arcsEnd; ++arc) {
+            m_search_stats.arcScans++;
+            NodeId j = arc.Target();
+            if (m_graph->state(j) == NodeState::S && m_graph->dis(j) == unreached
+                    && m_graph->NonzeroCap(arc, true)) {
+                m_graph->dis(j) = child_dis;
+                m_relabel_queue.push_back(j);
+            }
+        }
+    }
+
+    // Nodes we didn't reach are cut off from the source
+    for (NodeId i : tree_nodes) {
+        if (m_graph->dis(i) == unreached)
+            m_graph->state(i) = NodeState::N;
+    }
+    // Set the current arc of each node to its first admissible arc
+    for (NodeId i : m_relabel_queue) {
+        int parent_dis = m_graph->dis(i) - 1;
+        if (parent_dis == 0) {
+            m_graph->parentArc(i) = m_graph->ArcsEndIdx(i);
+            m_graph->parent(i) = m_graph->GetS();
+        } else {
+            auto arcsEnd = m_graph->ArcsEnd(i);
+            auto arc = m_graph->ArcsBegin(i);
+            for (; arc != arcsEnd; ++arc) {
+                m_search_stats.arcScans++;
+                NodeId j = arc.Target();
+                if (m_graph->state(j) == NodeState::S && m_graph->dis(j) == parent_dis
+                        && m_graph->NonzeroCap(arc, false))
+                    break;
+            }
+            ASSERT(arc != arcsEnd);
+            m_graph->parentArc(i) = arc.Index();
+            m_graph->parent(i) = arc.Target();
+        }
+        AddToLayer(i);
     }
 }
 
@@ -277,12 +473,12 @@ void SourceIBFS::Push(ArcIterator& arc, bool forwardArc, REAL delta) {
 void SourceIBFS::ComputeMinCut() {
     auto& labels = m_energy->GetLabels();
     for (NodeId i = 0; i < m_graph->NumNodes(); ++i) {
-        if (m_graph->node(i).state == NodeState::T)
+        if (m_graph->state(i) == NodeState::T)
             labels[i] = 0;
-        else if (m_graph->node(i).state == NodeState::S)
+        else if (m_graph->state(i) == NodeState::S)
             labels[i] = 1;
         else {
-            ASSERT(m_graph->node(i).state == NodeState::N);
+            ASSERT(m_graph->state(i) == NodeState::N);
             // Put N nodes on whichever side could still grow
             labels[i] = 0;
         }
@@ -291,44 +487,44 @@ void SourceIBFS::ComputeMinCut() {
 
 void SourceIBFS::Solve(SubmodularIBFS* energy) {
     m_energy = energy;
+    m_interrupt = energy->Params().interrupt;
     m_graph = &energy->Graph();
-    m_graph->ResetFlow();
-    m_graph->UpperBoundCliques(energy->Params().ub, energy->Params().fixedVars, energy->GetLabels(), energy->NormStats());
+    m_search_stats = SoSGraph::SearchStats{};
+    m_global_relabel_freq = energy->Params().globalRelabelFreq;
+    m_initial_search = energy->Params().parallelInitialSearch;
+    m_num_threads = energy->Params().numThreads;
+    energy->SetupFlow();
+    if (energy->Params().reducePersistent)
+        m_graph->FixPersistentNodes(energy->ReductionStats());
     IBFS();
     ComputeMinCut();
+    *energy->SearchStats() = m_search_stats;
 }
 
 void SourceIBFS::AddToLayer(NodeId i) {
-    auto& node = m_graph->node(i);
-    int dis = node.dis;
-    if (node.state == NodeState::S) {
-        m_source_layers[dis].push_back(node);
-        if (node.dis == m_source_tree_d)
-            m_search_node_end = m_source_layers[m_source_tree_d].end();
+    if (m_graph->state(i) == NodeState::S) {
+        m_source_layers.PushBack(m_graph->dis(i), i);
     } else {
         ASSERT(false);
     }
 }
 
 void SourceIBFS::RemoveFromLayer(NodeId i) {
-    auto& node = m_graph->node(i);
-    if (m_search_node_iter != m_search_node_end && &(*m_search_node_iter) == &node)
+    if (m_search_node == i)
         AdvanceSearchNode();
-    int dis = node.dis;
-    if (node.state == NodeState::S || node.state == NodeState::S_orphan) {
-        auto& layer = m_source_layers[dis];
-        layer.erase(layer.iterator_to(node));
+    NodeState state = m_graph->state(i);
+    if (state == NodeState::S || state == NodeState::S_orphan) {
+        m_source_layers.Erase(m_graph->dis(i), i);
     } else {
         ASSERT(false);
     }
 }
 
 void SourceIBFS::AdvanceSearchNode() {
-    m_search_node_iter++;
-    if (m_search_node_iter != m_search_node_end) {
-        Node& n = *m_search_node_iter;
-        NodeId i = n.id;
-        ASSERT(n.state == NodeState::S || n.state == NodeState::S_orphan);
+    m_search_node = m_source_layers.Next(m_search_node);
+    if (m_search_node != NodeLayers::End()) {
+        NodeId i = m_search_node;
+        ASSERT(m_graph->state(i) == NodeState::S || m_graph->state(i) == NodeState::S_orphan);
         m_search_arc = m_graph->ArcsBegin(i);
         m_search_arc_end = m_graph->ArcsEnd(i);
     }
@@ -1,6 +1,12 @@
 #include "submodular-ibfs.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <exception>
+#include <limits>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "flow-solver.hpp"
@@ -10,9 +16,20 @@ typedef std::chrono::duration<double> Duration;
 typedef std::chrono::system_clock Clock;
 
 
-inline std::unique_ptr<FlowSolver> FlowSolver::GetSolver(const SubmodularIBFSParams& params) {
+std::unique_ptr<FlowSolver> FlowSolver::GetSolver(const SubmodularIBFSParams& params, const SoSGraph& graph) {
     typedef SubmodularIBFSParams::FlowAlgorithm Alg;
     typedef std::unique_ptr<FlowSolver> FlowPtr;
+    if (params.pairwiseFastPath && params.alg != Alg::parametric) {
+        bool allPairwise = true;
+        for (const auto& c : graph.GetCliques()) {
+            if (c.Size() != 2) {
+                allPairwise = false;
+                break;
+            }
+        }
+        if (allPairwise)
+            return FlowPtr{ new PairwiseBK{} };
+    }
     switch (params.alg) {
         case Alg::bidirectional:
             return FlowPtr{ new BidirectionalIBFS{} };
@@ -20,6 +37,12 @@ inline std::unique_ptr<FlowSolver> FlowSolver::GetSolver(const SubmodularIBFSPar
             return FlowPtr{ new SourceIBFS{} };
         case Alg::parametric:
             return FlowPtr{ new ParametricIBFS{} };
+        case Alg::pairwise_bk:
+            return FlowPtr{ new PairwiseBK{} };
+        case Alg::reduction:
+            return FlowPtr{ new PairwiseReduction{} };
+        case Alg::tree_dp:
+            return FlowPtr{ new TreeDP{} };
         default:
             ASSERT(false);
     }
@@ -28,24 +51,32 @@ inline std::unique_ptr<FlowSolver> FlowSolver::GetSolver(const SubmodularIBFSPar
 std::vector<std::pair<SubmodularIBFSParams::FlowAlgorithm, std::string>> SubmodularIBFSParams::algNames 
     = { { SubmodularIBFSParams::FlowAlgorithm::bidirectional, "bidirectional" },
         { SubmodularIBFSParams::FlowAlgorithm::source, "source" },
-        { SubmodularIBFSParams::FlowAlgorithm::parametric, "parametric" }
+        { SubmodularIBFSParams::FlowAlgorithm::parametric, "parametric" },
+        { SubmodularIBFSParams::FlowAlgorithm::pairwise_bk, "pairwise_bk" },
+        { SubmodularIBFSParams::FlowAlgorithm::reduction, "reduction" },
+        { SubmodularIBFSParams::FlowAlgorithm::tree_dp, "tree_dp" },
+        { SubmodularIBFSParams::FlowAlgorithm::automatic, "auto" }
     };
 
 SubmodularIBFS::SubmodularIBFS(SubmodularIBFSParams params) 
     : m_params(params),
-    m_flowSolver(FlowSolver::GetSolver(params))
+    m_flowSolver()
 { }
 
 SubmodularIBFS::~SubmodularIBFS() { }
 
 SubmodularIBFS::NodeId SubmodularIBFS::AddNode(int n) {
-    for (int i = 0; i < n; ++i)
-        m_labels.push_back(-1);
+    m_labels.resize(m_labels.size() + n, -1);
     return m_graph.AddNode(n);
 }
 
+void SubmodularIBFS::Reserve(NodeId numNodes, CliqueId numCliques) {
+    m_labels.reserve(numNodes);
+    m_graph.Reserve(numNodes, numCliques);
+}
+
 int SubmodularIBFS::GetLabel(NodeId n) const {
-    return m_labels[n];
+    return m_labels[Internal(n)];
 }
 
 void SubmodularIBFS::AddUnaryTerm(NodeId n, REAL E0, REAL E1) {
@@ -61,7 +92,7 @@ void SubmodularIBFS::AddUnaryTerm(NodeId n, REAL E0, REAL E1) {
         E1 = 0;
     }
     // FIXME: Shouldn't it be the other way around (E1, E0)?
-    m_graph.AddTerminalWeights(n, E0, E1);
+    m_graph.AddTerminalWeights(Internal(n), E0, E1);
 }
 
 void SubmodularIBFS::AddUnaryTerm(NodeId n, REAL coeff) {
@@ -73,20 +104,43 @@ void SubmodularIBFS::ClearUnaries() {
 }
 
 void SubmodularIBFS::AddClique(const std::vector<NodeId>& nodes, const std::vector<REAL>& energyTable) {
+    m_hypertree = -1;
+    m_haveGraphStats = false;
     m_graph.AddClique(nodes, energyTable);
 }
 
+void SubmodularIBFS::AddClique(std::vector<NodeId>&& nodes, std::vector<REAL>&& energyTable) {
+    m_hypertree = -1;
+    m_haveGraphStats = false;
+    m_graph.AddClique(std::move(nodes), std::move(energyTable));
+}
+
+void SubmodularIBFS::AddCliques(int k, CliqueId count, const NodeId* nodes, const REAL* energyTables) {
+    m_hypertree = -1;
+    m_haveGraphStats = false;
+    m_graph.AddCliques(k, count, nodes, energyTables);
+}
+
 void SubmodularIBFS::AddPairwiseTerm(NodeId i, NodeId j, REAL E00, REAL E01, REAL E10, REAL E11) {
     std::vector<NodeId> nodes{i, j};
     std::vector<REAL> energyTable{E00, E01, E10, E11};
-    AddClique(nodes, energyTable);
+    AddClique(std::move(nodes), std::move(energyTable));
 }
 
 REAL SubmodularIBFS::ComputeEnergy() const {
-    return ComputeEnergy(m_labels);
+    return ComputeInternalEnergy(m_labels);
 }
 
 REAL SubmodularIBFS::ComputeEnergy(const std::vector<int>& labels) const {
+    if (m_node_index.empty())
+        return ComputeInternalEnergy(labels);
+    std::vector<int> internalLabels(labels.size());
+    for (NodeId i = 0; i < NodeId(labels.size()); ++i)
+        internalLabels[m_node_index[i]] = labels[i];
+    return ComputeInternalEnergy(internalLabels);
+}
+
+REAL SubmodularIBFS::ComputeInternalEnergy(const std::vector<int>& labels) const {
     // FIXME: Change to actually store the original unaries, since optimization 
     // might change them.
     REAL total = m_constant_term;
@@ -101,6 +155,363 @@ REAL SubmodularIBFS::ComputeEnergy(const std::vector<int>& labels) const {
 }
 
 void SubmodularIBFS::Solve() {
+    m_graph.Freeze();
+    if (m_params.nodeOrder != SoSGraph::NodeOrder::none && m_node_index.empty()
+            && m_graph.GetS() == -1)
+        Reorder();
+    if (m_node_index.empty() || m_params.fixedVars.empty()) {
+        SolveChosen();
+        return;
+    }
+    // The flow solvers read fixedVars in the order of m_graph, so it is
+    // swapped in for the duration of the solve
+    std::vector<bool> fixedVars(m_params.fixedVars.size());
+    for (NodeId i = 0; i < NodeId(fixedVars.size()); ++i)
+        fixedVars[m_node_index[i]] = m_params.fixedVars[i];
+    fixedVars.swap(m_params.fixedVars);
+    try {
+        SolveChosen();
+    } catch (...) {
+        fixedVars.swap(m_params.fixedVars);
+        throw;
+    }
+    fixedVars.swap(m_params.fixedVars);
+}
+
+void SubmodularIBFS::Reorder() {
+    const auto order = m_graph.ComputeOrder(m_params.nodeOrder);
+    const auto cliqueOrder = m_graph.Reorder(order);
+    const NodeId n = order.size();
+    m_node_index.resize(n);
+    std::vector<int> labels(n);
+    for (NodeId k = 0; k < n; ++k) {
+        m_node_index[order[k]] = k;
+        labels[k] = m_labels[order[k]];
+    }
+    m_labels.swap(labels);
+    m_clique_index.resize(cliqueOrder.size());
+    for (CliqueId k = 0; k < CliqueId(cliqueOrder.size()); ++k)
+        m_clique_index[cliqueOrder[k]] = k;
+}
+
+void SubmodularIBFS::SolveChosen() {
+    typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+    if (m_params.alg != Alg::automatic && m_params.ub != SoSGraph::UBfn::automatic) {
+        SolveFlow();
+        return;
+    }
+    // The flow solvers read their choice from m_params, so it is swapped in
+    // for the duration of the solve
+    const Alg alg = m_params.alg;
+    const SoSGraph::UBfn ub = m_params.ub;
+    ChooseSolver(m_params);
+    const Alg chosen = m_params.alg;
+    auto start = Clock::now();
+    try {
+        SolveFlow();
+    } catch (...) {
+        m_params.alg = alg;
+        m_params.ub = ub;
+        throw;
+    }
+    m_params.alg = alg;
+    m_params.ub = ub;
+    if (alg == Alg::automatic && m_autoSolves < m_params.autoProbe) {
+        m_probeTime[static_cast<int>(chosen)] += Duration{ Clock::now() - start }.count();
+        m_probeCount[static_cast<int>(chosen)]++;
+    }
+    m_autoSolves++;
+}
+
+// Solve with source IBFS if one side has at least this many times more
+// nodes than the other. Balanced graphs grow both trees about equally, and
+// the bidirectional search pays off.
+static const double sourceOnlyImbalance = 1.5;
+
+void SubmodularIBFS::ChooseSolver(SubmodularIBFSParams& params) {
+    typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+    // Clique sizes and submodularity cost O(2^k k^2) per clique and only
+    // change with the cliques, so they are counted on the first solve. The
+    // source and sink balance depends on the unaries, and is recounted
+    if (!m_haveGraphStats) {
+        m_graphStats = m_graph.ComputeStats(true);
+        m_haveGraphStats = true;
+    } else if (params.alg == Alg::automatic) {
+        m_graph.CountBalance(m_graphStats);
+    }
+    const auto& stats = m_graphStats;
+    const CliqueId m = m_graph.GetNumCliques();
+    if (params.ub == SoSGraph::UBfn::automatic) {
+        if (stats.nonsubmodularPairwise == m - stats.submodular)
+            params.ub = SoSGraph::UBfn::chen;
+        else
+            params.ub = SoSGraph::UBfn::cvpr14;
+    }
+    if (params.alg != Alg::automatic)
+        return;
+    if (m_probeTime.empty()) {
+        m_probeTime.assign(static_cast<int>(Alg::automatic), 0);
+        m_probeCount.assign(static_cast<int>(Alg::automatic), 0);
+    }
+    if (stats.pairwise == m) {
+        params.alg = Alg::pairwise_bk;
+        return;
+    }
+    // TreeDP is exact and linear time on hypertrees. Only the energies
+    // change between solves, so this is only checked once
+    if (m_hypertree == -1)
+        m_hypertree = TreeDP{}.IsHypertree(m_graph);
+    // Cliques of size at most 3 always reduce exactly to pairwise edges
+    const bool reducible = stats.cliqueSizes.size() <= 4;
+    std::vector<Alg> candidates = { Alg::bidirectional, Alg::source };
+    if (reducible)
+        candidates.push_back(Alg::reduction);
+    if (m_hypertree)
+        candidates.push_back(Alg::tree_dp);
+    if (m_autoSolves < params.autoProbe) {
+        params.alg = candidates[m_autoSolves % candidates.size()];
+    } else if (params.autoProbe > 0) {
+        params.alg = candidates[0];
+        double bestTime = std::numeric_limits<double>::max();
+        for (Alg a : candidates) {
+            int idx = static_cast<int>(a);
+            if (m_probeCount[idx] > 0 && m_probeTime[idx] / m_probeCount[idx] < bestTime) {
+                bestTime = m_probeTime[idx] / m_probeCount[idx];
+                params.alg = a;
+            }
+        }
+    } else if (m_hypertree) {
+        params.alg = Alg::tree_dp;
+    } else if (reducible) {
+        params.alg = Alg::reduction;
+    } else if (std::max(stats.sourceNodes, stats.sinkNodes)
+            >= sourceOnlyImbalance * std::min(stats.sourceNodes, stats.sinkNodes)) {
+        params.alg = Alg::source;
+    } else {
+        params.alg = Alg::bidirectional;
+    }
+}
+
+void SubmodularIBFS::SolveFlow() {
+    // The solver is chosen on the first solve, once the graph is known, and
+    // again whenever the choice of algorithm changes
+    if (!m_flowSolver || m_flowSolverAlg != m_params.alg) {
+        m_flowSolver = FlowSolver::GetSolver(m_params, m_graph);
+        m_flowSolverAlg = m_params.alg;
+    }
+    if (m_params.decompose
+            && m_params.alg != SubmodularIBFSParams::FlowAlgorithm::parametric
+            && SolveComponents())
+        return;
     m_flowSolver->Solve(this);    
 }
 
+void SubmodularIBFS::SetupFlow() {
+    auto start = Clock::now();
+    if (m_params.fusedSetup) {
+        m_graph.SetupFlow(m_params.ub, m_params.fixedVars, &m_normStats, m_params.numThreads);
+        m_setupStats.cliquePasses = 1;
+    } else {
+        m_graph.ResetFlow();
+        m_graph.UpperBoundCliques(m_params.ub, m_params.fixedVars, m_labels, &m_normStats);
+        m_setupStats.cliquePasses = 2;
+    }
+    m_setupStats.time = Duration{ Clock::now() - start }.count();
+}
+
+// Components smaller than this are batched together into one subproblem, so
+// that we don't pay the setup cost of a solver for each of them
+static const SoSGraph::NodeId minGroupSize = 1024;
+
+bool SubmodularIBFS::SolveComponents() {
+    const NodeId n = m_graph.NumNodes();
+    const auto& fixedVars = m_params.fixedVars;
+    auto isFixed = [&](NodeId i) { return !fixedVars.empty() && fixedVars[i]; };
+
+    // Union-find over the unfixed nodes of each clique
+    std::vector<NodeId> root(n);
+    for (NodeId i = 0; i < n; ++i)
+        root[i] = i;
+    auto find = [&](NodeId i) {
+        while (root[i] != i) {
+            root[i] = root[root[i]];
+            i = root[i];
+        }
+        return i;
+    };
+    for (const auto& c : m_graph.GetCliques()) {
+        NodeId first = -1;
+        for (NodeId i : c.Nodes()) {
+            if (isFixed(i))
+                continue;
+            if (first == -1) {
+                first = find(i);
+            } else {
+                NodeId r = find(i);
+                if (r != first)
+                    root[r] = first;
+            }
+        }
+    }
+    std::vector<NodeId> compSize(n, 0);
+    for (NodeId i = 0; i < n; ++i) {
+        root[i] = find(i);
+        compSize[root[i]]++;
+    }
+
+    // Assign each component with more than one node to a group, in order of
+    // their first node, so that the grouping doesn't depend on the number
+    // of threads
+    std::vector<int> compGroup(n, -1);
+    std::vector<std::vector<NodeId>> groupNodes;
+    std::vector<std::vector<CliqueId>> groupCliques;
+    std::vector<NodeId> localId(n, -1);
+    NodeId lastGroupSize = minGroupSize;
+    for (NodeId i = 0; i < n; ++i) {
+        NodeId r = root[i];
+        if (compSize[r] == 1)
+            continue;
+        if (compGroup[r] == -1) {
+            if (lastGroupSize >= minGroupSize) {
+                groupNodes.emplace_back();
+                lastGroupSize = 0;
+            }
+            compGroup[r] = groupNodes.size() - 1;
+            lastGroupSize += compSize[r];
+        }
+        auto& nodes = groupNodes[compGroup[r]];
+        localId[i] = nodes.size();
+        nodes.push_back(i);
+    }
+    if (groupNodes.size() < 2)
+        return false;
+    groupCliques.resize(groupNodes.size());
+    for (CliqueId cid = 0; cid < m_graph.GetNumCliques(); ++cid) {
+        for (NodeId i : m_graph.clique(cid).Nodes()) {
+            if (!isFixed(i)) {
+                int g = compGroup[root[i]];
+                if (g != -1)
+                    groupCliques[g].push_back(cid);
+                break;
+            }
+        }
+    }
+
+    // Bound all cliques, and cut the single nodes. Their cliques (if any)
+    // have no capacity, so the cut only depends on the terminal edges
+    SetupFlow();
+    for (NodeId i = 0; i < n; ++i) {
+        if (compSize[root[i]] != 1)
+            continue;
+        REAL resSource = m_graph.m_c_si[i] - m_graph.m_phi_si[i];
+        REAL resSink = m_graph.m_c_it[i] - m_graph.m_phi_it[i];
+        REAL minCap = std::min(resSource, resSink);
+        m_graph.m_phi_si[i] += minCap;
+        m_graph.m_phi_it[i] += minCap;
+        m_labels[i] = (resSource > resSink) ? 1 : 0;
+    }
+
+    std::vector<NodeId> groupFixed(groupNodes.size(), 0);
+    std::vector<SoSGraph::SearchStats> groupSearch(groupNodes.size());
+    auto solveGroup = [&](size_t g) {
+        const auto& nodes = groupNodes[g];
+        SubmodularIBFSParams params = m_params;
+        params.decompose = false;
+        params.nodeOrder = SoSGraph::NodeOrder::none;
+        // Groups are already solved in parallel
+        params.numThreads = 1;
+        params.fixedVars.assign(nodes.size(), false);
+        SubmodularIBFS sub(params);
+        sub.Reserve(nodes.size(), groupCliques[g].size());
+        sub.AddNode(nodes.size());
+        SoSGraph& subGraph = sub.Graph();
+        for (NodeId li = 0; li < NodeId(nodes.size()); ++li) {
+            subGraph.AddTerminalWeights(li, m_graph.m_c_si[nodes[li]], m_graph.m_c_it[nodes[li]]);
+            sub.GetLabels()[li] = m_labels[nodes[li]];
+        }
+        // Fixed nodes may be shared between groups, so each group gets its
+        // own copy, without terminal edges. Their flow is already set above.
+        std::unordered_map<NodeId, NodeId> fixedLocal;
+        std::vector<NodeId> cliqueNodes;
+        for (CliqueId cid : groupCliques[g]) {
+            const auto& c = m_graph.clique(cid);
+            cliqueNodes.clear();
+            for (NodeId i : c.Nodes()) {
+                if (!isFixed(i)) {
+                    cliqueNodes.push_back(localId[i]);
+                    continue;
+                }
+                auto it = fixedLocal.find(i);
+                if (it == fixedLocal.end()) {
+                    NodeId li = sub.AddNode();
+                    sub.GetLabels()[li] = m_labels[i];
+                    sub.Params().fixedVars.push_back(true);
+                    it = fixedLocal.insert(std::make_pair(i, li)).first;
+                }
+                cliqueNodes.push_back(it->second);
+            }
+            sub.AddClique(cliqueNodes, c.EnergyTable());
+        }
+
+        sub.Solve();
+
+        // Write back the flow and cut. Nodes and cliques are disjoint
+        // between groups, so this is safe to do concurrently.
+        const SoSGraph& subGraphConst = subGraph;
+        for (NodeId li = 0; li < NodeId(nodes.size()); ++li) {
+            NodeId i = nodes[li];
+            m_graph.m_phi_si[i] = subGraphConst.GetPhi_si()[li];
+            m_graph.m_phi_it[i] = subGraphConst.GetPhi_it()[li];
+            m_labels[i] = sub.GetLabel(li);
+        }
+        CliqueId lc = 0;
+        for (CliqueId cid : groupCliques[g]) {
+            auto& c = m_graph.clique(cid);
+            const auto& subC = subGraphConst.clique(lc++);
+            c.AlphaCi() = subC.AlphaCi();
+            c.AlphaEnergy() = subC.AlphaEnergy();
+            c.ComputeMinTightSets();
+        }
+        groupFixed[g] = sub.ReductionStats()->fixed;
+        groupSearch[g] = *sub.SearchStats();
+    };
+
+    int numThreads = m_params.numThreads;
+    if (numThreads <= 0)
+        numThreads = std::max<int>(std::thread::hardware_concurrency(), 1);
+    numThreads = std::min<int>(numThreads, groupNodes.size());
+    std::atomic<size_t> nextGroup(0);
+    std::vector<std::exception_ptr> errors(numThreads);
+    auto worker = [&](int t) {
+        try {
+            for (size_t g = nextGroup++; g < groupNodes.size(); g = nextGroup++)
+                solveGroup(g);
+        } catch (...) {
+            errors[t] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < numThreads; ++t)
+        threads.emplace_back(worker, t);
+    worker(0);
+    for (auto& th : threads)
+        th.join();
+    for (const auto& e : errors) {
+        if (e)
+            std::rethrow_exception(e);
+    }
+
+    m_reductionStats.nodes = n;
+    m_reductionStats.fixed = 0;
+    for (NodeId f : groupFixed)
+        m_reductionStats.fixed += f;
+    m_searchStats = SoSGraph::SearchStats{};
+    for (const auto& st : groupSearch) {
+        m_searchStats.arcScans += st.arcScans;
+        m_searchStats.relabels += st.relabels;
+        m_searchStats.gapNodes += st.gapNodes;
+        m_searchStats.globalRelabels += st.globalRelabels;
+    }
+    return true;
+}
+
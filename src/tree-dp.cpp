@@ -0,0 +1,358 @@
+#include "flow-solver.hpp"
+
+#include <cstdlib>
+#include <deque>
+#include <limits>
+
+#include "submodular-ibfs.hpp"
+
+// Bits of x at the given positions, packed into the low bits
+static inline SoSGraph::IBFSEnergyTableClique::Assignment
+Project(SoSGraph::IBFSEnergyTableClique::Assignment x, const std::vector<int>& positions) {
+    SoSGraph::IBFSEnergyTableClique::Assignment result = 0;
+    for (size_t t = 0; t < positions.size(); ++t)
+        result |= ((x >> positions[t]) & 1) << t;
+    return result;
+}
+
+bool TreeDP::BuildJoinTree() {
+    const NodeId n = m_graph->NumNodes();
+    const CliqueId m = m_graph->GetNumCliques();
+    const auto& neighbors = m_graph->GetNeighbors();
+
+    // Number of remaining cliques containing each node
+    std::vector<int> deg(n);
+    for (NodeId i = 0; i < n; ++i)
+        deg[i] = neighbors[i].size();
+    std::vector<char> removed(m, false);
+    m_order.clear();
+    m_parent.assign(m, -1);
+    m_children.assign(m, std::vector<CliqueId>{});
+    m_sep.assign(m, std::vector<int>{});
+    m_sep_in_parent.assign(m, std::vector<int>{});
+
+    std::deque<CliqueId> queue;
+    for (CliqueId c = 0; c < m; ++c)
+        queue.push_back(c);
+    std::vector<int> shared;
+    while (!queue.empty()) {
+        CliqueId c = queue.front();
+        queue.pop_front();
+        if (removed[c])
+            continue;
+        const auto& nodes = m_graph->clique(c).Nodes();
+        shared.clear();
+        for (size_t p = 0; p < nodes.size(); ++p) {
+            if (deg[nodes[p]] > 1)
+                shared.push_back(p);
+        }
+        // c is an ear if some other clique contains all of its shared
+        // nodes, so look among the cliques of the shared node in the fewest
+        CliqueId parent = -1;
+        if (!shared.empty()) {
+            NodeId s0 = nodes[shared[0]];
+            for (int p : shared) {
+                if (neighbors[nodes[p]].size() < neighbors[s0].size())
+                    s0 = nodes[p];
+            }
+            for (CliqueId cand : neighbors[s0]) {
+                if (cand == c || removed[cand])
+                    continue;
+                const auto& candClique = m_graph->clique(cand);
+                bool contains = true;
+                for (int p : shared) {
+                    if (candClique.GetIndex(nodes[p]) == candClique.Size()) {
+                        contains = false;
+                        break;
+                    }
+                }
+                if (contains) {
+                    parent = cand;
+                    break;
+                }
+            }
+            // Not an ear yet. It can only become one once one of its
+            // nodes is left in no other clique, and then it is requeued
+            if (parent == -1)
+                continue;
+        }
+
+        removed[c] = true;
+        m_order.push_back(c);
+        m_parent[c] = parent;
+        m_sep[c] = shared;
+        if (parent != -1) {
+            m_children[parent].push_back(c);
+            const auto& parentClique = m_graph->clique(parent);
+            for (int p : shared)
+                m_sep_in_parent[c].push_back(parentClique.GetIndex(nodes[p]));
+        }
+        for (NodeId i : nodes) {
+            if (--deg[i] != 1)
+                continue;
+            for (CliqueId cand : neighbors[i]) {
+                if (!removed[cand]) {
+                    queue.push_back(cand);
+                    break;
+                }
+            }
+        }
+    }
+    return CliqueId(m_order.size()) == m;
+}
+
+void TreeDP::Upward(CliqueId c) {
+    const auto& clique = m_graph->clique(c);
+    const auto& nodes = clique.Nodes();
+    const auto& energy = clique.AlphaEnergy();
+    const auto& sep = m_sep[c];
+    const size_t k = clique.Size();
+    const Assignment num_assgns = Assignment(1) << k;
+    const size_t sep_size = sep.size();
+
+    Assignment sepMask = 0;
+    for (int p : sep)
+        sepMask |= Assignment(1) << p;
+
+    // Minimize out the nodes not shared with the rest of the tree, for each
+    // side of s and t. Terminal edges are cut if s is in S and the node
+    // isn't, or the node is in S and t isn't
+    auto& sepEnergy = m_sep_energy[c];
+    sepEnergy.assign(Assignment(1) << (sep_size + 2), std::numeric_limits<REAL>::max());
+    for (Assignment terminals = 0; terminals < 4; ++terminals) {
+        const bool sInS = terminals & 1;
+        const bool tInS = terminals & 2;
+        for (Assignment x = 0; x < num_assgns; ++x) {
+            REAL value = energy[x];
+            for (CliqueId child : m_children[c]) {
+                const Assignment childTerminals = terminals << m_sep[child].size();
+                value += m_sep_energy[child][Project(x, m_sep_in_parent[child]) | childTerminals];
+            }
+            for (size_t p = 0; p < k; ++p) {
+                if (sepMask & (Assignment(1) << p))
+                    continue;
+                const bool inS = (x >> p) & 1;
+                const REAL tr = m_tr_cap[nodes[p]];
+                if (tr > 0 && sInS && !inS)
+                    value += tr;
+                else if (tr < 0 && inS && !tInS)
+                    value -= tr;
+            }
+            REAL& sepValue = sepEnergy[Project(x, sep) | (terminals << sep_size)];
+            sepValue = std::min(sepValue, value);
+        }
+    }
+}
+
+void TreeDP::LocalFlow(std::vector<Clique*>& cliques,
+        const std::vector<const std::vector<int>*>& cliqueNodes,
+        std::vector<REAL>& supply) {
+    const int k = supply.size();
+    // The arc used to reach each node in the search: the previous node
+    // (-1 for a start, -2 if not reached), clique and indices in it
+    std::vector<int> prevNode(k), prevClique(k), prevFrom(k), prevTo(k);
+    std::vector<int> queue;
+    while (true) {
+        prevNode.assign(k, -2);
+        queue.clear();
+        for (int u = 0; u < k; ++u) {
+            if (supply[u] > 0) {
+                prevNode[u] = -1;
+                queue.push_back(u);
+            }
+        }
+        int end = -1;
+        for (size_t head = 0; head < queue.size() && end == -1; ++head) {
+            int u = queue[head];
+            for (size_t ci = 0; ci < cliques.size() && end == -1; ++ci) {
+                const auto& cn = *cliqueNodes[ci];
+                for (size_t a = 0; a < cn.size(); ++a) {
+                    if (cn[a] != u)
+                        continue;
+                    for (size_t b = 0; b < cn.size(); ++b) {
+                        int v = cn[b];
+                        if (b == a || prevNode[v] != -2
+                                || !cliques[ci]->NonzeroCapacity(a, b))
+                            continue;
+                        prevNode[v] = u;
+                        prevClique[v] = ci;
+                        prevFrom[v] = a;
+                        prevTo[v] = b;
+                        if (supply[v] < 0) {
+                            end = v;
+                            break;
+                        }
+                        queue.push_back(v);
+                    }
+                    break;
+                }
+            }
+        }
+        if (end == -1)
+            break;
+
+        REAL delta = -supply[end];
+        int v = end;
+        for (; prevNode[v] != -1; v = prevNode[v])
+            delta = std::min(delta, cliques[prevClique[v]]->ExchangeCapacity(prevFrom[v], prevTo[v]));
+        delta = std::min(delta, supply[v]);
+        ASSERT(delta > 0);
+        supply[end] += delta;
+        for (v = end; prevNode[v] != -1; v = prevNode[v])
+            cliques[prevClique[v]]->Push(prevFrom[v], prevTo[v], delta);
+        supply[v] -= delta;
+    }
+}
+
+void TreeDP::Downward(CliqueId c) {
+    auto& clique = m_graph->clique(c);
+    const auto& nodes = clique.Nodes();
+    const auto& sep = m_sep[c];
+    const auto& children = m_children[c];
+    const int k = clique.Size();
+    // Local indices of the terminals
+    const int s = k;
+    const int t = k + 1;
+
+    // The root has to maximize the flow from s to t, everything else
+    // routes exactly the flow its parent sent into its subtree
+    std::vector<REAL> supply(k + 2, 0);
+    if (m_parent[c] == -1) {
+        supply[s] = std::numeric_limits<REAL>::max() / 4;
+        supply[t] = -supply[s];
+    } else {
+        const auto& demand = m_demand[c];
+        for (size_t i = 0; i < sep.size(); ++i)
+            supply[sep[i]] = demand[i];
+        supply[s] = demand[sep.size()];
+        supply[t] = demand[sep.size() + 1];
+    }
+
+    std::vector<char> isSep(k, false);
+    for (int p : sep)
+        isSep[p] = true;
+    std::vector<int> identity(k);
+    for (int p = 0; p < k; ++p)
+        identity[p] = p;
+    std::vector<Clique*> cliques{ &clique };
+    std::vector<const std::vector<int>*> cliqueNodes{ &identity };
+    // Terminal edges of the private nodes, and the functions of the
+    // children, as cliques on the local nodes
+    std::vector<Clique> localCliques;
+    std::vector<std::vector<int>> localNodes;
+    localCliques.reserve(k + children.size());
+    localNodes.reserve(k + children.size());
+    std::vector<int> terminalClique(k, -1);
+    for (int p = 0; p < k; ++p) {
+        const REAL tr = m_tr_cap[nodes[p]];
+        if (isSep[p] || tr == 0)
+            continue;
+        terminalClique[p] = localCliques.size();
+        if (tr > 0)
+            localNodes.push_back(std::vector<int>{ s, p });
+        else
+            localNodes.push_back(std::vector<int>{ p, t });
+        localCliques.emplace_back(localNodes.back(), std::vector<REAL>{ 0, std::abs(tr), 0, 0 });
+    }
+    const size_t firstChild = localCliques.size();
+    for (CliqueId child : children) {
+        localNodes.push_back(m_sep_in_parent[child]);
+        localNodes.back().push_back(s);
+        localNodes.back().push_back(t);
+        localCliques.emplace_back(localNodes.back(), m_sep_energy[child]);
+    }
+    for (size_t i = 0; i < localCliques.size(); ++i) {
+        localCliques[i].ComputeMinTightSets();
+        cliques.push_back(&localCliques[i]);
+        cliqueNodes.push_back(&localNodes[i]);
+    }
+    LocalFlow(cliques, cliqueNodes, supply);
+
+    // The subtree of c can always route the flow its parent sent into it,
+    // since that is bounded by its cut function
+    for (int p = 0; p < k; ++p)
+        ASSERT(supply[p] == 0);
+    for (size_t i = 0; i < children.size(); ++i)
+        m_demand[children[i]] = localCliques[firstChild + i].AlphaCi();
+    // The flow out of s, or into t, is the first entry of AlphaCi of the
+    // terminal edge
+    for (int p = 0; p < k; ++p) {
+        if (isSep[p])
+            continue;
+        const NodeId i = nodes[p];
+        REAL res = m_tr_cap[i];
+        if (terminalClique[p] != -1) {
+            const REAL flow = localCliques[terminalClique[p]].AlphaCi()[0];
+            res += (res > 0) ? -flow : flow;
+        }
+        m_graph->m_phi_si[i] = m_graph->m_c_si[i] - std::max<REAL>(res, 0);
+        m_graph->m_phi_it[i] = m_graph->m_c_it[i] - std::max<REAL>(-res, 0);
+    }
+}
+
+void TreeDP::ComputeMinCut() {
+    // Source side of the minimum cut is everything reachable from s in the
+    // residual graph
+    auto& labels = m_energy->GetLabels();
+    const NodeId n = m_graph->NumNodes();
+    std::vector<NodeId> queue;
+    for (NodeId i = 0; i < n; ++i) {
+        if (m_graph->m_c_si[i] > m_graph->m_phi_si[i]) {
+            labels[i] = 1;
+            queue.push_back(i);
+        } else {
+            labels[i] = 0;
+        }
+    }
+    for (size_t head = 0; head < queue.size(); ++head) {
+        NodeId i = queue[head];
+        auto arcsEnd = m_graph->ArcsEnd(i);
+        for (auto arc = m_graph->ArcsBegin(i); arc != arcsEnd; ++arc) {
+            NodeId j = arc.Target();
+            if (labels[j] == 0 && m_graph->NonzeroCap(arc, true)) {
+                labels[j] = 1;
+                queue.push_back(j);
+            }
+        }
+    }
+}
+
+void TreeDP::Solve(SubmodularIBFS* energy) {
+    m_energy = energy;
+    m_interrupt = energy->Params().interrupt;
+    m_graph = &energy->Graph();
+    energy->SetupFlow();
+    if (!BuildJoinTree()) {
+        if (!m_fallback)
+            m_fallback.reset(new BidirectionalIBFS{});
+        m_fallback->Solve(energy);
+        return;
+    }
+
+    const NodeId n = m_graph->NumNodes();
+    const CliqueId m = m_graph->GetNumCliques();
+    m_tr_cap.resize(n);
+    for (NodeId i = 0; i < n; ++i) {
+        m_tr_cap[i] = (m_graph->m_c_si[i] - m_graph->m_phi_si[i])
+            - (m_graph->m_c_it[i] - m_graph->m_phi_it[i]);
+    }
+    m_sep_energy.resize(m);
+    m_demand.resize(m);
+
+    for (CliqueId c : m_order) {
+        Poll();
+        Upward(c);
+    }
+    for (auto it = m_order.rbegin(); it != m_order.rend(); ++it) {
+        Poll();
+        Downward(*it);
+    }
+    // Nodes in no clique only have their terminal edges
+    for (NodeId i = 0; i < n; ++i) {
+        if (!m_graph->GetNeighbors()[i].empty())
+            continue;
+        m_graph->m_phi_si[i] = m_graph->m_c_si[i] - std::max<REAL>(m_tr_cap[i], 0);
+        m_graph->m_phi_it[i] = m_graph->m_c_it[i] - std::max<REAL>(-m_tr_cap[i], 0);
+    }
+    ComputeMinCut();
+}
@@ -0,0 +1,79 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "test-util.hpp"
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+
+BOOST_AUTO_TEST_SUITE(AutomaticTests)
+
+BOOST_AUTO_TEST_CASE(MatchesBruteForce) {
+    const int n = 12;
+    for (int probe : { 0, 4 }) {
+        for (int k = 2; k <= 4; ++k) {
+            for (int seed = 0; seed < 20; ++seed) {
+                std::mt19937 rng(seed);
+                SubmodularIBFSParams params(Alg::automatic);
+                params.ub = SoSGraph::UBfn::automatic;
+                params.autoProbe = probe;
+                SubmodularIBFS ibfs(params);
+                ibfs.AddNode(n);
+                AddRandomCliques(ibfs, rng, n, k, 15);
+                // Probing tries a different solver on each of the first
+                // solves
+                for (int iter = 0; iter < 6; ++iter) {
+                    AddRandomUnaries(ibfs, rng, n);
+                    ibfs.Solve();
+                    BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+                    ibfs.ClearUnaries();
+                    ibfs.AddConstantTerm(-ibfs.GetConstantTerm());
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(HypertreeMatchesBruteForce) {
+    for (int probe : { 0, 4 }) {
+        for (int k = 3; k <= 4; ++k) {
+            for (int seed = 0; seed < 20; ++seed) {
+                std::mt19937 rng(seed);
+                SubmodularIBFSParams params(Alg::automatic);
+                params.autoProbe = probe;
+                SubmodularIBFS ibfs(params);
+                const int n = AddRandomHypertree(ibfs, rng, k, 5);
+                for (int iter = 0; iter < 6; ++iter) {
+                    AddRandomUnaries(ibfs, rng, n);
+                    ibfs.Solve();
+                    BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+                    ibfs.ClearUnaries();
+                    ibfs.AddConstantTerm(-ibfs.GetConstantTerm());
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(StatsFollowUnaries) {
+    // Clique statistics are kept from the first solve, while the source
+    // and sink counts follow the unaries
+    const int n = 10;
+    std::mt19937 rng(2);
+    SubmodularIBFS ibfs(SubmodularIBFSParams(Alg::automatic));
+    ibfs.AddNode(n);
+    AddRandomCliques(ibfs, rng, n, 2, 10);
+    AddRandomCliques(ibfs, rng, n, 3, 5);
+    for (REAL cost : { 1000, -1000 }) {
+        ibfs.ClearUnaries();
+        for (int i = 0; i < n; ++i)
+            ibfs.AddUnaryTerm(i, std::max<REAL>(cost, 0), std::max<REAL>(-cost, 0));
+        ibfs.Solve();
+        BOOST_CHECK_EQUAL(ibfs.GraphStats()->pairwise, 10);
+        BOOST_CHECK_EQUAL(ibfs.GraphStats()->cliqueSizes[3], 5);
+        const auto* stats = ibfs.GraphStats();
+        BOOST_CHECK_EQUAL((cost > 0) ? stats->sourceNodes : stats->sinkNodes, n);
+        BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,130 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "test-util.hpp"
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+
+BOOST_AUTO_TEST_SUITE(BuilderTests)
+
+BOOST_AUTO_TEST_CASE(AddCliquesMatchesAddClique) {
+    // The same cliques added one at a time and in blocks of flat arrays,
+    // with some AddClique calls between the blocks
+    const int n = 12;
+    const int count = 15;
+    for (int k = 2; k <= 4; ++k) {
+        for (int seed = 0; seed < 20; ++seed) {
+            std::mt19937 rng(seed);
+            SubmodularIBFSParams params(Alg::bidirectional);
+            params.pairwiseFastPath = false;
+            SubmodularIBFS single(params), bulk(params);
+            single.AddNode(n);
+            bulk.Reserve(n, count);
+            bulk.AddNode(n);
+            std::vector<SubmodularIBFS::NodeId> nodes;
+            std::vector<REAL> tables;
+            for (int c = 0; c < count; ++c) {
+                auto cliqueNodes = RandomNodes(rng, n, k);
+                auto table = RandomSubmodularTable(rng, k);
+                single.AddClique(cliqueNodes, table);
+                if (c % 5 == 4) {
+                    bulk.AddClique(cliqueNodes, table);
+                    continue;
+                }
+                nodes.insert(nodes.end(), cliqueNodes.begin(), cliqueNodes.end());
+                tables.insert(tables.end(), table.begin(), table.end());
+                if (c % 5 == 3) {
+                    bulk.AddCliques(k, nodes.size() / k, nodes.data(), tables.data());
+                    nodes.clear();
+                    tables.clear();
+                }
+            }
+            std::vector<int> labels(n);
+            for (int i = 0; i < n; ++i) {
+                const REAL e0 = rng() % 30, e1 = rng() % 30;
+                single.AddUnaryTerm(i, e0, e1);
+                bulk.AddUnaryTerm(i, e0, e1);
+                labels[i] = rng() % 2;
+            }
+            BOOST_CHECK_EQUAL(bulk.ComputeEnergy(labels), single.ComputeEnergy(labels));
+            single.Solve();
+            bulk.Solve();
+            BOOST_CHECK_EQUAL(bulk.ComputeEnergy(), BruteForceMin(single, n));
+            BOOST_CHECK_EQUAL(single.ComputeEnergy(), bulk.ComputeEnergy());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(AddCliquesWithoutTables) {
+    // Cliques added without tables have zero energy, and only the unaries
+    // count
+    const int n = 10;
+    std::mt19937 rng(3);
+    SubmodularIBFSParams params(Alg::bidirectional);
+    params.pairwiseFastPath = false;
+    SubmodularIBFS ibfs(params);
+    ibfs.AddNode(n);
+    std::vector<SubmodularIBFS::NodeId> nodes;
+    for (int c = 0; c < 8; ++c) {
+        auto cliqueNodes = RandomNodes(rng, n, 3);
+        nodes.insert(nodes.end(), cliqueNodes.begin(), cliqueNodes.end());
+    }
+    ibfs.AddCliques(3, 8, nodes.data());
+    AddRandomUnaries(ibfs, rng, n);
+    ibfs.Solve();
+    BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+}
+
+BOOST_AUTO_TEST_CASE(SharedTables) {
+    // Many cliques with a few distinct tables share them, and solving
+    // leaves the shared tables unchanged
+    const int n = 12;
+    for (int seed = 0; seed < 20; ++seed) {
+        std::mt19937 rng(seed);
+        SubmodularIBFSParams params(Alg::bidirectional);
+        params.pairwiseFastPath = false;
+        SubmodularIBFS ibfs(params);
+        ibfs.AddNode(n);
+        std::vector<std::vector<REAL>> distinct;
+        for (int t = 0; t < 3; ++t)
+            distinct.push_back(RandomSubmodularTable(rng, 3));
+        std::vector<int> which;
+        for (int c = 0; c < 30; ++c) {
+            which.push_back(rng() % distinct.size());
+            ibfs.AddClique(RandomNodes(rng, n, 3), distinct[which.back()]);
+        }
+        ibfs.Graph().Freeze();
+        auto& cliques = ibfs.Graph().GetCliques();
+        for (int c = 1; c < 30; ++c) {
+            for (int d = 0; d < c; ++d) {
+                const bool shared = &cliques[c].EnergyTable() == &cliques[d].EnergyTable();
+                BOOST_CHECK_EQUAL(shared, which[c] == which[d]);
+            }
+        }
+        for (int iter = 0; iter < 3; ++iter) {
+            ibfs.ClearUnaries();
+            ibfs.AddConstantTerm(-ibfs.GetConstantTerm());
+            AddRandomUnaries(ibfs, rng, n);
+            ibfs.Solve();
+            BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+        }
+        for (int c = 0; c < 30; ++c)
+            BOOST_CHECK(cliques[c].EnergyTable() == distinct[which[c]]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(MutableTableIsCopied) {
+    SubmodularIBFS ibfs;
+    ibfs.AddNode(4);
+    const std::vector<REAL> table = { 0, 1, 1, 2, 1, 2, 2, 0 };
+    ibfs.AddClique({ 0, 1, 2 }, table);
+    ibfs.AddClique({ 1, 2, 3 }, table);
+    ibfs.Graph().Freeze();
+    auto& cliques = ibfs.Graph().GetCliques();
+    BOOST_CHECK(&cliques[0].EnergyTable() == &cliques[1].EnergyTable());
+    cliques[0].MutableEnergyTable()[7] = 3;
+    BOOST_CHECK_EQUAL(cliques[0].EnergyTable()[7], 3);
+    BOOST_CHECK(cliques[1].EnergyTable() == table);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,62 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "test-util.hpp"
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+
+BOOST_AUTO_TEST_SUITE(DecomposeTests)
+
+// Random energy with cliques of size k within each of parts blocks of
+// size nodes, so that it splits into (at least) parts components, plus
+// loose nodes in no clique
+static void AddBlockEnergy(SubmodularIBFS& ibfs, int seed, int k, int parts, int size, int loose) {
+    std::mt19937 rng(seed);
+    const int n = parts*size + loose;
+    ibfs.AddNode(n);
+    AddRandomUnaries(ibfs, rng, n);
+    for (int part = 0; part < parts; ++part) {
+        for (int c = 0; c < 2*size; ++c) {
+            auto nodes = RandomNodes(rng, size, k);
+            for (auto& i : nodes)
+                i += part*size;
+            ibfs.AddClique(nodes, RandomSubmodularTable(rng, k));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(MatchesWholeGraph) {
+    // Components are only solved separately once they are large enough, so
+    // compare with solving the whole graph instead of brute force
+    for (int k = 2; k <= 3; ++k) {
+        for (int seed = 0; seed < 5; ++seed) {
+            REAL energy[2];
+            for (int decompose = 0; decompose < 2; ++decompose) {
+                SubmodularIBFSParams params(Alg::bidirectional);
+                params.decompose = decompose;
+                params.pairwiseFastPath = false;
+                params.numThreads = 2;
+                SubmodularIBFS ibfs(params);
+                AddBlockEnergy(ibfs, seed, k, 3, 1500, 10);
+                ibfs.Solve();
+                energy[decompose] = ibfs.ComputeEnergy();
+            }
+            BOOST_CHECK_EQUAL(energy[0], energy[1]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(SmallMatchesBruteForce) {
+    const int n = 2*4 + 4;
+    for (int seed = 0; seed < 20; ++seed) {
+        SubmodularIBFSParams params(Alg::bidirectional);
+        params.decompose = true;
+        params.pairwiseFastPath = false;
+        SubmodularIBFS ibfs(params);
+        AddBlockEnergy(ibfs, seed, 3, 2, 4, 4);
+        ibfs.Solve();
+        BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,61 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "test-util.hpp"
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+
+BOOST_AUTO_TEST_SUITE(PairwiseBKTests)
+
+BOOST_AUTO_TEST_CASE(MatchesBruteForce) {
+    const int n = 12;
+    for (int seed = 0; seed < 100; ++seed) {
+        std::mt19937 rng(seed);
+        SubmodularIBFSParams params(Alg::pairwise_bk);
+        SubmodularIBFS ibfs(params);
+        ibfs.AddNode(n);
+        AddRandomUnaries(ibfs, rng, n);
+        AddRandomCliques(ibfs, rng, n, 2, 25);
+        ibfs.Solve();
+        BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(FastPathMatchesBruteForce) {
+    // The fast path picks PairwiseBK for all-pairwise graphs, whatever the
+    // algorithm asked for
+    const int n = 12;
+    for (int seed = 0; seed < 100; ++seed) {
+        std::mt19937 rng(seed);
+        SubmodularIBFSParams params(Alg::source);
+        SubmodularIBFS ibfs(params);
+        ibfs.AddNode(n);
+        AddRandomUnaries(ibfs, rng, n);
+        for (int c = 0; c < 25; ++c) {
+            auto nodes = RandomNodes(rng, n, 2);
+            REAL e01 = rng() % 20, e10 = rng() % 20;
+            ibfs.AddPairwiseTerm(nodes[0], nodes[1], 0, e01, e10, rng() % (e01 + e10 + 1));
+        }
+        ibfs.Solve();
+        BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(RepeatedSolves) {
+    // The solver is kept between solves, with new unaries each time
+    const int n = 12;
+    std::mt19937 rng(7);
+    SubmodularIBFSParams params(Alg::pairwise_bk);
+    SubmodularIBFS ibfs(params);
+    ibfs.AddNode(n);
+    AddRandomCliques(ibfs, rng, n, 2, 25);
+    for (int iter = 0; iter < 20; ++iter) {
+        ibfs.ClearUnaries();
+        ibfs.AddConstantTerm(-ibfs.GetConstantTerm());
+        AddRandomUnaries(ibfs, rng, n);
+        ibfs.Solve();
+        BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
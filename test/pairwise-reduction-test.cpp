@@ -0,0 +1,45 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "test-util.hpp"
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+
+BOOST_AUTO_TEST_SUITE(PairwiseReductionTests)
+
+BOOST_AUTO_TEST_CASE(MatchesBruteForce) {
+    // Cliques of size 4 may not reduce, and then fall back to IBFS
+    const int n = 12;
+    for (int k = 2; k <= 4; ++k) {
+        for (int seed = 0; seed < 50; ++seed) {
+            std::mt19937 rng(seed);
+            SubmodularIBFSParams params(Alg::reduction);
+            params.pairwiseFastPath = false;
+            SubmodularIBFS ibfs(params);
+            ibfs.AddNode(n);
+            AddRandomUnaries(ibfs, rng, n);
+            AddRandomCliques(ibfs, rng, n, k, 20);
+            ibfs.Solve();
+            BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(RepeatedSolves) {
+    const int n = 12;
+    std::mt19937 rng(5);
+    SubmodularIBFSParams params(Alg::reduction);
+    params.pairwiseFastPath = false;
+    SubmodularIBFS ibfs(params);
+    ibfs.AddNode(n);
+    AddRandomCliques(ibfs, rng, n, 3, 20);
+    for (int iter = 0; iter < 20; ++iter) {
+        ibfs.ClearUnaries();
+        ibfs.AddConstantTerm(-ibfs.GetConstantTerm());
+        AddRandomUnaries(ibfs, rng, n);
+        ibfs.Solve();
+        BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
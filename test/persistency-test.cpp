@@ -0,0 +1,51 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "test-util.hpp"
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+
+BOOST_AUTO_TEST_SUITE(PersistencyTests)
+
+BOOST_AUTO_TEST_CASE(MatchesBruteForce) {
+    const int n = 12;
+    SoSGraph::NodeId fixed = 0;
+    for (int k = 3; k <= 4; ++k) {
+        for (Alg alg : { Alg::bidirectional, Alg::source }) {
+            for (int seed = 0; seed < 50; ++seed) {
+                std::mt19937 rng(seed);
+                SubmodularIBFSParams params(alg);
+                params.reducePersistent = true;
+                SubmodularIBFS ibfs(params);
+                ibfs.AddNode(n);
+                AddRandomUnaries(ibfs, rng, n, 60);
+                AddRandomCliques(ibfs, rng, n, k, 10);
+                ibfs.Solve();
+                BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+                fixed += ibfs.ReductionStats()->fixed;
+            }
+        }
+    }
+    // Strong unaries leave some nodes persistent
+    BOOST_CHECK(fixed > 0);
+}
+
+BOOST_AUTO_TEST_CASE(RepeatedSolves) {
+    // Persistent nodes are found again on each solve, with new unaries
+    const int n = 12;
+    std::mt19937 rng(11);
+    SubmodularIBFSParams params(Alg::bidirectional);
+    params.reducePersistent = true;
+    SubmodularIBFS ibfs(params);
+    ibfs.AddNode(n);
+    AddRandomCliques(ibfs, rng, n, 3, 10);
+    for (int iter = 0; iter < 20; ++iter) {
+        ibfs.ClearUnaries();
+        ibfs.AddConstantTerm(-ibfs.GetConstantTerm());
+        AddRandomUnaries(ibfs, rng, n, 60);
+        ibfs.Solve();
+        BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,52 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "test-util.hpp"
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+typedef SoSGraph::NodeOrder NodeOrder;
+
+BOOST_AUTO_TEST_SUITE(ReorderTests)
+
+BOOST_AUTO_TEST_CASE(MatchesBruteForce) {
+    const int n = 12;
+    for (NodeOrder order : { NodeOrder::bfs, NodeOrder::rcm }) {
+        for (int seed = 0; seed < 30; ++seed) {
+            std::mt19937 rng(seed);
+            SubmodularIBFSParams params(Alg::bidirectional);
+            params.pairwiseFastPath = false;
+            params.nodeOrder = order;
+            SubmodularIBFS ibfs(params);
+            ibfs.AddNode(n);
+            AddRandomUnaries(ibfs, rng, n);
+            AddRandomCliques(ibfs, rng, n, 3, 15);
+            ibfs.Solve();
+            BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+            // GetLabel takes the ids the nodes were added with
+            std::vector<int> labels(n);
+            for (int i = 0; i < n; ++i)
+                labels[i] = ibfs.GetLabel(i);
+            BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(labels), ibfs.ComputeEnergy());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(RepeatedSolves) {
+    const int n = 12;
+    std::mt19937 rng(7);
+    SubmodularIBFSParams params(Alg::bidirectional);
+    params.pairwiseFastPath = false;
+    params.nodeOrder = NodeOrder::rcm;
+    SubmodularIBFS ibfs(params);
+    ibfs.AddNode(n);
+    AddRandomCliques(ibfs, rng, n, 3, 15);
+    for (int iter = 0; iter < 10; ++iter) {
+        ibfs.ClearUnaries();
+        ibfs.AddConstantTerm(-ibfs.GetConstantTerm());
+        AddRandomUnaries(ibfs, rng, n);
+        ibfs.Solve();
+        BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
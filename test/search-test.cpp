@@ -0,0 +1,93 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "test-util.hpp"
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+
+BOOST_AUTO_TEST_SUITE(SearchTests)
+
+BOOST_AUTO_TEST_CASE(GlobalRelabelMatchesBruteForce) {
+    const int n = 12;
+    size_t globalRelabels = 0;
+    for (double freq : { 0.0, 0.1, 1.0 }) {
+        for (Alg alg : { Alg::bidirectional, Alg::source }) {
+            for (int k = 2; k <= 4; ++k) {
+                for (int seed = 0; seed < 30; ++seed) {
+                    std::mt19937 rng(seed);
+                    SubmodularIBFSParams params(alg);
+                    params.pairwiseFastPath = false;
+                    params.globalRelabelFreq = freq;
+                    SubmodularIBFS ibfs(params);
+                    ibfs.AddNode(n);
+                    AddRandomUnaries(ibfs, rng, n);
+                    AddRandomCliques(ibfs, rng, n, k, 20);
+                    ibfs.Solve();
+                    BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+                    globalRelabels += ibfs.SearchStats()->globalRelabels;
+                    if (freq == 0)
+                        BOOST_CHECK_EQUAL(ibfs.SearchStats()->globalRelabels, 0u);
+                }
+            }
+        }
+    }
+    BOOST_CHECK(globalRelabels > 0);
+}
+
+BOOST_AUTO_TEST_CASE(InitialSearchMatchesBruteForce) {
+    const int n = 12;
+    for (bool concurrent : { false, true }) {
+        for (int threads : { 1, 2, 4 }) {
+            for (int k = 2; k <= 4; ++k) {
+                for (int seed = 0; seed < 20; ++seed) {
+                    std::mt19937 rng(seed);
+                    SubmodularIBFSParams params(Alg::bidirectional);
+                    params.pairwiseFastPath = false;
+                    params.parallelInitialSearch = true;
+                    params.concurrentInitialTrees = concurrent;
+                    params.numThreads = threads;
+                    SubmodularIBFS ibfs(params);
+                    ibfs.AddNode(n);
+                    AddRandomUnaries(ibfs, rng, n);
+                    AddRandomCliques(ibfs, rng, n, k, 20);
+                    ibfs.Solve();
+                    BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(CapacityScalingMatchesBruteForce) {
+    const int n = 12;
+    for (int k = 2; k <= 4; ++k) {
+        for (int seed = 0; seed < 30; ++seed) {
+            std::mt19937 rng(seed);
+            SubmodularIBFSParams params(Alg::bidirectional);
+            params.pairwiseFastPath = false;
+            params.capacityScaling = true;
+            SubmodularIBFS ibfs(params);
+            ibfs.AddNode(n);
+            AddRandomUnaries(ibfs, rng, n, 1000);
+            AddRandomCliques(ibfs, rng, n, k, 20);
+            ibfs.Solve();
+            BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(StatsAreCounted) {
+    const int n = 12;
+    std::mt19937 rng(3);
+    SubmodularIBFSParams params(Alg::bidirectional);
+    params.pairwiseFastPath = false;
+    params.reducePersistent = false;
+    SubmodularIBFS ibfs(params);
+    ibfs.AddNode(n);
+    AddRandomUnaries(ibfs, rng, n);
+    AddRandomCliques(ibfs, rng, n, 3, 20);
+    ibfs.Solve();
+    BOOST_CHECK(ibfs.SearchStats()->arcScans > 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,464 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "sospd.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <random>
+
+typedef MultilabelEnergy::CliquePtr CliquePtr;
+typedef MultilabelEnergy::VarId VarId;
+typedef MultilabelEnergy::Label Label;
+
+/** Random unaries on a width x width grid with Potts cliques of size 3 over
+ * every row and column run
+ */
+static void AddPottsGrid(MultilabelEnergy& energy, int width, int numLabels, std::mt19937& rng) {
+    const int n = width*width;
+    energy.addVar(n);
+    std::uniform_int_distribution<int> cost(0, 100);
+    for (int i = 0; i < n; ++i) {
+        std::vector<REAL> unary(numLabels);
+        for (REAL& u : unary)
+            u = cost(rng);
+        energy.addUnaryTerm(i, unary);
+    }
+    for (int dir = 0; dir < 2; ++dir) {
+        for (int y = 0; y < width; ++y) {
+            for (int x = 0; x + 3 <= width; ++x) {
+                std::vector<VarId> nodes;
+                for (int j = 0; j < 3; ++j)
+                    nodes.push_back(dir ? (x + j)*width + y : y*width + x + j);
+                energy.addClique(CliquePtr(new PottsClique<3>(nodes, 0, 30)));
+            }
+        }
+    }
+}
+
+static REAL Energy(const MultilabelEnergy& energy, const SoSPD<>& sospd) {
+    std::vector<Label> labels(energy.numVars());
+    for (size_t i = 0; i < labels.size(); ++i)
+        labels[i] = sospd.GetLabel(i);
+    return energy.computeEnergy(labels);
+}
+
+/** All duals, by clique, position in the clique and label */
+static void Duals(const MultilabelEnergy& energy, const SoSPD<>& sospd, std::vector<REAL>& duals) {
+    duals.clear();
+    const auto& cliques = energy.cliques();
+    for (size_t c = 0; c < cliques.size(); ++c)
+        for (size_t j = 0; j < cliques[c]->size(); ++j)
+            for (Label l = 0; l < energy.numLabels(); ++l)
+                duals.push_back(sospd.dualVariable(c, j, l));
+}
+
+BOOST_AUTO_TEST_SUITE(SoSPDTests)
+
+BOOST_AUTO_TEST_CASE(AlphaExpansionMatchesCycling) {
+    // Alpha-expansion stops once a cycle of labels makes no progress, which
+    // must give the same labeling as cycling through the labels for the
+    // whole budget
+    const int width = 8;
+    const int niters = 60;
+    for (int seed = 0; seed < 10; ++seed) {
+        const int numLabels = 3 + seed % 4;
+        std::mt19937 rng(seed);
+        MultilabelEnergy energy(numLabels);
+        AddPottsGrid(energy, width, numLabels, rng);
+        SubmodularIBFSParams params;
+        SoSPD<> expansion(&energy, params);
+        expansion.SetAlphaExpansion();
+        expansion.Solve(niters);
+        SoSPD<> cycling(&energy, params);
+        cycling.SetProposalCallback([&](int iter, const std::vector<Label>&, std::vector<Label>& fusion) {
+            std::fill(fusion.begin(), fusion.end(), iter % numLabels);
+        });
+        cycling.Solve(niters);
+        BOOST_CHECK_EQUAL(Energy(energy, expansion), Energy(energy, cycling));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(AlphaExpansionStopsWithManyLabels) {
+    // With many labels the duals keep moving long after the labeling has
+    // settled, and Solve must still stop well within the budget, at the
+    // energy that cycling through the labels for the whole budget reaches
+    const int width = 10;
+    const int niters = 400;
+    for (int seed = 0; seed < 4; ++seed) {
+        const int numLabels = 30 + 10 * (seed % 2);
+        std::mt19937 rng(seed);
+        MultilabelEnergy energy(numLabels);
+        AddPottsGrid(energy, width, numLabels, rng);
+        SubmodularIBFSParams params;
+        SoSPD<> expansion(&energy, params);
+        expansion.SetAlphaExpansion();
+        int iters = 0;
+        expansion.SetProgressCallback([&](int iter, REAL) { iters = iter; });
+        expansion.Solve(niters);
+        BOOST_CHECK_LT(iters, niters / 2);
+        SoSPD<> cycling(&energy, params);
+        cycling.SetProposalCallback([&](int iter, const std::vector<Label>&, std::vector<Label>& fusion) {
+            std::fill(fusion.begin(), fusion.end(), iter % numLabels);
+        });
+        cycling.Solve(niters);
+        BOOST_CHECK_EQUAL(Energy(energy, expansion), Energy(energy, cycling));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(CandidateLabelsMatchAllLabels) {
+    // Each node has a few cheap labels, drawn from the last few labels, and
+    // the others are far too expensive to use, so keeping only the cheap
+    // ones as candidates must not change the result. Most alphas, label 0
+    // first, are then a candidate of no node, and Solve must move on past
+    // them
+    const int niters = 400;
+    const int numShared = 6;
+    for (int seed = 0; seed < 4; ++seed) {
+        const int width = (seed % 2) ? 8 : 4;
+        const int numLabels = (seed % 2) ? 30 : 50;
+        const int numCheap = (seed % 2) ? 4 : 2;
+        std::mt19937 rng(seed);
+        MultilabelEnergy energy(numLabels);
+        const int n = width*width;
+        energy.addVar(n);
+        std::uniform_int_distribution<int> cost(0, 100);
+        std::vector<Label> order(numShared);
+        for (int l = 0; l < numShared; ++l)
+            order[l] = numLabels - numShared + l;
+        for (int i = 0; i < n; ++i) {
+            std::vector<REAL> unary(numLabels, 10000);
+            std::shuffle(order.begin(), order.end(), rng);
+            for (int j = 0; j < numCheap; ++j)
+                unary[order[j]] = cost(rng);
+            energy.addUnaryTerm(i, unary);
+        }
+        for (int dir = 0; dir < 2; ++dir) {
+            for (int y = 0; y < width; ++y) {
+                for (int x = 0; x + 3 <= width; ++x) {
+                    std::vector<VarId> nodes;
+                    for (int j = 0; j < 3; ++j)
+                        nodes.push_back(dir ? (x + j)*width + y : y*width + x + j);
+                    energy.addClique(CliquePtr(new PottsClique<3>(nodes, 0, 30)));
+                }
+            }
+        }
+        SubmodularIBFSParams params;
+        SoSPD<> candidates(&energy, params);
+        candidates.SetAlphaExpansion();
+        candidates.SetCandidateLabels(numCheap);
+        candidates.Solve(niters);
+        SoSPD<> all(&energy, params);
+        all.SetAlphaExpansion();
+        all.Solve(niters);
+        BOOST_CHECK_EQUAL(Energy(energy, candidates), Energy(energy, all));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(InterruptedAlphaExpansionResumes) {
+    // Solves interrupted at growing timeouts and then resumed must end
+    // where a single uninterrupted Solve does, and not stop early
+    const int width = 8;
+    for (int seed = 0; seed < 5; ++seed) {
+        const int numLabels = 4;
+        std::mt19937 rng(seed);
+        MultilabelEnergy energy(numLabels);
+        AddPottsGrid(energy, width, numLabels, rng);
+        SubmodularIBFSParams params;
+        SoSPD<> whole(&energy, params);
+        whole.SetAlphaExpansion();
+        whole.Solve(1000);
+        SoSPD<> resumed(&energy, params);
+        resumed.SetAlphaExpansion();
+        int interrupts = 0;
+        for (int attempt = 1; ; ++attempt) {
+            SolveToken token;
+            token.SetTimeout(1e-4 * attempt);
+            if (resumed.Solve(1000, token))
+                break;
+            interrupts++;
+        }
+        BOOST_CHECK_EQUAL(Energy(energy, resumed), Energy(energy, whole));
+        BOOST_TEST_MESSAGE("seed " << seed << ": " << interrupts << " interrupts");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ParallelPassesMatchSerial) {
+    // The grid has enough cliques for the per-clique passes to split into
+    // several chunks, which must give the same result as one thread
+    const int width = 40;
+    const int numLabels = 4;
+    for (int seed = 0; seed < 2; ++seed) {
+        std::mt19937 rng(seed);
+        MultilabelEnergy energy(numLabels);
+        AddPottsGrid(energy, width, numLabels, rng);
+        SubmodularIBFSParams serialParams;
+        SoSPD<> serial(&energy, serialParams);
+        serial.SetAlphaExpansion();
+        serial.Solve(12);
+        SubmodularIBFSParams parallelParams;
+        parallelParams.numThreads = 4;
+        SoSPD<> parallel(&energy, parallelParams);
+        parallel.SetAlphaExpansion();
+        parallel.Solve(12);
+        for (VarId i = 0; i < energy.numVars(); ++i)
+            BOOST_REQUIRE_EQUAL(parallel.GetLabel(i), serial.GetLabel(i));
+        BOOST_CHECK_EQUAL(Energy(energy, parallel), Energy(energy, serial));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(FusedDualUpdateMatchesPostEdit) {
+    const int width = 8;
+    for (int seed = 0; seed < 6; ++seed) {
+        const int numLabels = 3 + seed % 3;
+        std::mt19937 rng(seed);
+        MultilabelEnergy energy(numLabels);
+        AddPottsGrid(energy, width, numLabels, rng);
+        SubmodularIBFSParams params;
+        SoSPD<> fused(&energy, params);
+        fused.SetAlphaExpansion();
+        fused.Solve(60);
+        SoSPD<> unfused(&energy, params);
+        unfused.SetAlphaExpansion();
+        unfused.SetFusedDualUpdate(false);
+        unfused.Solve(60);
+        for (VarId i = 0; i < energy.numVars(); ++i)
+            BOOST_REQUIRE_EQUAL(fused.GetLabel(i), unfused.GetLabel(i));
+        BOOST_CHECK_EQUAL(Energy(energy, fused), Energy(energy, unfused));
+    }
+}
+
+template <int Degree>
+static void CheckPottsFusionTable(std::mt19937& rng) {
+    // Few labels, so that current and proposed labels often agree
+    std::uniform_int_distribution<int> label(0, 2);
+    std::uniform_int_distribution<int> cost(0, 50);
+    std::vector<VarId> nodes(Degree);
+    for (int i = 0; i < Degree; ++i)
+        nodes[i] = i;
+    for (int trial = 0; trial < 200; ++trial) {
+        const REAL same = cost(rng);
+        PottsClique<Degree> clique(nodes, same, same + cost(rng));
+        Label current[Degree], proposed[Degree];
+        for (int i = 0; i < Degree; ++i) {
+            current[i] = label(rng);
+            proposed[i] = label(rng);
+        }
+        std::vector<REAL> fast(1 << Degree), gray(1 << Degree);
+        clique.fusionTable(current, proposed, fast.data());
+        clique.Clique::fusionTable(current, proposed, gray.data());
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(fast.begin(), fast.end(),
+                gray.begin(), gray.end());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(PottsFusionTableMatchesDefault) {
+    std::mt19937 rng(0);
+    CheckPottsFusionTable<2>(rng);
+    CheckPottsFusionTable<3>(rng);
+    CheckPottsFusionTable<4>(rng);
+    CheckPottsFusionTable<5>(rng);
+}
+
+BOOST_AUTO_TEST_CASE(HeightScoresMatchRecompute) {
+    // Best-height alpha-expansion keeps its label scores up to date from
+    // iteration to iteration. A second solver picks alpha the same way,
+    // but from heights recomputed from the duals each time, and the two
+    // must stay in step. The heights of the current labels must also add
+    // up to the energy after every iteration
+    const int width = 6;
+    for (int seed = 0; seed < 4; ++seed) {
+        const int numLabels = 3 + seed;
+        std::mt19937 rng(seed);
+        MultilabelEnergy energy(numLabels);
+        AddPottsGrid(energy, width, numLabels, rng);
+        const VarId n = energy.numVars();
+        const auto& cliques = energy.cliques();
+        SubmodularIBFSParams params;
+        SoSPD<> incremental(&energy, params);
+        incremental.SetHeightAlphaExpansion();
+        bool energyMatches = true;
+        incremental.SetProgressCallback([&](int, REAL reported) {
+            if (reported != Energy(energy, incremental))
+                energyMatches = false;
+        });
+        SoSPD<> recomputed(&energy, params);
+        const SoSPD<>& duals = recomputed;
+        recomputed.SetProposalCallback([&](int, const std::vector<Label>& current, std::vector<Label>& fusion) {
+            std::vector<REAL> height(n*numLabels);
+            for (VarId i = 0; i < n; ++i)
+                for (int l = 0; l < numLabels; ++l)
+                    height[i*numLabels+l] = energy.unary(i, l);
+            for (size_t c = 0; c < cliques.size(); ++c)
+                for (size_t j = 0; j < cliques[c]->size(); ++j)
+                    for (int l = 0; l < numLabels; ++l)
+                        height[cliques[c]->nodes()[j]*numLabels+l] += duals.dualVariable(c, j, l);
+            REAL best = 0;
+            Label alpha = 0;
+            for (int l = 0; l < numLabels; ++l) {
+                REAL score = 0;
+                for (VarId i = 0; i < n; ++i)
+                    score += std::max<REAL>(0, height[i*numLabels+current[i]] - height[i*numLabels+l]);
+                if (score > best) {
+                    best = score;
+                    alpha = l;
+                }
+            }
+            std::fill(fusion.begin(), fusion.end(), alpha);
+        });
+        for (int iter = 0; iter < 30; ++iter) {
+            incremental.Solve(1);
+            recomputed.Solve(1);
+            for (VarId i = 0; i < n; ++i)
+                BOOST_REQUIRE_EQUAL(incremental.GetLabel(i), recomputed.GetLabel(i));
+        }
+        BOOST_CHECK(energyMatches);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(BoundsBelowOptimum) {
+    // On grids small enough to enumerate, LowerBound must never exceed the
+    // optimum, and a Solve that stops on its gap target must be within the
+    // gap of the optimum. The gap target is checked against LowerBound
+    // after the first iteration and NearbyLowerBound after that
+    const int width = 3;
+    const int numLabels = 3;
+    const double gaps[] = { 0.02, 0.05, 0.1, 0.2, 0.3 };
+    int gapStops = 0;
+    for (int seed = 0; seed < 6; ++seed) {
+        std::mt19937 rng(seed);
+        MultilabelEnergy energy(numLabels);
+        AddPottsGrid(energy, width, numLabels, rng);
+        const VarId n = energy.numVars();
+        std::vector<Label> labels(n, 0);
+        REAL optimum = std::numeric_limits<REAL>::max();
+        while (true) {
+            optimum = std::min(optimum, energy.computeEnergy(labels));
+            VarId i = 0;
+            while (i < n && ++labels[i] == Label(numLabels))
+                labels[i++] = 0;
+            if (i == n)
+                break;
+        }
+        SubmodularIBFSParams params;
+        SoSPD<> plain(&energy, params);
+        plain.SetAlphaExpansion();
+        int plainIters = 0;
+        plain.SetProgressCallback([&](int iter, REAL) {
+            plainIters = iter;
+            BOOST_CHECK_LE(plain.LowerBound(), optimum);
+        });
+        plain.Solve(100);
+        for (double gap : gaps) {
+            SoSPD<> gapped(&energy, params);
+            gapped.SetAlphaExpansion();
+            gapped.SetGapTarget(gap);
+            int gappedIters = 0;
+            gapped.SetProgressCallback([&](int iter, REAL) { gappedIters = iter; });
+            gapped.Solve(100);
+            if (gappedIters < plainIters) {
+                const REAL e = Energy(energy, gapped);
+                BOOST_CHECK_LE(e - optimum, gap * e);
+                gapStops++;
+            }
+        }
+    }
+    BOOST_TEST_MESSAGE(gapStops << " solves stopped on the gap target");
+}
+
+BOOST_AUTO_TEST_CASE(SpeculativeStepMatchesPlainStep) {
+    // The move a speculative step keeps must be the one a plain step with
+    // the same alpha makes. Apart from the duals at the old labels, which
+    // the post-edit correction adjusts, a step only changes duals at alpha,
+    // so alpha is read off those
+    const int width = 8;
+    for (int seed = 0; seed < 4; ++seed) {
+        const int numLabels = 4 + seed;
+        std::mt19937 rng(seed);
+        MultilabelEnergy energy(numLabels);
+        AddPottsGrid(energy, width, numLabels, rng);
+        const VarId n = energy.numVars();
+        const auto& cliques = energy.cliques();
+        SubmodularIBFSParams params;
+        SoSPD<> speculative(&energy, params);
+        speculative.SetSpeculativeProposals(3);
+        Label alpha = 0;
+        SoSPD<> plain(&energy, params);
+        plain.SetProposalCallback([&](int, const std::vector<Label>&, std::vector<Label>& fusion) {
+            std::fill(fusion.begin(), fusion.end(), alpha);
+        });
+        // Solve(0) only sets up the duals
+        speculative.Solve(0);
+        plain.Solve(0);
+        std::vector<Label> labels(n);
+        std::vector<REAL> before, after, plainDuals;
+        int steps = 0;
+        for (int iter = 0; iter < 30; ++iter) {
+            for (VarId i = 0; i < n; ++i)
+                labels[i] = speculative.GetLabel(i);
+            Duals(energy, speculative, before);
+            speculative.Solve(1);
+            Duals(energy, speculative, after);
+            bool found = false;
+            size_t d = 0;
+            for (size_t c = 0; c < cliques.size(); ++c) {
+                for (size_t j = 0; j < cliques[c]->size(); ++j) {
+                    for (int l = 0; l < numLabels; ++l, ++d) {
+                        if (Label(l) != labels[cliques[c]->nodes()[j]]
+                                && after[d] != before[d]) {
+                            alpha = l;
+                            found = true;
+                        }
+                    }
+                }
+            }
+            if (!found)
+                break;
+            plain.Solve(1);
+            steps++;
+            for (VarId i = 0; i < n; ++i)
+                BOOST_REQUIRE_EQUAL(speculative.GetLabel(i), plain.GetLabel(i));
+            Duals(energy, plain, plainDuals);
+            BOOST_REQUIRE(after == plainDuals);
+        }
+        BOOST_CHECK_GT(steps, 0);
+        BOOST_CHECK_EQUAL(Energy(energy, speculative), Energy(energy, plain));
+        BOOST_TEST_MESSAGE("seed " << seed << ": " << steps << " steps");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(FlatDualsMatchPerCliqueDuals) {
+    // Energies reached with the duals stored per clique, before they moved
+    // to a single buffer, for best-height alpha-expansion, cycling through
+    // the labels, and cycling with 4 candidate labels refreshed every 5
+    // iterations
+    const REAL expected[3][4] = {
+        { 4745, 4177, 4349, 4186 },
+        { 4745, 4177, 4358, 4186 },
+        { 5036, 4807, 4933, 5189 },
+    };
+    const int width = 10;
+    for (int mode = 0; mode < 3; ++mode) {
+        for (int seed = 0; seed < 4; ++seed) {
+            const int numLabels = 5 + 3*seed;
+            std::mt19937 rng(seed);
+            MultilabelEnergy energy(numLabels);
+            AddPottsGrid(energy, width, numLabels, rng);
+            SubmodularIBFSParams params;
+            SoSPD<> sospd(&energy, params);
+            if (mode == 0) {
+                sospd.SetHeightAlphaExpansion();
+            } else {
+                sospd.SetProposalCallback([&](int iter, const std::vector<Label>&, std::vector<Label>& fusion) {
+                    std::fill(fusion.begin(), fusion.end(), iter % numLabels);
+                });
+            }
+            if (mode == 2)
+                sospd.SetCandidateLabels(4, 5);
+            sospd.Solve(30);
+            BOOST_CHECK_EQUAL(Energy(energy, sospd), expected[mode][seed]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,99 @@
+#ifndef _TEST_UTIL_HPP_
+#define _TEST_UTIL_HPP_
+
+/** \file test-util.hpp
+ * Random small energies, and their minimum by brute force
+ */
+
+#include "submodular-ibfs.hpp"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+/** Random unary terms on nodes [0, n), with costs in [-range, range] */
+inline void AddRandomUnaries(SubmodularIBFS& ibfs, std::mt19937& rng, int n, int range = 30) {
+    std::uniform_int_distribution<int> cost(-range, range);
+    for (int i = 0; i < n; ++i)
+        ibfs.AddUnaryTerm(i, cost(rng), cost(rng));
+}
+
+/** k distinct random nodes in [0, n) */
+inline std::vector<SubmodularIBFS::NodeId> RandomNodes(std::mt19937& rng, int n, int k) {
+    std::vector<SubmodularIBFS::NodeId> nodes;
+    while (int(nodes.size()) < k) {
+        SubmodularIBFS::NodeId i = rng() % n;
+        if (std::find(nodes.begin(), nodes.end(), i) == nodes.end())
+            nodes.push_back(i);
+    }
+    return nodes;
+}
+
+/** Random submodular energy table for a clique of size k: a concave
+ * function of the number of nodes of a random subset in S, plus a modular
+ * part
+ */
+inline std::vector<REAL> RandomSubmodularTable(std::mt19937& rng, int k) {
+    const uint32_t mask = 1 + rng() % ((1 << k) - 1);
+    const int weight = 1 + rng() % 10;
+    const int cap = 1 + rng() % k;
+    std::vector<int> modular(k);
+    for (int& m : modular)
+        m = rng() % 10;
+    std::vector<REAL> table(1 << k);
+    for (uint32_t a = 0; a < table.size(); ++a) {
+        const int count = __builtin_popcount(a & mask);
+        table[a] = weight * std::min(count, cap) * std::min(__builtin_popcount(mask) - count, cap);
+        for (int j = 0; j < k; ++j) {
+            if (a & (1 << j))
+                table[a] += modular[j];
+        }
+    }
+    return table;
+}
+
+/** Add count random submodular cliques of size k on nodes [0, n) */
+inline void AddRandomCliques(SubmodularIBFS& ibfs, std::mt19937& rng, int n, int k, int count) {
+    for (int c = 0; c < count; ++c)
+        ibfs.AddClique(RandomNodes(rng, n, k), RandomSubmodularTable(rng, k));
+}
+
+/** Add count random submodular cliques of size k that form a hypertree:
+ * each clique after the first shares between 1 and k-1 nodes with an
+ * earlier one, and has new nodes otherwise. Adds the nodes too, and
+ * returns their number
+ */
+inline int AddRandomHypertree(SubmodularIBFS& ibfs, std::mt19937& rng, int k, int count) {
+    std::vector<std::vector<SubmodularIBFS::NodeId>> cliques;
+    int n = 0;
+    for (int c = 0; c < count; ++c) {
+        std::vector<SubmodularIBFS::NodeId> nodes;
+        if (c > 0) {
+            const auto& parent = cliques[rng() % cliques.size()];
+            const int shared = 1 + rng() % (k - 1);
+            for (int p : RandomNodes(rng, k, shared))
+                nodes.push_back(parent[p]);
+        }
+        while (int(nodes.size()) < k)
+            nodes.push_back(n++);
+        cliques.push_back(nodes);
+    }
+    ibfs.AddNode(n);
+    for (const auto& nodes : cliques)
+        ibfs.AddClique(nodes, RandomSubmodularTable(rng, k));
+    return n;
+}
+
+/** Least energy of any labeling of the n nodes of ibfs */
+inline REAL BruteForceMin(const SubmodularIBFS& ibfs, int n) {
+    REAL best = std::numeric_limits<REAL>::max();
+    std::vector<int> labels(n);
+    for (uint32_t a = 0; a < (1u << n); ++a) {
+        for (int i = 0; i < n; ++i)
+            labels[i] = (a >> i) & 1;
+        best = std::min(best, ibfs.ComputeEnergy(labels));
+    }
+    return best;
+}
+
+#endif
@@ -0,0 +1,97 @@
+#define BOOST_TEST_DYN_LINK
+#include <boost/test/unit_test.hpp>
+
+#include "test-util.hpp"
+#include "flow-solver.hpp"
+
+typedef SubmodularIBFSParams::FlowAlgorithm Alg;
+
+BOOST_AUTO_TEST_SUITE(TreeDPTests)
+
+BOOST_AUTO_TEST_CASE(HypertreeMatchesBruteForce) {
+    for (int k = 2; k <= 4; ++k) {
+        for (int seed = 0; seed < 50; ++seed) {
+            std::mt19937 rng(seed);
+            SubmodularIBFSParams params(Alg::tree_dp);
+            params.pairwiseFastPath = false;
+            SubmodularIBFS ibfs(params);
+            const int n = AddRandomHypertree(ibfs, rng, k, 5);
+            AddRandomUnaries(ibfs, rng, n);
+            ibfs.Graph().Freeze();
+            BOOST_CHECK(TreeDP{}.IsHypertree(ibfs.Graph()));
+            ibfs.Solve();
+            BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ForestAndLooseNodes) {
+    // Two separate hypertrees, and nodes in no clique
+    for (int seed = 0; seed < 50; ++seed) {
+        std::mt19937 rng(seed);
+        SubmodularIBFSParams params(Alg::tree_dp);
+        params.pairwiseFastPath = false;
+        SubmodularIBFS ibfs(params);
+        const int n1 = AddRandomHypertree(ibfs, rng, 3, 2);
+        const int n2 = AddRandomHypertree(ibfs, rng, 3, 2);
+        // The second tree reuses the ids of the first, so shift it
+        const int n = n1 + n2 + 2;
+        SubmodularIBFS forest(params);
+        forest.AddNode(n);
+        const auto& cliques = ibfs.Graph().GetCliques();
+        for (size_t c = 0; c < cliques.size(); ++c) {
+            auto nodes = cliques[c].Nodes();
+            if (c >= 2) {
+                for (auto& i : nodes)
+                    i += n1;
+            }
+            forest.AddClique(nodes, cliques[c].EnergyTable());
+        }
+        AddRandomUnaries(forest, rng, n);
+        forest.Solve();
+        BOOST_CHECK_EQUAL(forest.ComputeEnergy(), BruteForceMin(forest, n));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(CycleFallsBack) {
+    // A cycle of cliques is not a hypertree, and is solved by IBFS instead
+    const int n = 12;
+    for (int k = 2; k <= 3; ++k) {
+        for (int seed = 0; seed < 50; ++seed) {
+            std::mt19937 rng(seed);
+            SubmodularIBFSParams params(Alg::tree_dp);
+            params.pairwiseFastPath = false;
+            SubmodularIBFS ibfs(params);
+            ibfs.AddNode(n);
+            for (int c = 0; c < n; c += k - 1) {
+                std::vector<SubmodularIBFS::NodeId> nodes;
+                for (int j = 0; j < k; ++j)
+                    nodes.push_back((c + j) % n);
+                ibfs.AddClique(nodes, RandomSubmodularTable(rng, k));
+            }
+            AddRandomUnaries(ibfs, rng, n);
+            ibfs.Graph().Freeze();
+            BOOST_CHECK(!TreeDP{}.IsHypertree(ibfs.Graph()));
+            ibfs.Solve();
+            BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(RandomMatchesBruteForce) {
+    // Random cliques, which may or may not form a hypertree
+    const int n = 12;
+    for (int seed = 0; seed < 50; ++seed) {
+        std::mt19937 rng(seed);
+        SubmodularIBFSParams params(Alg::tree_dp);
+        params.pairwiseFastPath = false;
+        SubmodularIBFS ibfs(params);
+        ibfs.AddNode(n);
+        AddRandomUnaries(ibfs, rng, n);
+        AddRandomCliques(ibfs, rng, n, 3, 4);
+        ibfs.Solve();
+        BOOST_CHECK_EQUAL(ibfs.ComputeEnergy(), BruteForceMin(ibfs, n));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()